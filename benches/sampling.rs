@@ -0,0 +1,44 @@
+use criterion::{black_box, criterion_group, criterion_main, Criterion};
+use mptgen::sampling::{self, BasicSampler, Mirostat, Sampler};
+use rand::rngs::StdRng;
+use rand::SeedableRng;
+
+const N_VOCAB: usize = 50432;
+
+// a few likely tokens over a long tail, like the logits of a model
+fn logits() -> Vec<f32> {
+    let mut state = 0x2545f4914f6cdd1d_u64;
+    (0..N_VOCAB)
+        .map(|i| {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            let u = (state >> 40) as f32 / (1 << 24) as f32;
+            let peak = if i % 997 == 0 { 8.0 } else { 0.0 };
+            u * 6.0 - 3.0 + peak
+        })
+        .collect()
+}
+
+fn bench_samplers(c: &mut Criterion) {
+    let logits = logits();
+    let mut rng = StdRng::seed_from_u64(0);
+    c.bench_function("greedy", |b| {
+        b.iter(|| sampling::greedy(black_box(&logits)))
+    });
+    let mut basic = BasicSampler::new().temperature(Some(0.8));
+    c.bench_function("basic temperature=0.8", |b| {
+        b.iter(|| basic.sample(black_box(&logits), &mut rng))
+    });
+    let mut top_k = BasicSampler::new().temperature(Some(0.8)).top_k(Some(40));
+    c.bench_function("basic temperature=0.8 top_k=40", |b| {
+        b.iter(|| top_k.sample(black_box(&logits), &mut rng))
+    });
+    let mut mirostat = Mirostat::new();
+    c.bench_function("mirostat", |b| {
+        b.iter(|| mirostat.sample(black_box(&logits), &mut rng))
+    });
+}
+
+criterion_group!(benches, bench_samplers);
+criterion_main!(benches);
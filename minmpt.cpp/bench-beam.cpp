@@ -0,0 +1,201 @@
+// compares minmpt_beam_* with beam search over copied forks, each beam
+// evaluated on its own
+#include "minmpt.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+struct fork_beam {
+  minmpt_handle session;
+  std::vector<uint32_t> tokens;
+  float logprob;
+};
+
+struct bench_result {
+  double ms;
+  size_t peak_kv_bytes;
+  std::vector<uint32_t> best;
+};
+
+static double elapsed_ms(std::chrono::steady_clock::time_point t0) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - t0)
+      .count();
+}
+
+static bench_result bench_native(minmpt_handle base,
+                                 const std::vector<uint32_t> &prompt,
+                                 const minmpt_beam_params &params) {
+  bench_result result = {};
+  const auto t0 = std::chrono::steady_clock::now();
+  minmpt_beam_handle beam;
+  minmpt_beam_create(base, prompt.data(), prompt.size(), &params, &beam);
+  size_t n_live = 1;
+  while (n_live > 0) {
+    if (minmpt_beam_step(beam, &n_live) != MINMPT_OK) {
+      fprintf(stderr, "beam step failed\n");
+      exit(1);
+    }
+    // the pool is shared with base, which holds no blocks of its own
+    result.peak_kv_bytes =
+        std::max(result.peak_kv_bytes, minmpt_kv_bytes(base));
+  }
+  result.ms = elapsed_ms(t0);
+  const uint32_t *tokens;
+  size_t n_tokens;
+  if (minmpt_beam_result(beam, 0, &tokens, &n_tokens, nullptr) == MINMPT_OK) {
+    result.best.assign(tokens, tokens + n_tokens);
+  }
+  minmpt_beam_free(beam);
+  return result;
+}
+
+// the same search the way it is done without the beam api: every survivor
+// is a fork of its parent, copying the kv cache, and beams are evaluated
+// one after the other
+static bench_result bench_forks(minmpt_handle base,
+                                const std::vector<uint32_t> &prompt,
+                                const minmpt_beam_params &params) {
+  bench_result result = {};
+  const auto t0 = std::chrono::steady_clock::now();
+  const size_t n_vocab = minmpt_n_vocab(base);
+  std::vector<float> logits(n_vocab);
+  std::vector<fork_beam> live(1);
+  minmpt_fork(base, &live[0].session);
+  live[0].logprob = 0.0f;
+  std::vector<std::vector<float>> all_logits;
+  float best_score = -INFINITY;
+  for (size_t step = 0; step < params.max_tokens && !live.empty(); ++step) {
+    all_logits.assign(live.size(), std::vector<float>());
+    for (size_t i = 0; i < live.size(); ++i) {
+      const uint32_t *tokens =
+          step == 0 ? prompt.data() : &live[i].tokens.back();
+      const size_t n_tokens = step == 0 ? prompt.size() : 1;
+      minmpt_eval_logits(live[i].session, tokens, n_tokens, logits.data());
+      all_logits[i] = logits;
+    }
+    size_t kv_bytes = 0;
+    for (const auto &beam : live) {
+      kv_bytes += minmpt_kv_bytes(beam.session);
+    }
+    result.peak_kv_bytes = std::max(result.peak_kv_bytes, kv_bytes);
+
+    struct candidate {
+      size_t parent;
+      uint32_t token;
+      float logprob;
+    };
+    std::vector<candidate> candidates;
+    for (size_t i = 0; i < live.size(); ++i) {
+      const float *l = all_logits[i].data();
+      const float lmax = *std::max_element(l, l + n_vocab);
+      float sum = 0.0f;
+      for (size_t t = 0; t < n_vocab; ++t) {
+        sum += expf(l[t] - lmax);
+      }
+      for (size_t t = 0; t < n_vocab; ++t) {
+        candidates.push_back(
+            {i, (uint32_t)t, live[i].logprob + l[t] - lmax - logf(sum)});
+      }
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [](const candidate &a, const candidate &b) {
+                return a.logprob > b.logprob;
+              });
+    std::vector<fork_beam> next;
+    for (const auto &c : candidates) {
+      if (next.size() == params.n_beams) {
+        break;
+      }
+      if (c.token == params.eos_token) {
+        const float score =
+            c.logprob / powf(live[c.parent].tokens.size() + 1.0f,
+                             params.length_penalty);
+        if (score > best_score) {
+          best_score = score;
+          result.best = live[c.parent].tokens;
+        }
+        continue;
+      }
+      fork_beam beam;
+      minmpt_fork(live[c.parent].session, &beam.session);
+      beam.tokens = live[c.parent].tokens;
+      beam.tokens.push_back(c.token);
+      beam.logprob = c.logprob;
+      next.push_back(std::move(beam));
+    }
+    for (auto &beam : live) {
+      minmpt_free(beam.session);
+    }
+    live.swap(next);
+  }
+  for (auto &beam : live) {
+    const float score =
+        beam.logprob / powf(beam.tokens.size(), params.length_penalty);
+    if (score > best_score) {
+      best_score = score;
+      result.best = beam.tokens;
+    }
+    minmpt_free(beam.session);
+  }
+  result.ms = elapsed_ms(t0);
+  return result;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr,
+            "usage: %s model.bin [n_prompt] [n_gen] [block_size] [n_threads]\n",
+            argv[0]);
+    return 1;
+  }
+  const char *fname = argv[1];
+  const size_t n_prompt = argc > 2 ? atoi(argv[2]) : 256;
+  const size_t n_gen = argc > 3 ? atoi(argv[3]) : 32;
+  const int block_size = argc > 4 ? atoi(argv[4]) : 16;
+  const unsigned n_threads = argc > 5 ? atoi(argv[5]) : 4;
+
+  minmpt_params params = minmpt_default_params();
+  minmpt_handle dense, paged;
+  if (minmpt_load_with_params(&dense, fname, strlen(fname), &params) !=
+      MINMPT_OK) {
+    return 1;
+  }
+  params.kv_block_size = block_size;
+  if (minmpt_load_with_params(&paged, fname, strlen(fname), &params) !=
+      MINMPT_OK) {
+    return 1;
+  }
+  minmpt_set_n_threads(dense, n_threads);
+  minmpt_set_n_threads(paged, n_threads);
+
+  // a fixed pseudo-random prompt; no eos, so every run generates n_gen
+  std::vector<uint32_t> prompt;
+  const size_t n_vocab = minmpt_n_vocab(paged);
+  for (size_t i = 0; i < n_prompt; ++i) {
+    prompt.push_back(1 + (i * 37 + 11) % (n_vocab - 1));
+  }
+
+  printf("%6s %12s %12s %10s %12s %12s %8s\n", "beams", "native ms",
+         "forks ms", "speedup", "native MB", "forks MB", "same");
+  for (size_t n_beams = 4; n_beams <= 8; n_beams += 2) {
+    minmpt_beam_params beam_params = minmpt_beam_default_params();
+    beam_params.n_beams = n_beams;
+    beam_params.max_tokens = n_gen;
+    beam_params.eos_token = (uint32_t)-1;
+    const bench_result native = bench_native(paged, prompt, beam_params);
+    const bench_result forks = bench_forks(dense, prompt, beam_params);
+    printf("%6zu %12.1f %12.1f %9.2fx %12.1f %12.1f %8s\n", n_beams,
+           native.ms, forks.ms, forks.ms / native.ms,
+           native.peak_kv_bytes / 1048576.0, forks.peak_kv_bytes / 1048576.0,
+           native.best == forks.best ? "yes" : "no");
+  }
+  minmpt_free(dense);
+  minmpt_free(paged);
+  return 0;
+}
@@ -482,7 +482,20 @@ ggml_fp16_t ggml_fp32_to_fp16(float x) {
 }
 
 void ggml_fp16_to_fp32_row(const ggml_fp16_t * x, float * y, size_t n) {
-    for (size_t i = 0; i < n; i++) {
+    size_t i = 0;
+#if defined(__F16C__)
+    for (; i + 7 < n; i += 8) {
+        __m128i x_vec = _mm_loadu_si128((const __m128i *)(x + i));
+        __m256 y_vec = _mm256_cvtph_ps(x_vec);
+        _mm256_storeu_ps(y + i, y_vec);
+    }
+    for (; i + 3 < n; i += 4) {
+        __m128i x_vec = _mm_loadl_epi64((const __m128i *)(x + i));
+        __m128 y_vec = _mm_cvtph_ps(x_vec);
+        _mm_storeu_ps(y + i, y_vec);
+    }
+#endif
+    for (; i < n; i++) {
         y[i] = GGML_FP16_TO_FP32(x[i]);
     }
 }
@@ -3789,6 +3802,10 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "MAP_UNARY",
     "MAP_BINARY",
 
+    "MAP_CUSTOM1_F32",
+    "MAP_CUSTOM2_F32",
+    "MAP_CUSTOM3_F32",
+
     "MAP_CUSTOM1",
     "MAP_CUSTOM2",
     "MAP_CUSTOM3",
@@ -3797,7 +3814,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CROSS_ENTROPY_LOSS_BACK",
 };
 
-static_assert(GGML_OP_COUNT == 66, "GGML_OP_COUNT != 66");
+static_assert(GGML_OP_COUNT == 69, "GGML_OP_COUNT != 69");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -3867,6 +3884,10 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "f(x)",
     "f(x,y)",
 
+    "custom_f32(x)",
+    "custom_f32(x,y)",
+    "custom_f32(x,y,z)",
+
     "custom(x)",
     "custom(x,y)",
     "custom(x,y,z)",
@@ -3875,7 +3896,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "cross_entropy_loss_back(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 66, "GGML_OP_COUNT != 66");
+static_assert(GGML_OP_COUNT == 69, "GGML_OP_COUNT != 69");
 
 static_assert(sizeof(struct ggml_object)%GGML_MEM_ALIGN == 0, "ggml_object size must be a multiple of GGML_MEM_ALIGN");
 static_assert(sizeof(struct ggml_tensor)%GGML_MEM_ALIGN == 0, "ggml_tensor size must be a multiple of GGML_MEM_ALIGN");
@@ -7531,7 +7552,7 @@ struct ggml_tensor * ggml_map_custom1_impl_f32(
 
     ggml_scratch_load(ctx);
 
-    result->op = GGML_OP_MAP_CUSTOM1;
+    result->op = GGML_OP_MAP_CUSTOM1_F32;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
     result->src0 = a;
     result->opt[0] = addr_tensor;
@@ -7576,7 +7597,7 @@ struct ggml_tensor * ggml_map_custom2_impl_f32(
 
     ggml_scratch_load(ctx);
 
-    result->op = GGML_OP_MAP_CUSTOM2;
+    result->op = GGML_OP_MAP_CUSTOM2_F32;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
     result->src0 = a;
     result->src1 = b;
@@ -7625,7 +7646,7 @@ struct ggml_tensor * ggml_map_custom3_impl_f32(
 
     ggml_scratch_load(ctx);
 
-    result->op = GGML_OP_MAP_CUSTOM3;
+    result->op = GGML_OP_MAP_CUSTOM3_F32;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
     result->src0 = a;
     result->src1 = b;
@@ -7653,6 +7674,125 @@ struct ggml_tensor * ggml_map_custom3_inplace_f32(
     return ggml_map_custom3_impl_f32(ctx, a, b, c, fun, true);
 }
 
+// ggml_map_custom1 / ggml_map_custom2 / ggml_map_custom3
+
+struct ggml_map_custom_op_params {
+    union {
+        ggml_custom1_op_t f1;
+        ggml_custom2_op_t f2;
+        ggml_custom3_op_t f3;
+    } fun;
+    int    n_tasks;
+    void * userdata;
+};
+
+static struct ggml_tensor * ggml_map_custom_impl(
+        struct ggml_context * ctx,
+        enum   ggml_op        op,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c,
+        struct ggml_map_custom_op_params params,
+        bool   inplace) {
+    GGML_ASSERT(params.n_tasks == GGML_N_TASKS_MAX || params.n_tasks > 0);
+
+    bool is_node = false;
+
+    if (!inplace && (a->grad || (b && b->grad) || (c && c->grad))) {
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
+
+    ggml_scratch_save(ctx);
+
+    struct ggml_tensor * params_tensor = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, sizeof(struct ggml_map_custom_op_params));
+    memcpy(params_tensor->data, &params, sizeof(params));
+
+    ggml_scratch_load(ctx);
+
+    result->op = op;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0 = a;
+    result->src1 = b;
+    result->opt[0] = params_tensor;
+    result->opt[1] = c;
+
+    return result;
+}
+
+struct ggml_tensor * ggml_map_custom1(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        ggml_custom1_op_t     fun,
+        int                   n_tasks,
+        void                * userdata) {
+    struct ggml_map_custom_op_params params = { .n_tasks = n_tasks, .userdata = userdata };
+    params.fun.f1 = fun;
+    return ggml_map_custom_impl(ctx, GGML_OP_MAP_CUSTOM1, a, NULL, NULL, params, false);
+}
+
+struct ggml_tensor * ggml_map_custom1_inplace(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        ggml_custom1_op_t     fun,
+        int                   n_tasks,
+        void                * userdata) {
+    struct ggml_map_custom_op_params params = { .n_tasks = n_tasks, .userdata = userdata };
+    params.fun.f1 = fun;
+    return ggml_map_custom_impl(ctx, GGML_OP_MAP_CUSTOM1, a, NULL, NULL, params, true);
+}
+
+struct ggml_tensor * ggml_map_custom2(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        ggml_custom2_op_t     fun,
+        int                   n_tasks,
+        void                * userdata) {
+    struct ggml_map_custom_op_params params = { .n_tasks = n_tasks, .userdata = userdata };
+    params.fun.f2 = fun;
+    return ggml_map_custom_impl(ctx, GGML_OP_MAP_CUSTOM2, a, b, NULL, params, false);
+}
+
+struct ggml_tensor * ggml_map_custom2_inplace(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        ggml_custom2_op_t     fun,
+        int                   n_tasks,
+        void                * userdata) {
+    struct ggml_map_custom_op_params params = { .n_tasks = n_tasks, .userdata = userdata };
+    params.fun.f2 = fun;
+    return ggml_map_custom_impl(ctx, GGML_OP_MAP_CUSTOM2, a, b, NULL, params, true);
+}
+
+struct ggml_tensor * ggml_map_custom3(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c,
+        ggml_custom3_op_t     fun,
+        int                   n_tasks,
+        void                * userdata) {
+    struct ggml_map_custom_op_params params = { .n_tasks = n_tasks, .userdata = userdata };
+    params.fun.f3 = fun;
+    return ggml_map_custom_impl(ctx, GGML_OP_MAP_CUSTOM3, a, b, c, params, false);
+}
+
+struct ggml_tensor * ggml_map_custom3_inplace(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c,
+        ggml_custom3_op_t     fun,
+        int                   n_tasks,
+        void                * userdata) {
+    struct ggml_map_custom_op_params params = { .n_tasks = n_tasks, .userdata = userdata };
+    params.fun.f3 = fun;
+    return ggml_map_custom_impl(ctx, GGML_OP_MAP_CUSTOM3, a, b, c, params, true);
+}
+
 // ggml_cross_entropy_loss
 
 struct ggml_tensor * ggml_cross_entropy_loss(
@@ -8164,6 +8304,22 @@ static void ggml_compute_forward_dup_f32(
         return;
     }
 
+    if (ggml_is_quantized(dst->type) && nb00 == sizeof(float) &&
+        ne00 == ne0 && ne01 == ne1 && ne02 == ne2 && ne03 == ne3) {
+        // quantize by rows into a strided destination
+        quantize_row_q_t const quantize_row_q = quantize_fns[dst->type].quantize_row_q;
+
+        for (int64_t i03 = 0; i03 < ne03; i03++) {
+            for (int64_t i02 = 0; i02 < ne02; i02++) {
+                for (int64_t i01 = ir0; i01 < ir1; i01++) {
+                    const float * src0_ptr = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+                    quantize_row_q(src0_ptr, (char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3, ne00);
+                }
+            }
+        }
+        return;
+    }
+
     // dst counters
 
     int64_t i10 = 0;
@@ -14544,18 +14700,14 @@ static void ggml_compute_forward_map_custom1_f32(
 static void ggml_compute_forward_map_custom1(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * a,
-        struct ggml_tensor * dst,
-        const ggml_custom1_op_f32_t fun) {
-    switch (a->type) {
-        case GGML_TYPE_F32:
-            {
-                ggml_compute_forward_map_custom1_f32(params, a, dst, fun);
-            } break;
-        default:
-            {
-                GGML_ASSERT(false);
-            } break;
+        struct ggml_tensor * dst) {
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
     }
+
+    const struct ggml_map_custom_op_params * p = (const struct ggml_map_custom_op_params *) dst->opt[0]->data;
+
+    p->fun.f1(dst, a, params->ith, params->nth, p->userdata);
 }
 
 // ggml_compute_forward_map_custom2
@@ -14580,18 +14732,14 @@ static void ggml_compute_forward_map_custom2(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * a,
         const struct ggml_tensor * b,
-        struct ggml_tensor * dst,
-        const ggml_custom2_op_f32_t fun) {
-    switch (a->type) {
-        case GGML_TYPE_F32:
-            {
-                ggml_compute_forward_map_custom2_f32(params, a, b, dst, fun);
-            } break;
-        default:
-            {
-                GGML_ASSERT(false);
-            } break;
+        struct ggml_tensor * dst) {
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
     }
+
+    const struct ggml_map_custom_op_params * p = (const struct ggml_map_custom_op_params *) dst->opt[0]->data;
+
+    p->fun.f2(dst, a, b, params->ith, params->nth, p->userdata);
 }
 
 // ggml_compute_forward_map_custom3
@@ -14618,18 +14766,14 @@ static void ggml_compute_forward_map_custom3(
         const struct ggml_tensor * a,
         const struct ggml_tensor * b,
         const struct ggml_tensor * c,
-        struct ggml_tensor * dst,
-        const ggml_custom3_op_f32_t fun) {
-    switch (a->type) {
-        case GGML_TYPE_F32:
-            {
-                ggml_compute_forward_map_custom3_f32(params, a, b, c, dst, fun);
-            } break;
-        default:
-            {
-                GGML_ASSERT(false);
-            } break;
+        struct ggml_tensor * dst) {
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
     }
+
+    const struct ggml_map_custom_op_params * p = (const struct ggml_map_custom_op_params *) dst->opt[0]->data;
+
+    p->fun.f3(dst, a, b, c, params->ith, params->nth, p->userdata);
 }
 
 // ggml_compute_forward_cross_entropy_loss
@@ -15177,22 +15321,37 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
                 ggml_compute_forward_map_binary(params, tensor->src0, tensor->src1, tensor, fun);
             }
             break;
-        case GGML_OP_MAP_CUSTOM1:
+        case GGML_OP_MAP_CUSTOM1_F32:
             {
                 const ggml_custom1_op_f32_t fun = *((ggml_custom1_op_f32_t *)tensor->opt[0]->data);
-                ggml_compute_forward_map_custom1(params, tensor->src0, tensor, fun);
+                ggml_compute_forward_map_custom1_f32(params, tensor->src0, tensor, fun);
             }
             break;
-        case GGML_OP_MAP_CUSTOM2:
+        case GGML_OP_MAP_CUSTOM2_F32:
             {
                 const ggml_custom2_op_f32_t fun = *((ggml_custom2_op_f32_t *)tensor->opt[0]->data);
-                ggml_compute_forward_map_custom2(params, tensor->src0, tensor->src1, tensor, fun);
+                ggml_compute_forward_map_custom2_f32(params, tensor->src0, tensor->src1, tensor, fun);
             }
             break;
-        case GGML_OP_MAP_CUSTOM3:
+        case GGML_OP_MAP_CUSTOM3_F32:
             {
                 const ggml_custom3_op_f32_t fun = *((ggml_custom3_op_f32_t *)tensor->opt[0]->data);
-                ggml_compute_forward_map_custom3(params, tensor->src0, tensor->src1, tensor->opt[1], tensor, fun);
+                ggml_compute_forward_map_custom3_f32(params, tensor->src0, tensor->src1, tensor->opt[1], tensor, fun);
+            }
+            break;
+        case GGML_OP_MAP_CUSTOM1:
+            {
+                ggml_compute_forward_map_custom1(params, tensor->src0, tensor);
+            }
+            break;
+        case GGML_OP_MAP_CUSTOM2:
+            {
+                ggml_compute_forward_map_custom2(params, tensor->src0, tensor->src1, tensor);
+            }
+            break;
+        case GGML_OP_MAP_CUSTOM3:
+            {
+                ggml_compute_forward_map_custom3(params, tensor->src0, tensor->src1, tensor->opt[1], tensor);
             }
             break;
         case GGML_OP_CROSS_ENTROPY_LOSS:
@@ -16008,6 +16167,9 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
         case GGML_OP_WIN_UNPART:
         case GGML_OP_MAP_UNARY:
         case GGML_OP_MAP_BINARY:
+        case GGML_OP_MAP_CUSTOM1_F32:
+        case GGML_OP_MAP_CUSTOM2_F32:
+        case GGML_OP_MAP_CUSTOM3_F32:
         case GGML_OP_MAP_CUSTOM1:
         case GGML_OP_MAP_CUSTOM2:
         case GGML_OP_MAP_CUSTOM3:
@@ -16741,11 +16903,22 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                 case GGML_OP_WIN_UNPART:
                 case GGML_OP_MAP_UNARY:
                 case GGML_OP_MAP_BINARY:
+                case GGML_OP_MAP_CUSTOM1_F32:
+                case GGML_OP_MAP_CUSTOM2_F32:
+                case GGML_OP_MAP_CUSTOM3_F32:
+                    {
+                        node->n_tasks = 1;
+                    } break;
                 case GGML_OP_MAP_CUSTOM1:
                 case GGML_OP_MAP_CUSTOM2:
                 case GGML_OP_MAP_CUSTOM3:
                     {
-                        node->n_tasks = 1;
+                        const struct ggml_map_custom_op_params * p = (const struct ggml_map_custom_op_params *) node->opt[0]->data;
+                        if (p->n_tasks == GGML_N_TASKS_MAX) {
+                            node->n_tasks = n_threads;
+                        } else {
+                            node->n_tasks = MIN(p->n_tasks, n_threads);
+                        }
                     } break;
                 case GGML_OP_CROSS_ENTROPY_LOSS:
                     {
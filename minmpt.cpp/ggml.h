@@ -389,6 +389,10 @@ enum ggml_op {
   GGML_OP_MAP_UNARY,
   GGML_OP_MAP_BINARY,
 
+  GGML_OP_MAP_CUSTOM1_F32,
+  GGML_OP_MAP_CUSTOM2_F32,
+  GGML_OP_MAP_CUSTOM3_F32,
+
   GGML_OP_MAP_CUSTOM1,
   GGML_OP_MAP_CUSTOM2,
   GGML_OP_MAP_CUSTOM3,
@@ -1130,6 +1134,58 @@ ggml_map_custom3_inplace_f32(struct ggml_context *ctx, struct ggml_tensor *a,
                              struct ggml_tensor *b, struct ggml_tensor *c,
                              ggml_custom3_op_f32_t fun);
 
+// custom operators v2
+//
+// unlike the _f32 variants above, these are called from every worker thread
+// with the task index ith out of nth, and carry an opaque userdata pointer
+
+typedef void (*ggml_custom1_op_t)(struct ggml_tensor *dst,
+                                  const struct ggml_tensor *a, int ith,
+                                  int nth, void *userdata);
+typedef void (*ggml_custom2_op_t)(struct ggml_tensor *dst,
+                                  const struct ggml_tensor *a,
+                                  const struct ggml_tensor *b, int ith,
+                                  int nth, void *userdata);
+typedef void (*ggml_custom3_op_t)(struct ggml_tensor *dst,
+                                  const struct ggml_tensor *a,
+                                  const struct ggml_tensor *b,
+                                  const struct ggml_tensor *c, int ith,
+                                  int nth, void *userdata);
+
+#define GGML_N_TASKS_MAX -1
+
+GGML_API struct ggml_tensor *ggml_map_custom1(struct ggml_context *ctx,
+                                              struct ggml_tensor *a,
+                                              ggml_custom1_op_t fun,
+                                              int n_tasks, void *userdata);
+
+GGML_API struct ggml_tensor *
+ggml_map_custom1_inplace(struct ggml_context *ctx, struct ggml_tensor *a,
+                         ggml_custom1_op_t fun, int n_tasks, void *userdata);
+
+GGML_API struct ggml_tensor *ggml_map_custom2(struct ggml_context *ctx,
+                                              struct ggml_tensor *a,
+                                              struct ggml_tensor *b,
+                                              ggml_custom2_op_t fun,
+                                              int n_tasks, void *userdata);
+
+GGML_API struct ggml_tensor *
+ggml_map_custom2_inplace(struct ggml_context *ctx, struct ggml_tensor *a,
+                         struct ggml_tensor *b, ggml_custom2_op_t fun,
+                         int n_tasks, void *userdata);
+
+GGML_API struct ggml_tensor *ggml_map_custom3(struct ggml_context *ctx,
+                                              struct ggml_tensor *a,
+                                              struct ggml_tensor *b,
+                                              struct ggml_tensor *c,
+                                              ggml_custom3_op_t fun,
+                                              int n_tasks, void *userdata);
+
+GGML_API struct ggml_tensor *
+ggml_map_custom3_inplace(struct ggml_context *ctx, struct ggml_tensor *a,
+                         struct ggml_tensor *b, struct ggml_tensor *c,
+                         ggml_custom3_op_t fun, int n_tasks, void *userdata);
+
 // loss function
 
 GGML_API struct ggml_tensor *ggml_cross_entropy_loss(struct ggml_context *ctx,
@@ -0,0 +1,242 @@
+#include "minmpt.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+struct minmpt_beam_seq {
+  minmpt_handle session = nullptr;
+  // generated so far, the last of them not evaluated yet. the first beam
+  // starts with the prompt pending instead. empty once evaluated by a step
+  // that failed for another beam
+  std::vector<uint32_t> tokens;
+  std::vector<uint32_t> pending;
+  float logprob = 0.0f;
+};
+
+struct minmpt_beam_hyp {
+  std::vector<uint32_t> tokens;
+  float score;
+};
+
+struct minmpt_beam_candidate {
+  size_t parent;
+  uint32_t token;
+  float logprob;
+};
+
+struct minmpt_beam {
+  minmpt_beam_params params;
+  std::vector<minmpt_beam_seq> live;
+  // best first, at most n_beams
+  std::vector<minmpt_beam_hyp> finished;
+  // scratch
+  std::vector<std::vector<float>> logits;
+  std::vector<uint32_t> order;
+};
+
+static minmpt_beam *from_handle(minmpt_beam_handle h) {
+  return reinterpret_cast<minmpt_beam *>(h);
+}
+
+static void beam_finish(minmpt_beam &beam, std::vector<uint32_t> tokens,
+                        float logprob, size_t n_tokens) {
+  const float score =
+      logprob / powf((float)n_tokens, beam.params.length_penalty);
+  auto &finished = beam.finished;
+  auto it = std::find_if(
+      finished.begin(), finished.end(),
+      [&](const minmpt_beam_hyp &r) { return r.score < score; });
+  finished.insert(it, {std::move(tokens), score});
+  if (finished.size() > beam.params.n_beams) {
+    finished.pop_back();
+  }
+}
+
+static void beam_release(minmpt_beam &beam) {
+  for (auto &seq : beam.live) {
+    minmpt_free(seq.session);
+  }
+  beam.live.clear();
+}
+
+minmpt_beam_params minmpt_beam_default_params(void) {
+  minmpt_beam_params params;
+  params.n_beams = 4;
+  params.max_tokens = 64;
+  params.eos_token = 0;
+  params.length_penalty = 1.0f;
+  return params;
+}
+
+minmpt_error minmpt_beam_create(minmpt_handle base, const uint32_t *prompt,
+                                size_t n_tokens,
+                                const minmpt_beam_params *params,
+                                minmpt_beam_handle *beam) {
+  if (n_tokens == 0 || params->n_beams == 0 || params->max_tokens == 0) {
+    return MINMPT_INVALID;
+  }
+  auto beamp = new minmpt_beam;
+  beamp->params = *params;
+  minmpt_beam_seq seq;
+  minmpt_fork(base, &seq.session);
+  seq.pending.assign(prompt, prompt + n_tokens);
+  beamp->live.push_back(std::move(seq));
+  *beam = reinterpret_cast<minmpt_beam_handle>(beamp);
+  return MINMPT_OK;
+}
+
+minmpt_error minmpt_beam_step(minmpt_beam_handle beam, size_t *n_live) {
+  auto beamp = from_handle(beam);
+  auto &live = beamp->live;
+  const size_t n_beams = beamp->params.n_beams;
+  if (live.empty()) {
+    if (n_live) {
+      *n_live = 0;
+    }
+    return MINMPT_OK;
+  }
+
+  // the newest token of every live beam in one batch, leaving out beams a
+  // failed step already evaluated, whose logits are kept
+  const size_t n_vocab = minmpt_n_vocab(live[0].session);
+  std::vector<size_t> indices;
+  std::vector<minmpt_handle> handles;
+  std::vector<const uint32_t *> tokens;
+  std::vector<size_t> n_tokens;
+  std::vector<float *> logits;
+  beamp->logits.resize(live.size());
+  for (size_t i = 0; i < live.size(); ++i) {
+    beamp->logits[i].resize(n_vocab);
+    if (live[i].pending.empty()) {
+      continue;
+    }
+    indices.push_back(i);
+    handles.push_back(live[i].session);
+    tokens.push_back(live[i].pending.data());
+    n_tokens.push_back(live[i].pending.size());
+    logits.push_back(beamp->logits[i].data());
+  }
+  if (!handles.empty()) {
+    std::vector<minmpt_error> errors(handles.size());
+    const minmpt_error err =
+        minmpt_eval_batch(handles.data(), tokens.data(), n_tokens.data(),
+                          handles.size(), logits.data(), errors.data());
+    for (size_t i = 0; i < indices.size(); ++i) {
+      if (errors[i] == MINMPT_OK) {
+        live[indices[i]].pending.clear();
+      }
+    }
+    if (err != MINMPT_OK) {
+      return err;
+    }
+  }
+
+  // n_beams + 1 tokens of each beam are enough for n_beams that are not eos
+  std::vector<minmpt_beam_candidate> candidates;
+  auto &order = beamp->order;
+  const size_t n_top = std::min(n_beams + 1, n_vocab);
+  for (size_t i = 0; i < live.size(); ++i) {
+    const float *l = beamp->logits[i].data();
+    const float lmax = *std::max_element(l, l + n_vocab);
+    float sum = 0.0f;
+    for (size_t t = 0; t < n_vocab; ++t) {
+      sum += expf(l[t] - lmax);
+    }
+    const float lse = lmax + logf(sum);
+    order.resize(n_vocab);
+    for (size_t t = 0; t < n_vocab; ++t) {
+      order[t] = t;
+    }
+    std::partial_sort(order.begin(), order.begin() + n_top, order.end(),
+                      [&](uint32_t a, uint32_t b) { return l[a] > l[b]; });
+    for (size_t j = 0; j < n_top; ++j) {
+      candidates.push_back(
+          {i, order[j], live[i].logprob + l[order[j]] - lse});
+    }
+  }
+  std::sort(candidates.begin(), candidates.end(),
+            [](const minmpt_beam_candidate &a, const minmpt_beam_candidate &b) {
+              return a.logprob > b.logprob;
+            });
+
+  // the best extensions become the next beams. a beam's first child takes
+  // over its session, the others fork it, sharing the blocks of a paged
+  // cache; beams left without a child are freed
+  std::vector<minmpt_beam_candidate> chosen;
+  for (const auto &c : candidates) {
+    if (chosen.size() == n_beams) {
+      break;
+    }
+    if (c.token == beamp->params.eos_token) {
+      beam_finish(*beamp, live[c.parent].tokens, c.logprob,
+                  live[c.parent].tokens.size() + 1);
+    } else {
+      chosen.push_back(c);
+    }
+  }
+  std::vector<minmpt_beam_seq> next;
+  std::vector<bool> taken(live.size(), false);
+  for (const auto &c : chosen) {
+    minmpt_beam_seq &parent = live[c.parent];
+    minmpt_beam_seq seq;
+    if (!taken[c.parent]) {
+      seq.session = parent.session;
+      taken[c.parent] = true;
+    } else {
+      minmpt_fork(parent.session, &seq.session);
+    }
+    seq.tokens = parent.tokens;
+    seq.tokens.push_back(c.token);
+    seq.pending.assign(1, c.token);
+    seq.logprob = c.logprob;
+    next.push_back(std::move(seq));
+  }
+  for (size_t i = 0; i < live.size(); ++i) {
+    if (!taken[i]) {
+      minmpt_free(live[i].session);
+    }
+  }
+  live.swap(next);
+
+  // done once n_beams have finished, or the beams reach max_tokens
+  if (beamp->finished.size() == n_beams) {
+    beam_release(*beamp);
+  } else if (!live.empty() &&
+             live[0].tokens.size() >= beamp->params.max_tokens) {
+    for (auto &seq : live) {
+      beam_finish(*beamp, seq.tokens, seq.logprob, seq.tokens.size());
+    }
+    beam_release(*beamp);
+  }
+  if (n_live) {
+    *n_live = live.size();
+  }
+  return MINMPT_OK;
+}
+
+size_t minmpt_beam_n_results(minmpt_beam_handle beam) {
+  return from_handle(beam)->finished.size();
+}
+
+minmpt_error minmpt_beam_result(minmpt_beam_handle beam, size_t i,
+                                const uint32_t **tokens, size_t *n_tokens,
+                                float *score) {
+  auto beamp = from_handle(beam);
+  if (i >= beamp->finished.size()) {
+    return MINMPT_INVALID;
+  }
+  const auto &result = beamp->finished[i];
+  *tokens = result.tokens.data();
+  *n_tokens = result.tokens.size();
+  if (score) {
+    *score = result.score;
+  }
+  return MINMPT_OK;
+}
+
+void minmpt_beam_free(minmpt_beam_handle beam) {
+  auto beamp = from_handle(beam);
+  beam_release(*beamp);
+  delete beamp;
+}
@@ -0,0 +1,111 @@
+#include "minmpt.h"
+#include "mpt-sample.h"
+
+#include <random>
+#include <vector>
+
+minmpt_generate_params minmpt_generate_default_params(void) {
+  minmpt_generate_params params;
+  params.n = 4;
+  params.max_tokens = 64;
+  params.temperature = 1.0f;
+  params.seed = 0;
+  params.eos_token = 0;
+  return params;
+}
+
+minmpt_error minmpt_generate_n(minmpt_handle base, const uint32_t *prompt,
+                               size_t n_prompt,
+                               const minmpt_generate_params *params,
+                               uint32_t *const *tokens, size_t *n_tokens,
+                               float *logprobs) {
+  const size_t n = params->n;
+  if (n_prompt == 0 || n == 0 || params->temperature < 0.0f) {
+    return MINMPT_INVALID;
+  }
+  const size_t n_vocab = minmpt_n_vocab(base);
+  std::mt19937_64 rng(params->seed ? params->seed : std::random_device()());
+
+  // the prompt is evaluated once; the other continuations fork the session
+  // holding it, sharing its blocks when the kv cache is paged
+  std::vector<minmpt_handle> sessions(n);
+  std::vector<std::vector<float>> logits(n, std::vector<float>(n_vocab));
+  minmpt_fork(base, &sessions[0]);
+  minmpt_error err =
+      minmpt_eval_logits(sessions[0], prompt, n_prompt, logits[0].data());
+  if (err != MINMPT_OK) {
+    minmpt_free(sessions[0]);
+    return err;
+  }
+  for (size_t i = 1; i < n; ++i) {
+    minmpt_fork(sessions[0], &sessions[i]);
+    logits[i] = logits[0];
+  }
+
+  std::vector<bool> done(n, false);
+  std::vector<float> probs(n_vocab);
+  std::vector<minmpt_handle> handles;
+  std::vector<size_t> indices;
+  std::vector<minmpt_error> errors;
+  std::vector<uint32_t> next(n);
+  std::vector<const uint32_t *> batch_tokens;
+  std::vector<size_t> batch_n_tokens;
+  std::vector<float *> batch_logits;
+  for (size_t i = 0; i < n; ++i) {
+    n_tokens[i] = 0;
+    if (logprobs) {
+      logprobs[i] = 0.0f;
+    }
+  }
+  for (size_t step = 0; step < params->max_tokens; ++step) {
+    // sample every running continuation, then decode them in one batch
+    handles.clear();
+    indices.clear();
+    batch_tokens.clear();
+    batch_n_tokens.clear();
+    batch_logits.clear();
+    for (size_t i = 0; i < n; ++i) {
+      if (done[i]) {
+        continue;
+      }
+      mpt_probs(logits[i].data(), n_vocab, params->temperature, probs.data());
+      next[i] = mpt_sample(probs.data(), n_vocab, rng);
+      if (next[i] == params->eos_token) {
+        done[i] = true;
+        continue;
+      }
+      tokens[i][n_tokens[i]++] = next[i];
+      if (logprobs) {
+        logprobs[i] += mpt_logprob(logits[i].data(), n_vocab, next[i]);
+      }
+      if (step + 1 == params->max_tokens) {
+        continue;
+      }
+      handles.push_back(sessions[i]);
+      indices.push_back(i);
+      batch_tokens.push_back(&next[i]);
+      batch_n_tokens.push_back(1);
+      batch_logits.push_back(logits[i].data());
+    }
+    if (handles.empty()) {
+      break;
+    }
+    errors.resize(handles.size());
+    err = minmpt_eval_batch(handles.data(), batch_tokens.data(),
+                            batch_n_tokens.data(), handles.size(),
+                            batch_logits.data(), errors.data());
+    if (err == MINMPT_FAILURE || err == MINMPT_INVALID) {
+      break;
+    }
+    // a continuation out of context or kv cache ends where it is
+    for (size_t j = 0; j < indices.size(); ++j) {
+      done[indices[j]] = done[indices[j]] || errors[j] != MINMPT_OK;
+    }
+    err = MINMPT_OK;
+  }
+
+  for (auto session : sessions) {
+    minmpt_free(session);
+  }
+  return err;
+}
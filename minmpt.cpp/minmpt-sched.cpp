@@ -0,0 +1,532 @@
+#include "minmpt.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct minmpt_sched_seq {
+  // NULL while queued
+  minmpt_handle session = nullptr;
+  // every token submitted for the sequence, so it can be evaluated again
+  // after a preemption
+  std::vector<uint32_t> tokens;
+  // the tail of tokens not evaluated yet
+  size_t n_pending = 0;
+  // the prompt has been evaluated, later tokens come one per step
+  bool prefilled = false;
+  // in a batch being evaluated, and finished meanwhile
+  bool busy = false;
+  bool dropped = false;
+  std::vector<float> logits;
+  minmpt_error err = MINMPT_OK;
+};
+
+typedef std::map<uint64_t, minmpt_sched_seq>::iterator minmpt_sched_seq_it;
+
+struct minmpt_sched_batch {
+  std::vector<minmpt_sched_seq_it> seqs;
+  std::vector<minmpt_handle> handles;
+  std::vector<const uint32_t *> tokens;
+  std::vector<size_t> n_tokens;
+  std::vector<float *> logits;
+  size_t n_batch_tokens = 0;
+};
+
+struct minmpt_sched {
+  minmpt_handle base;
+  minmpt_sched_params params;
+  uint64_t next_id = 1;
+  std::map<uint64_t, minmpt_sched_seq> seqs;
+  std::deque<uint64_t> queue;
+  size_t n_running = 0;
+  minmpt_sched_stats stats = {};
+
+  // with split pools, the prefill worker evaluates prompts while the thread
+  // calling minmpt_sched_step decodes. cv wakes the worker when there is
+  // work, and a step waiting for a prompt to be handed off
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::thread prefill_worker;
+  bool stop = false;
+  // the cores split between the pools, decode taking the first
+  // n_decode_threads. empty if the affinity mask is unknown
+  std::vector<int> cpus;
+  size_t n_decode_threads = 0;
+  // the prefill worker is evaluating a batch on its share of the cores,
+  // which keeps the split until it is done
+  bool prefill_busy = false;
+};
+
+static minmpt_sched *from_handle(minmpt_sched_handle h) {
+  return reinterpret_cast<minmpt_sched *>(h);
+}
+
+// waiting for a token, or failed
+static bool seq_ready(const minmpt_sched_seq &seq) {
+  return !seq.dropped &&
+         (seq.err != MINMPT_OK || (seq.session && seq.n_pending == 0));
+}
+
+static void seq_release(minmpt_sched &sched, minmpt_sched_seq &seq) {
+  if (seq.session) {
+    minmpt_free(seq.session);
+    seq.session = nullptr;
+    sched.n_running--;
+  }
+}
+
+static bool sched_split(const minmpt_sched &sched) {
+  return sched.params.n_split_threads > 0;
+}
+
+// prompts queued or being evaluated
+static bool sched_prefilling(const minmpt_sched &sched) {
+  if (!sched.queue.empty()) {
+    return true;
+  }
+  for (const auto &it : sched.seqs) {
+    if (it.second.session && !it.second.prefilled) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static size_t sched_n_ready(const minmpt_sched &sched) {
+  size_t n = 0;
+  for (const auto &it : sched.seqs) {
+    n += seq_ready(it.second);
+  }
+  return n;
+}
+
+// whether the pool can hold the next queued sequence, leaving room for the
+// rest of each running one's pending tokens and a block to grow into.
+// blocks held only by the prefix cache count as free. a dense cache is a
+// whole fork of the base per sequence, counted against max_kv_bytes
+static bool sched_fits(const minmpt_sched &sched, const minmpt_sched_seq &seq) {
+  if (sched.n_running == 0) {
+    return true;
+  }
+  minmpt_kv_usage usage;
+  minmpt_get_kv_usage(sched.base, &usage);
+  if (usage.block_size == 0) {
+    const size_t max_bytes = sched.params.max_kv_bytes;
+    return max_bytes == 0 ||
+           (sched.n_running + 1) * minmpt_kv_bytes(sched.base) <= max_bytes;
+  }
+  if (usage.n_max == 0) {
+    return true;
+  }
+  const size_t bs = usage.block_size;
+  size_t n_blocks = 0;
+  for (const auto &it : sched.seqs) {
+    if (it.second.session) {
+      n_blocks += (it.second.n_pending + bs) / bs;
+    }
+  }
+  // whole blocks of the base context are shared with it
+  const size_t n_past = minmpt_n_past(sched.base);
+  n_blocks += (n_past + seq.n_pending + bs) / bs - n_past / bs;
+  return n_blocks + usage.n_used <= usage.n_max + usage.n_cached;
+}
+
+static void sched_admit(minmpt_sched &sched) {
+  while (!sched.queue.empty() && sched.n_running < sched.params.max_seqs) {
+    auto &seq = sched.seqs[sched.queue.front()];
+    if (!sched_fits(sched, seq)) {
+      break;
+    }
+    minmpt_fork(sched.base, &seq.session);
+    sched.n_running++;
+    sched.queue.pop_front();
+  }
+}
+
+// splits the cores by load. with no prompts to evaluate decode takes them
+// all, otherwise its share grows with the number of decoding sequences and
+// each pool keeps at least n_min_pool_threads. only steps split the cores,
+// and not while a prefill batch runs, so the pools never share one
+static void sched_partition(minmpt_sched &sched) {
+  if (sched.prefill_busy) {
+    return;
+  }
+  const size_t n_threads = sched.params.n_split_threads;
+  const size_t n_min = sched.params.n_min_pool_threads;
+  size_t n_decoding = 0;
+  for (const auto &it : sched.seqs) {
+    n_decoding += it.second.session && it.second.prefilled;
+  }
+  if (!sched_prefilling(sched)) {
+    sched.n_decode_threads = n_threads;
+  } else {
+    const size_t n_shared = n_threads - 2 * n_min;
+    const size_t max_seqs = sched.params.max_seqs;
+    sched.n_decode_threads =
+        n_min + (n_shared * n_decoding + max_seqs / 2) / max_seqs;
+  }
+  sched.stats.n_decode_threads = sched.n_decode_threads;
+  sched.stats.n_prefill_threads = n_threads - sched.n_decode_threads;
+}
+
+// runs the calling thread, and the ggml workers it starts, on cpus[i0, i1)
+static void sched_pin(const minmpt_sched &sched, size_t i0, size_t i1) {
+#ifdef __linux__
+  if (sched.cpus.empty()) {
+    return;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (size_t i = i0; i < i1; ++i) {
+    CPU_SET(sched.cpus[i], &set);
+  }
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+  (void)sched;
+  (void)i0;
+  (void)i1;
+#endif
+}
+
+// adds the decode tokens or the prompt chunks of running sequences to
+// batch, up to n_budget tokens. sequences are taken by id, which is
+// submission order rather than the order they were admitted in
+static void sched_collect(minmpt_sched &sched, bool prefill, size_t n_budget,
+                          minmpt_sched_batch &batch) {
+  const size_t n_vocab = minmpt_n_vocab(sched.base);
+  for (auto it = sched.seqs.begin(); it != sched.seqs.end(); ++it) {
+    auto &seq = it->second;
+    if (!seq.session || seq.busy || seq.n_pending == 0 ||
+        seq.prefilled == prefill || batch.n_batch_tokens == n_budget) {
+      continue;
+    }
+    size_t n = seq.n_pending;
+    if (prefill) {
+      n = std::min(n, std::min(sched.params.prefill_chunk,
+                               n_budget - batch.n_batch_tokens));
+    }
+    seq.busy = true;
+    seq.logits.resize(n_vocab);
+    batch.seqs.push_back(it);
+    batch.handles.push_back(seq.session);
+    batch.tokens.push_back(seq.tokens.data() + seq.tokens.size() -
+                           seq.n_pending);
+    batch.n_tokens.push_back(n);
+    batch.logits.push_back(seq.logits.data());
+    batch.n_batch_tokens += n;
+  }
+}
+
+// evaluates batch with the lock released, on n_threads unless 0, and
+// records the results. a prompt finishing here is handed off to decoding
+static minmpt_error sched_eval(minmpt_sched &sched,
+                               std::unique_lock<std::mutex> &lock,
+                               minmpt_sched_batch &batch, size_t n_threads) {
+  const size_t n_seqs = batch.seqs.size();
+  std::vector<minmpt_error> errors(n_seqs);
+  if (n_threads > 0) {
+    minmpt_set_n_threads(batch.handles[0], n_threads);
+  }
+  lock.unlock();
+  const minmpt_error err =
+      minmpt_eval_batch(batch.handles.data(), batch.tokens.data(),
+                        batch.n_tokens.data(), n_seqs, batch.logits.data(),
+                        errors.data());
+  lock.lock();
+  if (err == MINMPT_FAILURE) {
+    std::fill(errors.begin(), errors.end(), MINMPT_FAILURE);
+  }
+
+  // a sequence the pool cannot hold even alone fails instead
+  const bool alone = sched.n_running == 1;
+  std::vector<uint64_t> preempted;
+  for (size_t i = 0; i < n_seqs; ++i) {
+    auto it = batch.seqs[i];
+    auto &seq = it->second;
+    seq.busy = false;
+    if (seq.dropped) {
+      seq_release(sched, seq);
+      sched.seqs.erase(it);
+      continue;
+    }
+    if (errors[i] == MINMPT_OK) {
+      seq.n_pending -= batch.n_tokens[i];
+      seq.prefilled = seq.prefilled || seq.n_pending == 0;
+      continue;
+    }
+    seq_release(sched, seq);
+    if (errors[i] == MINMPT_KV_FULL && !alone) {
+      // evaluated again from the start once the pool has room
+      seq.n_pending = seq.tokens.size();
+      seq.prefilled = false;
+      preempted.push_back(it->first);
+    } else {
+      seq.err = errors[i];
+    }
+  }
+  sched.queue.insert(sched.queue.begin(), preempted.begin(), preempted.end());
+  sched.stats.n_preempted += preempted.size();
+  sched.stats.n_tokens_total += batch.n_batch_tokens;
+  sched.cv.notify_all();
+  return err == MINMPT_FAILURE ? err : MINMPT_OK;
+}
+
+static void sched_prefill_loop(minmpt_sched &sched) {
+  std::unique_lock<std::mutex> lock(sched.mutex);
+  while (!sched.stop) {
+    sched_admit(sched);
+    // the cores the last step left to prefill, none until a step sees
+    // prompts to evaluate
+    const size_t n_threads =
+        sched.params.n_split_threads - sched.n_decode_threads;
+    minmpt_sched_batch batch;
+    if (n_threads > 0) {
+      sched_collect(sched, true, sched.params.max_batch_tokens, batch);
+    }
+    if (batch.seqs.empty()) {
+      sched.cv.wait(lock);
+      continue;
+    }
+    sched.prefill_busy = true;
+    sched_pin(sched, sched.n_decode_threads, sched.params.n_split_threads);
+    sched.stats.n_prefill_tokens = batch.n_batch_tokens;
+    sched_eval(sched, lock, batch, n_threads);
+    sched.prefill_busy = false;
+  }
+}
+
+minmpt_sched_params minmpt_sched_default_params(void) {
+  minmpt_sched_params params;
+  params.max_seqs = 16;
+  params.max_batch_tokens = 256;
+  params.prefill_chunk = 128;
+  params.n_split_threads = 0;
+  params.n_min_pool_threads = 1;
+  params.max_kv_bytes = 0;
+  return params;
+}
+
+minmpt_error minmpt_sched_create(minmpt_handle base,
+                                 const minmpt_sched_params *params,
+                                 minmpt_sched_handle *sched) {
+  if (params->max_seqs == 0 || params->prefill_chunk == 0 ||
+      params->max_batch_tokens < params->max_seqs) {
+    return MINMPT_INVALID;
+  }
+  if (params->n_split_threads > 0 &&
+      (params->n_min_pool_threads == 0 ||
+       params->n_split_threads < 2 * params->n_min_pool_threads)) {
+    return MINMPT_INVALID;
+  }
+  // the pools are pinned to the cores this thread may run on, one thread
+  // per core
+  std::vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t set;
+  if (params->n_split_threads > 0 &&
+      sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+#endif
+  if (!cpus.empty() && params->n_split_threads > cpus.size()) {
+    return MINMPT_INVALID;
+  }
+  auto schedp = new minmpt_sched;
+  schedp->base = base;
+  schedp->params = *params;
+  if (sched_split(*schedp)) {
+    schedp->cpus = std::move(cpus);
+    schedp->n_decode_threads = params->n_split_threads;
+    schedp->prefill_worker =
+        std::thread(sched_prefill_loop, std::ref(*schedp));
+  }
+  *sched = reinterpret_cast<minmpt_sched_handle>(schedp);
+  return MINMPT_OK;
+}
+
+minmpt_error minmpt_sched_submit(minmpt_sched_handle sched,
+                                 const uint32_t *prompt, size_t n_tokens,
+                                 uint64_t *id) {
+  auto schedp = from_handle(sched);
+  if (n_tokens == 0) {
+    return MINMPT_INVALID;
+  }
+  std::lock_guard<std::mutex> lock(schedp->mutex);
+  *id = schedp->next_id++;
+  auto &seq = schedp->seqs[*id];
+  seq.tokens.assign(prompt, prompt + n_tokens);
+  seq.n_pending = n_tokens;
+  schedp->queue.push_back(*id);
+  schedp->cv.notify_all();
+  return MINMPT_OK;
+}
+
+minmpt_error minmpt_sched_step(minmpt_sched_handle sched, size_t *n_ready) {
+  auto schedp = from_handle(sched);
+  const auto t0 = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lock(schedp->mutex);
+  const bool split = sched_split(*schedp);
+
+  // decode tokens first, max_batch_tokens >= max_seqs leaves room for all
+  // of them. prompt chunks fill the rest, unless the prefill worker takes
+  // them
+  minmpt_sched_batch batch;
+  if (split) {
+    // the prefill worker takes the rest of the cores from here
+    sched_partition(*schedp);
+    schedp->cv.notify_all();
+  } else {
+    sched_admit(*schedp);
+  }
+  sched_collect(*schedp, false, schedp->params.max_batch_tokens, batch);
+  const size_t n_decode_tokens = batch.n_batch_tokens;
+  if (!split) {
+    sched_collect(*schedp, true, schedp->params.max_batch_tokens, batch);
+  }
+
+  minmpt_error err = MINMPT_OK;
+  if (!batch.seqs.empty()) {
+    size_t n_threads = 0;
+#ifdef __linux__
+    cpu_set_t saved;
+    pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved);
+#endif
+    if (split) {
+      sched_pin(*schedp, 0, schedp->n_decode_threads);
+      n_threads = schedp->n_decode_threads;
+    }
+    err = sched_eval(*schedp, lock, batch, n_threads);
+#ifdef __linux__
+    if (split) {
+      pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+    }
+#endif
+
+    const auto t1 = std::chrono::steady_clock::now();
+    const uint64_t us =
+        std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count();
+    auto &stats = schedp->stats;
+    stats.n_steps++;
+    stats.n_batch_seqs = batch.seqs.size();
+    stats.n_batch_tokens = batch.n_batch_tokens;
+    if (!split) {
+      stats.n_prefill_tokens = batch.n_batch_tokens - n_decode_tokens;
+    }
+    stats.step_us = us;
+    stats.step_us_total += us;
+    stats.step_us_max = std::max(stats.step_us_max, us);
+  } else if (split) {
+    // nothing to decode yet, wait for the prefill worker to hand some off
+    schedp->cv.wait(lock, [&] {
+      return sched_n_ready(*schedp) > 0 || !sched_prefilling(*schedp);
+    });
+  }
+
+  if (n_ready) {
+    *n_ready = sched_n_ready(*schedp);
+  }
+  return err;
+}
+
+size_t minmpt_sched_ready(minmpt_sched_handle sched, uint64_t *ids,
+                          size_t max_ids) {
+  auto schedp = from_handle(sched);
+  std::lock_guard<std::mutex> lock(schedp->mutex);
+  size_t n = 0;
+  for (const auto &it : schedp->seqs) {
+    if (seq_ready(it.second)) {
+      if (n < max_ids) {
+        ids[n] = it.first;
+      }
+      n++;
+    }
+  }
+  return n;
+}
+
+minmpt_error minmpt_sched_logits(minmpt_sched_handle sched, uint64_t id,
+                                 const float **logits) {
+  auto schedp = from_handle(sched);
+  std::lock_guard<std::mutex> lock(schedp->mutex);
+  auto it = schedp->seqs.find(id);
+  if (it == schedp->seqs.end() || !seq_ready(it->second)) {
+    return MINMPT_INVALID;
+  }
+  if (it->second.err != MINMPT_OK) {
+    return it->second.err;
+  }
+  *logits = it->second.logits.data();
+  return MINMPT_OK;
+}
+
+minmpt_error minmpt_sched_push(minmpt_sched_handle sched, uint64_t id,
+                               uint32_t token) {
+  auto schedp = from_handle(sched);
+  std::lock_guard<std::mutex> lock(schedp->mutex);
+  auto it = schedp->seqs.find(id);
+  if (it == schedp->seqs.end() || !seq_ready(it->second) ||
+      it->second.err != MINMPT_OK) {
+    return MINMPT_INVALID;
+  }
+  it->second.tokens.push_back(token);
+  it->second.n_pending = 1;
+  return MINMPT_OK;
+}
+
+void minmpt_sched_finish(minmpt_sched_handle sched, uint64_t id) {
+  auto schedp = from_handle(sched);
+  std::lock_guard<std::mutex> lock(schedp->mutex);
+  auto it = schedp->seqs.find(id);
+  if (it == schedp->seqs.end()) {
+    return;
+  }
+  // a sequence in a batch goes once the batch is done
+  if (it->second.busy) {
+    it->second.dropped = true;
+    return;
+  }
+  seq_release(*schedp, it->second);
+  auto queued = std::find(schedp->queue.begin(), schedp->queue.end(), id);
+  if (queued != schedp->queue.end()) {
+    schedp->queue.erase(queued);
+  }
+  schedp->seqs.erase(it);
+  schedp->cv.notify_all();
+}
+
+void minmpt_sched_get_stats(minmpt_sched_handle sched,
+                            minmpt_sched_stats *stats) {
+  auto schedp = from_handle(sched);
+  std::lock_guard<std::mutex> lock(schedp->mutex);
+  *stats = schedp->stats;
+  stats->n_queued = schedp->queue.size();
+  stats->n_running = schedp->n_running;
+}
+
+void minmpt_sched_free(minmpt_sched_handle sched) {
+  auto schedp = from_handle(sched);
+  if (schedp->prefill_worker.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(schedp->mutex);
+      schedp->stop = true;
+      schedp->cv.notify_all();
+    }
+    schedp->prefill_worker.join();
+  }
+  for (auto &it : schedp->seqs) {
+    seq_release(*schedp, it.second);
+  }
+  delete schedp;
+}
@@ -0,0 +1,265 @@
+#include "minmpt.h"
+#include "mpt-sample.h"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+struct minmpt_spec {
+  minmpt_spec_params params;
+  std::mt19937_64 rng;
+  minmpt_spec_stats stats = {};
+  // the target's tokens followed by the input of the round, and the draft's
+  std::vector<uint32_t> context;
+  std::vector<uint32_t> draft_context;
+  // the input followed by the drafted tokens, evaluated by the target
+  std::vector<uint32_t> batch;
+  // the draft's distribution for each drafted token, and the target's
+  // logits after each token of the batch that has a draft following it
+  std::vector<float> q;
+  std::vector<float> draft_logits;
+  std::vector<float> logits;
+  std::vector<float> p;
+
+  // prompt lookup. the context indexed so far with the prefix hashes of its
+  // tokens, and for each n-gram length the position after the last
+  // occurrence of each n-gram
+  std::vector<uint32_t> indexed;
+  std::vector<uint64_t> hashes;
+  std::vector<uint64_t> powers;
+  std::vector<std::unordered_map<uint64_t, size_t>> ngrams;
+};
+
+static minmpt_spec *from_handle(minmpt_spec_handle h) {
+  return reinterpret_cast<minmpt_spec *>(h);
+}
+
+static float spec_uniform(minmpt_spec &spec) {
+  return std::uniform_real_distribution<float>(0.0f, 1.0f)(spec.rng);
+}
+
+static void spec_context(minmpt_spec &spec, minmpt_handle target,
+                         const uint32_t *input, size_t n_input) {
+  spec.context.resize(minmpt_n_past(target));
+  minmpt_tokens(target, spec.context.data());
+  spec.context.insert(spec.context.end(), input, input + n_input);
+}
+
+// rewinds the draft to where it agrees with the context, and evaluates the
+// rest, at least one token for its logits
+static minmpt_error spec_sync_draft(minmpt_spec &spec, minmpt_handle draft) {
+  spec.draft_context.resize(minmpt_n_past(draft));
+  minmpt_tokens(draft, spec.draft_context.data());
+
+  size_t n_common = 0;
+  while (n_common < spec.draft_context.size() &&
+         n_common < spec.context.size() &&
+         spec.draft_context[n_common] == spec.context[n_common]) {
+    n_common++;
+  }
+  n_common = std::min(n_common, spec.context.size() - 1);
+  minmpt_rewind(draft, spec.draft_context.size() - n_common);
+  return minmpt_eval_logits(draft, spec.context.data() + n_common,
+                            spec.context.size() - n_common,
+                            spec.draft_logits.data());
+}
+
+// the hash of context[i0, i1)
+static uint64_t spec_ngram_hash(const minmpt_spec &spec, size_t i0,
+                                size_t i1) {
+  return spec.hashes[i1] - spec.hashes[i0] * spec.powers[i1 - i0];
+}
+
+// indexes the n-grams of the context. the context normally only grows; one
+// that no longer starts with what was indexed is indexed again
+static void spec_index(minmpt_spec &spec) {
+  const size_t ngram_min = spec.params.ngram_min;
+  const size_t ngram_max = spec.params.ngram_max;
+  const auto &context = spec.context;
+  if (spec.indexed.size() > context.size() ||
+      !std::equal(spec.indexed.begin(), spec.indexed.end(), context.begin())) {
+    spec.indexed.clear();
+    spec.hashes.assign(1, 0);
+    for (auto &ngrams : spec.ngrams) {
+      ngrams.clear();
+    }
+  }
+  for (size_t i = spec.indexed.size(); i < context.size(); ++i) {
+    // the n-grams ending at i are followed by token i
+    for (size_t n = ngram_min; n <= std::min(ngram_max, i); ++n) {
+      spec.ngrams[n - ngram_min][spec_ngram_hash(spec, i - n, i)] = i;
+    }
+    spec.hashes.push_back(spec.hashes.back() * 0x100000001b3ull + context[i] +
+                          1);
+    spec.indexed.push_back(context[i]);
+  }
+}
+
+// proposes what followed the last occurrence of the longest n-gram ending
+// the context, and returns how many tokens it appended to the batch
+static size_t spec_lookup(minmpt_spec &spec, size_t n_draft) {
+  spec_index(spec);
+  const auto &context = spec.context;
+  const size_t n_ctx = context.size();
+  for (size_t n = std::min(spec.params.ngram_max, n_ctx);
+       n >= spec.params.ngram_min; --n) {
+    const auto &ngrams = spec.ngrams[n - spec.params.ngram_min];
+    const auto it = ngrams.find(spec_ngram_hash(spec, n_ctx - n, n_ctx));
+    if (it == ngrams.end()) {
+      continue;
+    }
+    // hashes may collide
+    const size_t i = it->second;
+    if (!std::equal(context.begin() + (i - n), context.begin() + i,
+                    context.begin() + (n_ctx - n))) {
+      continue;
+    }
+    // a match just behind the end continues into its own proposal, which
+    // repeats the period of the text
+    const size_t n_batch = spec.batch.size();
+    for (size_t j = i; j < i + n_draft; ++j) {
+      spec.batch.push_back(j < n_ctx ? context[j]
+                                     : spec.batch[n_batch + j - n_ctx]);
+    }
+    return n_draft;
+  }
+  return 0;
+}
+
+minmpt_spec_params minmpt_spec_default_params(void) {
+  minmpt_spec_params params;
+  params.n_draft = 4;
+  params.temperature = 1.0f;
+  params.seed = 0;
+  params.ngram_min = 2;
+  params.ngram_max = 4;
+  return params;
+}
+
+minmpt_error minmpt_spec_create(const minmpt_spec_params *params,
+                                minmpt_spec_handle *spec) {
+  if (params->temperature < 0.0f || params->ngram_min == 0 ||
+      params->ngram_max < params->ngram_min) {
+    return MINMPT_INVALID;
+  }
+  auto specp = new minmpt_spec;
+  specp->params = *params;
+  specp->powers.assign(params->ngram_max + 1, 1);
+  for (size_t n = 1; n <= params->ngram_max; ++n) {
+    specp->powers[n] = specp->powers[n - 1] * 0x100000001b3ull;
+  }
+  specp->hashes.assign(1, 0);
+  specp->ngrams.resize(params->ngram_max - params->ngram_min + 1);
+  specp->rng.seed(params->seed ? params->seed : std::random_device()());
+  *spec = reinterpret_cast<minmpt_spec_handle>(specp);
+  return MINMPT_OK;
+}
+
+minmpt_error minmpt_spec_step(minmpt_spec_handle spec, minmpt_handle target,
+                              minmpt_handle draft, const uint32_t *input,
+                              size_t n_input, uint32_t *out, size_t *n_out) {
+  auto specp = from_handle(spec);
+  const auto t0 = std::chrono::steady_clock::now();
+  const size_t n_vocab = minmpt_n_vocab(target);
+  if (n_input == 0 || (draft && minmpt_n_vocab(draft) != n_vocab)) {
+    return MINMPT_INVALID;
+  }
+  const float temperature = specp->params.temperature;
+
+  // draft no further than the target's context reaches
+  const size_t n_past = minmpt_n_past(target) + n_input;
+  const size_t n_ctx = minmpt_n_ctx(target);
+  size_t n_draft =
+      std::min(specp->params.n_draft, n_ctx > n_past ? n_ctx - n_past : 0);
+
+  specp->batch.assign(input, input + n_input);
+  specp->q.resize(n_draft * n_vocab);
+  specp->draft_logits.resize(n_vocab);
+  if (n_draft > 0) {
+    spec_context(*specp, target, input, n_input);
+  }
+  if (!draft) {
+    // the lookup is certain of its tokens, which are kept with probability p
+    n_draft = n_draft > 0 ? spec_lookup(*specp, n_draft) : 0;
+    std::fill(specp->q.begin(), specp->q.end(), 0.0f);
+    for (size_t i = 0; i < n_draft; ++i) {
+      specp->q[i * n_vocab + specp->batch[n_input + i]] = 1.0f;
+    }
+  } else if (n_draft > 0 && spec_sync_draft(*specp, draft) != MINMPT_OK) {
+    n_draft = 0;
+  }
+  for (size_t i = 0; draft && i < n_draft; ++i) {
+    float *q = specp->q.data() + i * n_vocab;
+    mpt_probs(specp->draft_logits.data(), n_vocab, temperature, q);
+    const uint32_t token = mpt_sample(q, n_vocab, specp->rng);
+    specp->batch.push_back(token);
+    if (i + 1 < n_draft && minmpt_eval_logits(draft, &token, 1,
+                                              specp->draft_logits.data()) !=
+                               MINMPT_OK) {
+      n_draft = i + 1;
+    }
+  }
+
+  // one pass of the target gives its logits after the input and each draft
+  specp->logits.resize((n_draft + 1) * n_vocab);
+  const minmpt_error err =
+      minmpt_eval_logits_n(target, specp->batch.data(), specp->batch.size(),
+                           n_draft + 1, specp->logits.data());
+  if (err != MINMPT_OK) {
+    return err;
+  }
+
+  // each draft is kept with probability min(1, p / q). the first one
+  // rejected is replaced by a sample of max(0, p - q), and if none is, one
+  // more token is sampled from p
+  specp->p.resize(n_vocab);
+  float *p = specp->p.data();
+  size_t n_accepted = 0;
+  bool rejected = false;
+  for (; n_accepted < n_draft; ++n_accepted) {
+    const float *q = specp->q.data() + n_accepted * n_vocab;
+    const uint32_t token = specp->batch[n_input + n_accepted];
+    mpt_probs(specp->logits.data() + n_accepted * n_vocab, n_vocab,
+              temperature, p);
+    if (spec_uniform(*specp) * q[token] < p[token]) {
+      out[n_accepted] = token;
+      continue;
+    }
+    float residual = 0.0f;
+    for (size_t i = 0; i < n_vocab; ++i) {
+      p[i] = std::max(0.0f, p[i] - q[i]);
+      residual += p[i];
+    }
+    if (residual <= 0.0f) {
+      mpt_probs(specp->logits.data() + n_accepted * n_vocab, n_vocab,
+                temperature, p);
+    }
+    rejected = true;
+    break;
+  }
+  if (!rejected) {
+    mpt_probs(specp->logits.data() + n_draft * n_vocab, n_vocab, temperature,
+              p);
+  }
+  out[n_accepted] = mpt_sample(p, n_vocab, specp->rng);
+  *n_out = n_accepted + 1;
+  minmpt_rewind(target, n_draft - n_accepted);
+
+  auto &stats = specp->stats;
+  stats.n_rounds++;
+  stats.n_drafted += n_draft;
+  stats.n_accepted += n_accepted;
+  stats.n_tokens += *n_out;
+  stats.t_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - t0)
+                    .count();
+  return MINMPT_OK;
+}
+
+void minmpt_spec_get_stats(minmpt_spec_handle spec, minmpt_spec_stats *stats) {
+  *stats = from_handle(spec)->stats;
+}
+
+void minmpt_spec_free(minmpt_spec_handle spec) { delete from_handle(spec); }
@@ -1,17 +1,46 @@
 #include "minmpt.h"
+#include "mpt-head.h"
+#include "mpt-kv.h"
+#include "mpt-prefix.h"
+#include "mpt-sample.h"
 #include "mpt.h"
 
+#include <algorithm>
+#include <cmath>
+#include <fcntl.h>
 #include <memory>
+#include <random>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 struct minmpt_session {
   std::shared_ptr<mpt_model> model;
   std::unique_ptr<mpt_kvcache> kvcache;
+  // shared by forks, paged caches only
+  std::shared_ptr<mpt_prefix_cache> prefix_cache;
   size_t mem_per_token = 0;
   int n_threads = 4;
   size_t n_past = 0;
+  // the n_past tokens in the kv cache and the logits after the last of them
+  std::vector<uint32_t> tokens;
+  std::vector<float> logits;
+  // context shifting. once tokens have been dropped, the cache holds the
+  // first n_sink tokens of the stream, the positions kept by eviction and
+  // from n_window_start on a window of recent ones
+  bool ctx_shift = false;
+  size_t ctx_keep = 0;
+  size_t ctx_discard = 0;
+  int kv_evict = MINMPT_KV_EVICT_OLDEST;
+  size_t kv_budget = 0;
+  size_t kv_recent = 0;
+  // logits computed by the approximate head, 0 for all
+  size_t head_candidates = 0;
+  size_t n_sink = 0;
+  size_t n_window_start = 0;
+  size_t n_dropped = 0;
 };
 
 static minmpt_session *from_handle(minmpt_handle h) {
@@ -22,20 +51,143 @@ static const minmpt_session *from_handle_const(const minmpt_handle h) {
   return reinterpret_cast<const minmpt_session *>(h);
 }
 
+minmpt_params minmpt_default_params(void) {
+  minmpt_params params;
+  params.n_ctx_override = 0;
+  params.kv_layout = MINMPT_KV_LAYOUT_FLAT;
+  params.kv_type_k = MINMPT_KV_TYPE_F16;
+  params.kv_type_v = MINMPT_KV_TYPE_F16;
+  params.kv_block_size = 0;
+  params.kv_max_blocks = 0;
+  params.kv_disk_path = nullptr;
+  params.kv_ram_bytes = 0;
+  params.prefix_cache_bytes = 0;
+  params.ctx_shift = 0;
+  params.ctx_keep = 4;
+  params.ctx_discard = 0;
+  params.kv_evict = MINMPT_KV_EVICT_OLDEST;
+  params.kv_budget = 0;
+  params.kv_recent = 32;
+  params.attn_prune_tol = 0.0f;
+  params.head_clusters = 0;
+  params.head_candidates = 0;
+  return params;
+}
+
+static bool kv_type_from_minmpt(int kv_type, ggml_type *type) {
+  switch (kv_type) {
+  case MINMPT_KV_TYPE_F16:
+    *type = GGML_TYPE_F16;
+    return true;
+  case MINMPT_KV_TYPE_Q8_0:
+    *type = GGML_TYPE_Q8_0;
+    return true;
+  case MINMPT_KV_TYPE_Q4_0:
+    *type = GGML_TYPE_Q4_0;
+    return true;
+  case MINMPT_KV_TYPE_Q4_1:
+    *type = GGML_TYPE_Q4_1;
+    return true;
+  default:
+    return false;
+  }
+}
+
 minmpt_error minmpt_load(minmpt_handle *handle, const char *filename,
                          size_t fnlen, size_t n_ctx_override) {
+  minmpt_params params = minmpt_default_params();
+  params.n_ctx_override = n_ctx_override;
+  return minmpt_load_with_params(handle, filename, fnlen, &params);
+}
+
+minmpt_error minmpt_load_with_params(minmpt_handle *handle,
+                                     const char *filename, size_t fnlen,
+                                     const minmpt_params *params) {
+  mpt_kvcache_params kv_params;
+  switch (params->kv_layout) {
+  case MINMPT_KV_LAYOUT_FLAT:
+    kv_params.layout = MPT_KV_FLAT;
+    break;
+  case MINMPT_KV_LAYOUT_HEAD_MAJOR:
+    kv_params.layout = MPT_KV_HEAD_MAJOR;
+    break;
+  default:
+    return MINMPT_INVALID;
+  }
+  if (!kv_type_from_minmpt(params->kv_type_k, &kv_params.type_k) ||
+      !kv_type_from_minmpt(params->kv_type_v, &kv_params.type_v)) {
+    return MINMPT_INVALID;
+  }
+  if (kv_params.layout == MPT_KV_HEAD_MAJOR &&
+      kv_params.type_v != GGML_TYPE_F16) {
+    return MINMPT_INVALID;
+  }
+  if (params->kv_block_size < 0 || params->kv_max_blocks < 0) {
+    return MINMPT_INVALID;
+  }
+  if ((params->prefix_cache_bytes > 0 || params->kv_disk_path) &&
+      params->kv_block_size == 0) {
+    return MINMPT_INVALID;
+  }
+  if (params->kv_evict != MINMPT_KV_EVICT_OLDEST &&
+      params->kv_evict != MINMPT_KV_EVICT_H2O) {
+    return MINMPT_INVALID;
+  }
+  if (!(params->attn_prune_tol >= 0.0f && params->attn_prune_tol < 1.0f)) {
+    return MINMPT_INVALID;
+  }
+  kv_params.block_size = params->kv_block_size;
+  kv_params.max_blocks = params->kv_max_blocks;
+  if (params->kv_disk_path) {
+    kv_params.disk_path = params->kv_disk_path;
+    kv_params.ram_bytes = params->kv_ram_bytes;
+  }
+  kv_params.track_attn = params->kv_evict == MINMPT_KV_EVICT_H2O;
+  kv_params.attn_prune_tol = params->attn_prune_tol;
+
   auto modelp = new minmpt_session;
+  modelp->ctx_shift = params->ctx_shift != 0;
+  modelp->ctx_keep = params->ctx_keep;
+  modelp->ctx_discard = params->ctx_discard;
+  modelp->kv_evict = params->kv_evict;
+  modelp->kv_budget = params->kv_budget;
+  modelp->kv_recent = params->kv_recent;
+  modelp->head_candidates = params->head_candidates;
   std::string fn(filename, fnlen);
   try {
     modelp->model = std::make_shared<mpt_model>();
-    if (mpt_model_load(fn, *modelp->model, n_ctx_override)) {
-      modelp->kvcache = std::make_unique<mpt_kvcache>(*modelp->model);
+    if (mpt_model_load(fn, *modelp->model, params->n_ctx_override)) {
+      if (params->head_clusters > 0) {
+        modelp->model->head_index = mpt_head_index_build(
+            modelp->model->wte, params->head_clusters, modelp->n_threads);
+      }
+      if (kv_params.block_size > 0) {
+        auto pool =
+            std::make_shared<mpt_kv_pool>(modelp->model->hparams, kv_params);
+        modelp->kvcache = std::make_unique<mpt_kvcache>(pool);
+        if (params->prefix_cache_bytes > 0) {
+          const size_t block_bytes =
+              modelp->model->hparams.n_layer *
+              (pool->k_layer_bytes + pool->v_layer_bytes);
+          modelp->prefix_cache = std::make_shared<mpt_prefix_cache>(
+              pool, params->prefix_cache_bytes / block_bytes);
+        }
+      } else {
+        modelp->kvcache =
+            std::make_unique<mpt_kvcache>(*modelp->model, kv_params);
+      }
+      // size the eval buffers now, as this writes to the start of the cache
+      // and must not clobber a state loaded later
+      std::vector<float> dummy_logits;
+      mpt_eval_cpp(*modelp->model, *modelp->kvcache, modelp->n_threads, 0,
+                   {1, 2, 3, 4}, dummy_logits, modelp->mem_per_token);
+      modelp->kvcache->truncate(0);
       *handle = reinterpret_cast<minmpt_handle>(modelp);
       return MINMPT_OK;
     }
   } catch (...) {
-    delete modelp;
   }
+  delete modelp;
   return MINMPT_FAILURE;
 }
 
@@ -43,13 +195,25 @@ void minmpt_fork(minmpt_handle handle, minmpt_handle *child) {
   auto modelp = from_handle_const(handle);
   auto newp = new minmpt_session;
   newp->mem_per_token = modelp->mem_per_token;
+  newp->n_threads = modelp->n_threads;
   newp->model = modelp->model;
-  newp->kvcache = std::make_unique<mpt_kvcache>(*modelp->model);
-  memcpy(newp->kvcache->memory_k->data, modelp->kvcache->memory_k->data,
-         ggml_nbytes(newp->kvcache->memory_k));
-  memcpy(newp->kvcache->memory_v->data, modelp->kvcache->memory_v->data,
-         ggml_nbytes(newp->kvcache->memory_v));
   newp->n_past = modelp->n_past;
+  newp->tokens = modelp->tokens;
+  newp->logits = modelp->logits;
+  newp->ctx_shift = modelp->ctx_shift;
+  newp->ctx_keep = modelp->ctx_keep;
+  newp->ctx_discard = modelp->ctx_discard;
+  newp->kv_evict = modelp->kv_evict;
+  newp->kv_budget = modelp->kv_budget;
+  newp->kv_recent = modelp->kv_recent;
+  newp->head_candidates = modelp->head_candidates;
+  newp->n_sink = modelp->n_sink;
+  newp->n_window_start = modelp->n_window_start;
+  newp->n_dropped = modelp->n_dropped;
+  // paged caches share blocks, dense caches copy only the first n_past
+  newp->prefix_cache = modelp->prefix_cache;
+  newp->kvcache =
+      mpt_kv_fork(*modelp->model, *modelp->kvcache, modelp->n_past);
   *child = reinterpret_cast<minmpt_handle>(newp);
 }
 
@@ -69,18 +233,52 @@ size_t minmpt_n_past(minmpt_handle handle) {
   return modelp->n_past;
 }
 
+size_t minmpt_n_dropped(minmpt_handle handle) {
+  auto modelp = from_handle(handle);
+  return modelp->n_dropped;
+}
+
 void minmpt_rewind(minmpt_handle handle, size_t n) {
   auto modelp = from_handle(handle);
-  if (modelp->n_past > n) {
-    modelp->n_past -= n;
+  // rewinds the token stream. going back past the window leaves the sinks
+  // and counts the rest of the stream as dropped
+  const size_t n_sink = modelp->n_sink;
+  const size_t pos = modelp->n_past + modelp->n_dropped;
+  const size_t target = pos > n ? pos - n : 0;
+  if (target >= modelp->n_window_start + modelp->n_dropped) {
+    modelp->n_past = target - modelp->n_dropped;
+  } else if (target <= n_sink) {
+    modelp->n_past = target;
+    modelp->n_window_start = 0;
+    modelp->n_dropped = 0;
   } else {
-    modelp->n_past = 0;
+    modelp->n_past = n_sink;
+    modelp->n_window_start = n_sink;
+    modelp->n_dropped = target - n_sink;
   }
+  modelp->tokens.resize(modelp->n_past);
+  modelp->kvcache->truncate(modelp->n_past);
 }
 
 void minmpt_reset_ctx(minmpt_handle handle) {
   auto modelp = from_handle(handle);
   modelp->n_past = 0;
+  modelp->n_window_start = 0;
+  modelp->n_dropped = 0;
+  modelp->tokens.clear();
+  modelp->kvcache->truncate(0);
+}
+
+size_t minmpt_kv_bytes(minmpt_handle handle) {
+  auto modelp = from_handle(handle);
+  const auto &kvcache = *modelp->kvcache;
+  const size_t n_layer = modelp->model->hparams.n_layer;
+  const size_t block_bytes =
+      n_layer * (kvcache.k_layer_bytes + kvcache.v_layer_bytes);
+  if (kvcache.paged()) {
+    return kvcache.pool->n_allocated() * block_bytes;
+  }
+  return block_bytes;
 }
 
 void minmpt_set_n_threads(minmpt_handle handle, unsigned int n_threads) {
@@ -88,27 +286,652 @@ void minmpt_set_n_threads(minmpt_handle handle, unsigned int n_threads) {
   modelp->n_threads = n_threads > 0 ? n_threads : 4;
 }
 
+void minmpt_set_head_candidates(minmpt_handle handle, size_t n_candidates) {
+  auto modelp = from_handle(handle);
+  modelp->head_candidates = n_candidates;
+}
+
+// positions the cache may hold before shifting
+static size_t kv_limit(const minmpt_session &session) {
+  const size_t n_ctx = session.model->hparams.n_ctx;
+  if (!session.ctx_shift || session.kv_budget == 0) {
+    return n_ctx;
+  }
+  return std::min(session.kv_budget, n_ctx);
+}
+
+// evicts n_discard of the positions [n_keep, n_past - kv_recent) per layer,
+// those with the least attention mass, heavy-hitter style
+static minmpt_error evict_h2o(minmpt_session &session, size_t n_keep,
+                              size_t n_discard) {
+  const auto &hparams = session.model->hparams;
+  auto &kvcache = *session.kvcache;
+  const size_t n_past = session.n_past;
+  const size_t n_end = n_past - session.kv_recent;
+
+  std::vector<std::vector<int>> keep(hparams.n_layer);
+  std::vector<int> candidates;
+  for (int il = 0; il < hparams.n_layer; ++il) {
+    const float *mass = kvcache.attn_mass.data() + (size_t)il * hparams.n_ctx;
+    candidates.resize(n_end - n_keep);
+    for (size_t i = 0; i < candidates.size(); ++i) {
+      candidates[i] = n_keep + i;
+    }
+    // the heaviest stay, in position order. ties evict the older first
+    auto lighter = [&](int a, int b) {
+      return mass[a] < mass[b] || (mass[a] == mass[b] && a < b);
+    };
+    std::nth_element(candidates.begin(), candidates.begin() + n_discard,
+                     candidates.end(), lighter);
+    std::sort(candidates.begin() + n_discard, candidates.end());
+    auto &k = keep[il];
+    k.reserve(n_past - n_discard);
+    for (size_t i = 0; i < n_keep; ++i) {
+      k.push_back(i);
+    }
+    k.insert(k.end(), candidates.begin() + n_discard, candidates.end());
+    for (size_t i = n_end; i < n_past; ++i) {
+      k.push_back(i);
+    }
+  }
+  if (!mpt_kv_evict(kvcache, hparams, keep, n_past)) {
+    return MINMPT_KV_FULL;
+  }
+
+  // layers keep different tokens, the session follows the first
+  std::vector<uint32_t> tokens(keep[0].size());
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    tokens[i] = session.tokens[keep[0][i]];
+  }
+  session.tokens = std::move(tokens);
+  session.n_past -= n_discard;
+  session.n_window_start = session.n_past - session.kv_recent;
+  return MINMPT_OK;
+}
+
+// makes room for n_tokens more by dropping tokens after the sinks
+static minmpt_error shift_context(minmpt_session &session, size_t n_tokens) {
+  const size_t n_keep = session.n_dropped > 0
+                            ? session.n_sink
+                            : std::min(session.ctx_keep, session.n_past);
+  const bool h2o = session.kv_evict == MINMPT_KV_EVICT_H2O;
+  const size_t n_fixed = n_keep + (h2o ? session.kv_recent : 0);
+  if (session.n_past < n_fixed) {
+    return MINMPT_CTX_LIMIT;
+  }
+  const size_t n_window = session.n_past - n_fixed;
+  size_t n_discard =
+      session.ctx_discard > 0 ? session.ctx_discard : n_window / 2;
+  n_discard =
+      std::max(n_discard, session.n_past + n_tokens - kv_limit(session));
+  if (n_discard > n_window) {
+    return MINMPT_CTX_LIMIT;
+  }
+  if (h2o) {
+    const minmpt_error err = evict_h2o(session, n_keep, n_discard);
+    if (err != MINMPT_OK) {
+      return err;
+    }
+  } else {
+    if (!mpt_kv_shift(*session.kvcache, session.model->hparams, n_keep,
+                      n_discard, session.n_past)) {
+      return MINMPT_KV_FULL;
+    }
+    session.tokens.erase(session.tokens.begin() + n_keep,
+                         session.tokens.begin() + n_keep + n_discard);
+    session.n_past -= n_discard;
+    session.n_window_start = n_keep;
+  }
+  session.n_sink = n_keep;
+  session.n_dropped += n_discard;
+  return MINMPT_OK;
+}
+
+// after a shift the cached keys depend on dropped tokens, so they are no
+// longer what evaluating the tokens in the cache would give
+static mpt_prefix_cache *eval_prefix_cache(const minmpt_session &session) {
+  return session.n_dropped == 0 ? session.prefix_cache.get() : nullptr;
+}
+
+// gives back the last n_attached tokens eval_prepare took from the prefix
+// cache, when the batch they started fails. a context shift it made stays,
+// but leaves the session ready for the same tokens
+static void eval_abort(minmpt_session &session, size_t n_attached) {
+  session.n_past -= n_attached;
+  session.tokens.resize(session.n_past);
+  session.kvcache->truncate(session.n_past);
+}
+
+// everything before evaluating tokens: shifts the context if needed, takes
+// cached blocks for the start of the batch, advancing tokens past them, and
+// makes room in the kv cache. the last n_logits tokens are always evaluated.
+// on failure the tokens are left for another try
+static minmpt_error eval_prepare(minmpt_session &session,
+                                 const uint32_t *&tokens, size_t &n_tokens,
+                                 size_t n_logits = 1) {
+  if (session.n_past + n_tokens > kv_limit(session)) {
+    if (!session.ctx_shift) {
+      return MINMPT_CTX_LIMIT;
+    }
+    const minmpt_error err = shift_context(session, n_tokens);
+    if (err != MINMPT_OK) {
+      return err;
+    }
+  }
+  mpt_prefix_cache *prefix_cache = eval_prefix_cache(session);
+  size_t n_attached = 0;
+  if (prefix_cache && n_tokens > n_logits) {
+    // take cached blocks for the start of the batch
+    session.tokens.insert(session.tokens.end(), tokens, tokens + n_tokens);
+    const size_t n_past = prefix_cache->attach(
+        *session.kvcache, session.tokens.data(), session.n_past,
+        session.n_past + n_tokens - (n_logits - 1));
+    n_attached = n_past - session.n_past;
+    tokens += n_attached;
+    n_tokens -= n_attached;
+    session.n_past = n_past;
+    session.tokens.resize(n_past);
+  }
+  while (!session.kvcache->reserve(session.n_past, n_tokens)) {
+    // each eviction returns a block held only by the prefix cache to the
+    // pool. once none is left, the blocks in use belong to sessions
+    if (!prefix_cache || !prefix_cache->evict()) {
+      tokens -= n_attached;
+      n_tokens += n_attached;
+      eval_abort(session, n_attached);
+      return MINMPT_KV_FULL;
+    }
+  }
+  return MINMPT_OK;
+}
+
+// records evaluated tokens and the logits after the last of them, if any
+static void eval_finish(minmpt_session &session, const uint32_t *tokens,
+                        size_t n_tokens, const float *logits) {
+  mpt_prefix_cache *prefix_cache = eval_prefix_cache(session);
+  const size_t bs = session.kvcache->block_size;
+  const bool filled_block =
+      session.n_past / bs < (session.n_past + n_tokens) / bs;
+  session.n_past += n_tokens;
+  session.tokens.insert(session.tokens.end(), tokens, tokens + n_tokens);
+  // logits evaluated into the session's own buffer are moved to its start
+  const size_t n_vocab = session.model->hparams.n_vocab;
+  if (!logits) {
+    session.logits.clear();
+  } else {
+    if (logits != session.logits.data()) {
+      session.logits.resize(std::max(session.logits.size(), n_vocab));
+      std::copy(logits, logits + n_vocab, session.logits.begin());
+    }
+    session.logits.resize(n_vocab);
+  }
+  if (prefix_cache && filled_block) {
+    prefix_cache->insert(*session.kvcache, session.tokens.data(),
+                         session.n_past);
+  }
+}
+
 minmpt_error minmpt_eval_logits(minmpt_handle handle, const uint32_t *tokens,
                                 size_t n_tokens, float *logits) {
+  return minmpt_eval_logits_n(handle, tokens, n_tokens, 1, logits);
+}
+
+// evaluates tokens, writing the logits after the last n_logits of them,
+// only for the allowed tokens if any
+static minmpt_error eval_logits(minmpt_session &session,
+                                const uint32_t *tokens, size_t n_tokens,
+                                size_t n_logits, const uint32_t *allowed,
+                                size_t n_allowed, float *logits) {
+  if (n_logits == 0 || n_logits > n_tokens) {
+    return MINMPT_INVALID;
+  }
+  const size_t n_given = n_tokens;
+  const minmpt_error err = eval_prepare(session, tokens, n_tokens, n_logits);
+  if (err != MINMPT_OK) {
+    return err;
+  }
+  const size_t n_vocab = session.model->hparams.n_vocab;
+  if (!logits) {
+    session.logits.resize(n_logits * n_vocab);
+    logits = session.logits.data();
+  }
+  mpt_eval_seq seq = {session.kvcache.get(), (int)session.n_past, tokens,
+                      (int)n_tokens, logits};
+  seq.n_logits = (int)n_logits;
+  seq.n_candidates = (int)std::min(session.head_candidates, n_vocab);
+  seq.allowed = allowed;
+  seq.n_allowed = (int)n_allowed;
+  if (!mpt_eval_batch(*session.model, session.n_threads, &seq, 1,
+                      session.mem_per_token)) {
+    printf("Failed to predict\n");
+    eval_abort(session, n_given - n_tokens);
+    return MINMPT_FAILURE;
+  }
+  eval_finish(session, tokens, n_tokens, logits + (n_logits - 1) * n_vocab);
+  return MINMPT_OK;
+}
+
+minmpt_error minmpt_eval_logits_n(minmpt_handle handle, const uint32_t *tokens,
+                                  size_t n_tokens, size_t n_logits,
+                                  float *logits) {
+  return eval_logits(*from_handle(handle), tokens, n_tokens, n_logits,
+                     nullptr, 0, logits);
+}
+
+minmpt_error minmpt_eval_logits_allowed(minmpt_handle handle,
+                                        const uint32_t *tokens,
+                                        size_t n_tokens,
+                                        const uint32_t *allowed,
+                                        size_t n_allowed, float *logits) {
   auto modelp = from_handle(handle);
-  if (modelp->n_past + n_tokens > (size_t)modelp->model->hparams.n_ctx) {
-    return MINMPT_CTX_LIMIT;
+  const size_t n_vocab = modelp->model->hparams.n_vocab;
+  if (!allowed || n_allowed == 0 ||
+      std::any_of(allowed, allowed + n_allowed,
+                  [n_vocab](uint32_t token) { return token >= n_vocab; })) {
+    return MINMPT_INVALID;
+  }
+  return eval_logits(*modelp, tokens, n_tokens, 1, allowed, n_allowed,
+                     logits);
+}
+
+minmpt_error minmpt_eval_top_k(minmpt_handle handle, const uint32_t *tokens,
+                               size_t n_tokens, size_t k, uint32_t *top_tokens,
+                               float *top_logprobs) {
+  auto modelp = from_handle(handle);
+  if (n_tokens == 0 || k == 0 || k > minmpt_n_vocab(handle)) {
+    return MINMPT_INVALID;
   }
-  if (modelp->mem_per_token == 0) {
-    std::vector<float> dummy_logits;
-    mpt_eval_cpp(*modelp->model, *modelp->kvcache, modelp->n_threads, 0,
-                 {1, 2, 3, 4}, dummy_logits, modelp->mem_per_token);
+  const size_t n_given = n_tokens;
+  const minmpt_error err = eval_prepare(*modelp, tokens, n_tokens);
+  if (err != MINMPT_OK) {
+    return err;
   }
-  if (!mpt_eval(*modelp->model, *modelp->kvcache, modelp->n_threads,
-                modelp->n_past, tokens, n_tokens, logits,
-                modelp->mem_per_token)) {
+  mpt_eval_seq seq = {modelp->kvcache.get(), (int)modelp->n_past, tokens,
+                      (int)n_tokens, nullptr};
+  seq.top_k = (int)k;
+  seq.top_tokens = top_tokens;
+  seq.top_logprobs = top_logprobs;
+  if (!mpt_eval_batch(*modelp->model, modelp->n_threads, &seq, 1,
+                      modelp->mem_per_token)) {
     printf("Failed to predict\n");
+    eval_abort(*modelp, n_given - n_tokens);
     return MINMPT_FAILURE;
   }
-  modelp->n_past += n_tokens;
+  eval_finish(*modelp, tokens, n_tokens, nullptr);
+  return MINMPT_OK;
+}
+
+minmpt_error minmpt_eval_batch(const minmpt_handle *handles,
+                               const uint32_t *const *tokens,
+                               const size_t *n_tokens, size_t n_seqs,
+                               float *const *logits, minmpt_error *errors) {
+  if (n_seqs == 0) {
+    return MINMPT_INVALID;
+  }
+  auto first = from_handle(handles[0]);
+  for (size_t i = 0; i < n_seqs; ++i) {
+    auto modelp = from_handle(handles[i]);
+    if (modelp->model != first->model || n_tokens[i] == 0 ||
+        std::find(handles, handles + i, handles[i]) != handles + i) {
+      return MINMPT_INVALID;
+    }
+  }
+
+  // sessions failing to prepare are left out of the batch. the first
+  // error is returned once the others are evaluated
+  minmpt_error err = MINMPT_OK;
+  std::vector<minmpt_session *> sessions;
+  std::vector<size_t> indices;
+  std::vector<mpt_eval_seq> seqs;
+  for (size_t i = 0; i < n_seqs; ++i) {
+    auto modelp = from_handle(handles[i]);
+    const uint32_t *seq_tokens = tokens[i];
+    size_t seq_n_tokens = n_tokens[i];
+    const minmpt_error seq_err =
+        eval_prepare(*modelp, seq_tokens, seq_n_tokens);
+    if (errors) {
+      errors[i] = seq_err;
+    }
+    if (seq_err != MINMPT_OK) {
+      err = err == MINMPT_OK ? seq_err : err;
+      continue;
+    }
+    sessions.push_back(modelp);
+    indices.push_back(i);
+    seqs.push_back({modelp->kvcache.get(), (int)modelp->n_past, seq_tokens,
+                    (int)seq_n_tokens, logits[i]});
+    seqs.back().n_candidates = (int)std::min(
+        modelp->head_candidates, (size_t)modelp->model->hparams.n_vocab);
+  }
+  if (seqs.empty()) {
+    return err;
+  }
+  if (!mpt_eval_batch(*first->model, first->n_threads, seqs.data(),
+                      seqs.size(), first->mem_per_token)) {
+    printf("Failed to predict\n");
+    // none of the batch took its tokens
+    for (size_t i = 0; i < seqs.size(); ++i) {
+      eval_abort(*sessions[i], n_tokens[indices[i]] - seqs[i].n_tokens);
+      if (errors) {
+        errors[indices[i]] = MINMPT_FAILURE;
+      }
+    }
+    return MINMPT_FAILURE;
+  }
+  for (size_t i = 0; i < seqs.size(); ++i) {
+    eval_finish(*sessions[i], seqs[i].tokens, seqs[i].n_tokens,
+                seqs[i].logits);
+  }
+  return err;
+}
+
+minmpt_error minmpt_eval_cfg(minmpt_handle pos, const uint32_t *pos_tokens,
+                             size_t n_pos, minmpt_handle neg,
+                             const uint32_t *neg_tokens, size_t n_neg,
+                             float cfg_scale, float *logits) {
+  const size_t n_vocab = from_handle(pos)->model->hparams.n_vocab;
+  std::vector<float> neg_logits(n_vocab);
+  const minmpt_handle handles[2] = {pos, neg};
+  const uint32_t *const tokens[2] = {pos_tokens, neg_tokens};
+  const size_t n_tokens[2] = {n_pos, n_neg};
+  float *const out[2] = {logits, neg_logits.data()};
+  minmpt_error errors[2] = {MINMPT_FAILURE, MINMPT_FAILURE};
+  const minmpt_error err =
+      minmpt_eval_batch(handles, tokens, n_tokens, 2, out, errors);
+  if (err != MINMPT_OK) {
+    // the side that took its tokens gives them back, keeping pos and neg
+    // in step for a retry
+    for (int i = 0; i < 2; ++i) {
+      if (errors[i] == MINMPT_OK) {
+        minmpt_rewind(handles[i], n_tokens[i]);
+      }
+    }
+    return err;
+  }
+  for (size_t i = 0; i < n_vocab; ++i) {
+    // a token the approximate head left out of neg keeps its pos logit
+    if (neg_logits[i] != -INFINITY) {
+      logits[i] = cfg_scale * (logits[i] - neg_logits[i]) + neg_logits[i];
+    }
+  }
+  return MINMPT_OK;
+}
+
+void minmpt_get_kv_usage(minmpt_handle handle, minmpt_kv_usage *usage) {
+  auto modelp = from_handle(handle);
+  *usage = {};
+  const auto &kvcache = *modelp->kvcache;
+  if (!kvcache.paged()) {
+    return;
+  }
+  usage->block_size = kvcache.block_size;
+  usage->n_used = kvcache.pool->n_used();
+  usage->n_max = kvcache.pool->params.max_blocks;
+  if (modelp->prefix_cache) {
+    usage->n_cached = modelp->prefix_cache->stats().n_blocks;
+  }
+}
+
+void minmpt_get_prefix_cache_stats(minmpt_handle handle,
+                                   minmpt_prefix_cache_stats *stats) {
+  auto modelp = from_handle(handle);
+  *stats = {};
+  if (!modelp->prefix_cache) {
+    return;
+  }
+  const auto &kvcache = *modelp->kvcache;
+  const mpt_prefix_cache_stats counters = modelp->prefix_cache->stats();
+  stats->n_lookups = counters.n_lookups;
+  stats->n_hits = counters.n_hits;
+  stats->n_tokens_reused = counters.n_tokens_reused;
+  stats->n_blocks = counters.n_blocks;
+  stats->n_bytes = counters.n_blocks * modelp->model->hparams.n_layer *
+                   (kvcache.k_layer_bytes + kvcache.v_layer_bytes);
+}
+
+void minmpt_get_kv_io_stats(minmpt_handle handle, minmpt_kv_io_stats *stats) {
+  auto modelp = from_handle(handle);
+  *stats = {};
+  const auto &kvcache = *modelp->kvcache;
+  if (!kvcache.paged()) {
+    return;
+  }
+  const mpt_kv_io_stats io = kvcache.pool->io_stats();
+  stats->n_tokens = io.n_tokens;
+  stats->n_read_bytes = io.n_read_bytes;
+  stats->n_paged_out_bytes = io.n_paged_out_bytes;
+  stats->stall_us = io.stall_us;
+}
+
+void minmpt_tokens(minmpt_handle handle, uint32_t *tokens) {
+  auto modelp = from_handle(handle);
+  std::copy(modelp->tokens.begin(), modelp->tokens.end(), tokens);
+}
+
+#define MINMPT_STATE_MAGIC 0x6d707473 // mpts
+#define MINMPT_STATE_VERSION 3
+
+// followed by n_past tokens, n_vocab logits and the kv cache positions
+// [0, n_past) as written by mpt_kv_visit
+struct minmpt_state_header {
+  uint32_t magic;
+  uint32_t version;
+  int32_t n_vocab;
+  int32_t n_embd;
+  int32_t n_head;
+  int32_t n_layer;
+  int32_t kv_layout;
+  int32_t kv_type_k;
+  int32_t kv_type_v;
+  uint32_t n_past;
+  uint32_t n_sink;
+  uint32_t n_window_start;
+  uint32_t n_dropped;
+};
+
+static minmpt_state_header state_header(const minmpt_session &session) {
+  const auto &hparams = session.model->hparams;
+  const auto &kv_params = session.kvcache->params;
+  minmpt_state_header header;
+  header.magic = MINMPT_STATE_MAGIC;
+  header.version = MINMPT_STATE_VERSION;
+  header.n_vocab = hparams.n_vocab;
+  header.n_embd = hparams.n_embd;
+  header.n_head = hparams.n_head;
+  header.n_layer = hparams.n_layer;
+  header.kv_layout = kv_params.layout;
+  header.kv_type_k = kv_params.type_k;
+  header.kv_type_v = kv_params.type_v;
+  header.n_past = session.n_past;
+  header.n_sink = session.n_sink;
+  header.n_window_start = session.n_window_start;
+  header.n_dropped = session.n_dropped;
+  return header;
+}
+
+minmpt_error minmpt_save_state(minmpt_handle handle, const char *filename,
+                               size_t fnlen) {
+  auto modelp = from_handle(handle);
+  const auto &hparams = modelp->model->hparams;
+  const minmpt_state_header header = state_header(*modelp);
+  std::vector<float> logits(modelp->logits);
+  logits.resize(hparams.n_vocab);
+
+  std::string fn(filename, fnlen);
+  FILE *f = fopen(fn.c_str(), "wb");
+  if (!f) {
+    fprintf(stderr, "%s: failed to open '%s'\n", __func__, fn.c_str());
+    return MINMPT_FAILURE;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+  ok = ok && fwrite(modelp->tokens.data(), sizeof(uint32_t), header.n_past,
+                    f) == header.n_past;
+  ok = ok && fwrite(logits.data(), sizeof(float), logits.size(), f) ==
+                 logits.size();
+  mpt_kv_visit(*modelp->kvcache, hparams, header.n_past,
+               [&](char *data, size_t size) {
+                 ok = ok && fwrite(data, 1, size, f) == size;
+               });
+  ok = fclose(f) == 0 && ok;
+  if (!ok) {
+    fprintf(stderr, "%s: failed to write '%s'\n", __func__, fn.c_str());
+    return MINMPT_FAILURE;
+  }
+  return MINMPT_OK;
+}
+
+minmpt_error minmpt_load_state(minmpt_handle handle, const char *filename,
+                               size_t fnlen, float *logits) {
+  auto modelp = from_handle(handle);
+  const auto &hparams = modelp->model->hparams;
+
+  std::string fn(filename, fnlen);
+  int fd = open(fn.c_str(), O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "%s: failed to open '%s'\n", __func__, fn.c_str());
+    return MINMPT_FAILURE;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(minmpt_state_header)) {
+    close(fd);
+    return MINMPT_INVALID;
+  }
+  const size_t file_size = st.st_size;
+  void *addr = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    return MINMPT_FAILURE;
+  }
+  const char *data = (const char *)addr;
+
+  minmpt_state_header header;
+  memcpy(&header, data, sizeof(header));
+  minmpt_state_header expected = state_header(*modelp);
+  expected.n_past = header.n_past;
+  expected.n_sink = header.n_sink;
+  expected.n_window_start = header.n_window_start;
+  expected.n_dropped = header.n_dropped;
+  const size_t size = sizeof(header) + header.n_past * sizeof(uint32_t) +
+                      hparams.n_vocab * sizeof(float) +
+                      mpt_kv_visit_size(modelp->kvcache->params, hparams,
+                                        header.n_past);
+  minmpt_error err = MINMPT_OK;
+  if (memcmp(&header, &expected, sizeof(header)) != 0 || file_size != size) {
+    fprintf(stderr, "%s: '%s' does not match this model and kv cache\n",
+            __func__, fn.c_str());
+    err = MINMPT_INVALID;
+  } else if (header.n_past > (size_t)hparams.n_ctx) {
+    err = MINMPT_CTX_LIMIT;
+  } else {
+    modelp->n_past = 0;
+    modelp->tokens.clear();
+    modelp->kvcache->truncate(0);
+    if (!modelp->kvcache->reserve(0, header.n_past)) {
+      err = MINMPT_KV_FULL;
+    }
+  }
+  if (err != MINMPT_OK) {
+    munmap(addr, file_size);
+    return err;
+  }
+
+  data += sizeof(header);
+  const uint32_t *tokens = (const uint32_t *)data;
+  modelp->tokens.assign(tokens, tokens + header.n_past);
+  data += header.n_past * sizeof(uint32_t);
+  const float *state_logits = (const float *)data;
+  modelp->logits.assign(state_logits, state_logits + hparams.n_vocab);
+  if (logits) {
+    std::copy(modelp->logits.begin(), modelp->logits.end(), logits);
+  }
+  data += hparams.n_vocab * sizeof(float);
+  mpt_kv_visit(*modelp->kvcache, hparams, header.n_past,
+               [&](char *dst, size_t size) {
+                 memcpy(dst, data, size);
+                 data += size;
+               });
+  modelp->n_past = header.n_past;
+  modelp->n_sink = header.n_sink;
+  modelp->n_window_start = header.n_window_start;
+  modelp->n_dropped = header.n_dropped;
+  // attention mass is not saved, eviction starts over from the load
+  auto &attn_mass = modelp->kvcache->attn_mass;
+  std::fill(attn_mass.begin(), attn_mass.end(), 0.0f);
+  if (modelp->prefix_cache && modelp->n_dropped == 0) {
+    modelp->prefix_cache->insert(*modelp->kvcache, modelp->tokens.data(),
+                                 modelp->n_past);
+  }
+
+  munmap(addr, file_size);
   return MINMPT_OK;
 }
 void minmpt_free(minmpt_handle handle) {
   auto modelp = from_handle(handle);
   delete modelp;
 }
+
+static mpt_sampler *sampler_from_handle(minmpt_sampler_handle h) {
+  return reinterpret_cast<mpt_sampler *>(h);
+}
+
+minmpt_sampler_params minmpt_sampler_default_params(void) {
+  minmpt_sampler_params params;
+  params.temperature = 1.0f;
+  params.top_k = 0;
+  params.top_p = 1.0f;
+  params.min_p = 0.0f;
+  params.repeat_penalty = 1.0f;
+  params.repeat_last_n = 64;
+  params.mirostat = 0;
+  params.mirostat_tau = 6.28f;
+  params.mirostat_eta = 1.0f;
+  params.seed = 0;
+  return params;
+}
+
+minmpt_error minmpt_sampler_create(const minmpt_sampler_params *params,
+                                   minmpt_sampler_handle *sampler) {
+  if (params->temperature < 0.0f || !(params->top_p > 0.0f) ||
+      params->top_p > 1.0f || params->min_p < 0.0f || params->min_p > 1.0f ||
+      !(params->repeat_penalty > 0.0f)) {
+    return MINMPT_INVALID;
+  }
+  auto samplerp = new mpt_sampler;
+  samplerp->temperature = params->temperature;
+  samplerp->top_k = params->top_k;
+  samplerp->top_p = params->top_p;
+  samplerp->min_p = params->min_p;
+  samplerp->repeat_penalty = params->repeat_penalty;
+  samplerp->repeat_last_n = params->repeat_last_n;
+  samplerp->mirostat = params->mirostat != 0;
+  samplerp->mirostat_tau = params->mirostat_tau;
+  samplerp->mirostat_eta = params->mirostat_eta;
+  samplerp->mirostat_mu = 2.0f * params->mirostat_tau;
+  samplerp->rng.seed(params->seed ? params->seed : std::random_device()());
+  *sampler = reinterpret_cast<minmpt_sampler_handle>(samplerp);
+  return MINMPT_OK;
+}
+
+minmpt_error minmpt_sample_next(minmpt_handle handle,
+                                minmpt_sampler_handle sampler, uint32_t *token,
+                                float *logprob, size_t n_top,
+                                uint32_t *top_tokens, float *top_logprobs) {
+  auto modelp = from_handle(handle);
+  auto samplerp = sampler_from_handle(sampler);
+  const size_t n_vocab = modelp->model->hparams.n_vocab;
+  if (modelp->logits.size() != n_vocab) {
+    return MINMPT_INVALID;
+  }
+  const float *logits = modelp->logits.data();
+  *token = mpt_sampler_next(*samplerp, logits, n_vocab, modelp->tokens.data(),
+                            modelp->tokens.size());
+  if (logprob || (n_top > 0 && (top_tokens || top_logprobs))) {
+    mpt_sampler_logprobs(*samplerp, logits, n_vocab, *token, logprob, n_top,
+                         top_tokens, top_logprobs);
+  }
+  return MINMPT_OK;
+}
+
+void minmpt_sampler_free(minmpt_sampler_handle sampler) {
+  delete sampler_from_handle(sampler);
+}
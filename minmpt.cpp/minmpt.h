@@ -8,26 +8,433 @@
 #define MINMPT_INVALID 1
 #define MINMPT_FAILURE 2
 #define MINMPT_CTX_LIMIT 3
+#define MINMPT_KV_FULL 4
+
+// kv cache layouts
+#define MINMPT_KV_LAYOUT_FLAT 0
+// keys head-major, values pre-transposed per head
+#define MINMPT_KV_LAYOUT_HEAD_MAJOR 1
+
+// kv cache types, quantized types store 32 value blocks with a shared scale
+#define MINMPT_KV_TYPE_F16 0
+#define MINMPT_KV_TYPE_Q8_0 1
+#define MINMPT_KV_TYPE_Q4_0 2
+#define MINMPT_KV_TYPE_Q4_1 3
+
+// what context shifting drops from the kv cache
+#define MINMPT_KV_EVICT_OLDEST 0
+// the positions that received the least attention so far, chosen per layer
+#define MINMPT_KV_EVICT_H2O 1
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 typedef void *minmpt_handle;
 typedef int minmpt_error;
+
+typedef struct minmpt_params {
+  // 0 to use the model's max_seq_len
+  size_t n_ctx_override;
+  // one of MINMPT_KV_LAYOUT_*
+  int kv_layout;
+  // MINMPT_KV_TYPE_* for keys and values. quantized values need the flat
+  // layout
+  int kv_type_k;
+  int kv_type_v;
+  // page the kv cache in blocks of this many positions, drawn as needed from
+  // a pool shared with forks. 0 allocates all n_ctx positions up front
+  int kv_block_size;
+  // most blocks the pool may hold, 0 for no limit
+  int kv_max_blocks;
+  // keep the blocks in a memory-mapped scratch file created at this path,
+  // NULL for RAM. needs kv_block_size. each session keeps its most recent
+  // kv_ram_bytes of blocks resident and pages older ones in per layer
+  const char *kv_disk_path;
+  size_t kv_ram_bytes;
+  // keep up to this many bytes of kv blocks keyed by the tokens they hold,
+  // so sessions sharing a prefix evaluate it once. needs kv_block_size
+  size_t prefix_cache_bytes;
+  // when a batch would run past n_ctx, drop the oldest tokens after the first
+  // ctx_keep instead of failing with MINMPT_CTX_LIMIT
+  int ctx_shift;
+  size_t ctx_keep;
+  // tokens dropped per shift, 0 for half of those after ctx_keep
+  size_t ctx_discard;
+  // one of MINMPT_KV_EVICT_*
+  int kv_evict;
+  // with ctx_shift, shift once the cache would hold more than this many
+  // positions instead of n_ctx. 0 for n_ctx
+  size_t kv_budget;
+  // the last kv_recent tokens are never evicted by MINMPT_KV_EVICT_H2O
+  size_t kv_recent;
+  // skip keys so far back that ALiBi scales their attention weight by less
+  // than this, per head. 0 attends to every position
+  float attn_prune_tol;
+  // cluster the rows of the output projection into this many groups at
+  // load, for an approximate head. 0 builds no index
+  size_t head_clusters;
+  // with the index, logits are computed for at least this many tokens, from
+  // the clusters best matching each output, and the rest are -INFINITY.
+  // fewer candidates are faster and more likely to miss a likely token. 0
+  // computes all of them
+  size_t head_candidates;
+} minmpt_params;
+
+typedef struct minmpt_prefix_cache_stats {
+  // evals of more than one token, which look for cached blocks
+  size_t n_lookups;
+  size_t n_hits;
+  size_t n_tokens_reused;
+  size_t n_blocks;
+  size_t n_bytes;
+} minmpt_prefix_cache_stats;
+
+typedef struct minmpt_kv_io_stats {
+  // tokens evaluated with the kv cache on disk
+  size_t n_tokens;
+  size_t n_read_bytes;
+  size_t n_paged_out_bytes;
+  // time attention waited for blocks to be read in
+  uint64_t stall_us;
+} minmpt_kv_io_stats;
+
+typedef struct minmpt_kv_usage {
+  // positions per block, 0 for a dense cache
+  size_t block_size;
+  // blocks held by sessions or the prefix cache
+  size_t n_used;
+  // blocks referenced by the prefix cache, which it gives back when the
+  // pool runs out
+  size_t n_cached;
+  // 0 for no limit
+  size_t n_max;
+} minmpt_kv_usage;
+
+minmpt_params minmpt_default_params(void);
 minmpt_error minmpt_load(minmpt_handle *handle, const char *filename,
                          size_t fnlen, size_t n_ctx_override);
+minmpt_error minmpt_load_with_params(minmpt_handle *handle,
+                                     const char *filename, size_t fnlen,
+                                     const minmpt_params *params);
 
 void minmpt_fork(minmpt_handle handle, minmpt_handle *child);
 
 size_t minmpt_n_vocab(minmpt_handle handle);
 size_t minmpt_n_past(minmpt_handle handle);
+// tokens dropped or evicted by context shifting, n_past + n_dropped is the
+// position in the token stream
+size_t minmpt_n_dropped(minmpt_handle handle);
+// rewinds the token stream by n
 void minmpt_rewind(minmpt_handle handle, size_t n);
 size_t minmpt_n_ctx(minmpt_handle handle);
 void minmpt_reset_ctx(minmpt_handle handle);
+// kv cache memory held for this session and the forks sharing its pool
+size_t minmpt_kv_bytes(minmpt_handle handle);
 void minmpt_set_n_threads(minmpt_handle handle, unsigned int n_threads);
+// the head_candidates of this session, 0 for exact logits
+void minmpt_set_head_candidates(minmpt_handle handle, size_t n_candidates);
+// logits may be NULL, leaving them in the session for minmpt_sample_next
 minmpt_error minmpt_eval_logits(minmpt_handle handle, const uint32_t *tokens,
                                 size_t n_tokens, float *logits);
+// like minmpt_eval_logits, writing the logits after each of the last
+// n_logits tokens, n_logits * n_vocab floats, to logits
+minmpt_error minmpt_eval_logits_n(minmpt_handle handle, const uint32_t *tokens,
+                                  size_t n_tokens, size_t n_logits,
+                                  float *logits);
+// like minmpt_eval_logits, computing logits only for the n_allowed tokens
+// of allowed, such as the labels of a classifier, and setting the others to
+// -INFINITY. a short list gathers only its rows of the output projection,
+// so the head costs in proportion to its length. the allowed logits are
+// exact even with head_candidates set
+minmpt_error minmpt_eval_logits_allowed(minmpt_handle handle,
+                                        const uint32_t *tokens,
+                                        size_t n_tokens,
+                                        const uint32_t *allowed,
+                                        size_t n_allowed, float *logits);
+// evaluates tokens and writes the k most likely next tokens, most likely
+// first, to top_tokens and their log probabilities to top_logprobs. the
+// head computes the logits a block of the vocabulary at a time, keeping only
+// the top k and the softmax normalizer, so no logits are written; the
+// session holds none afterwards for minmpt_sample_next
+minmpt_error minmpt_eval_top_k(minmpt_handle handle, const uint32_t *tokens,
+                               size_t n_tokens, size_t k, uint32_t *top_tokens,
+                               float *top_logprobs);
+// evaluates tokens[i][0, n_tokens[i]) in session handles[i] for each of the
+// n_seqs sessions, writing the logits of each to logits[i]. the sessions
+// must be distinct forks of one model; their tokens share each pass over
+// the weights. a session that cannot take its tokens is skipped and its
+// error returned after the others are evaluated. unless errors is NULL,
+// errors[i] is set to the error of session i: the sessions with MINMPT_OK
+// took their tokens and must not be given them again, the others are left
+// ready to retry theirs. if the batch itself fails, every session it held
+// gets MINMPT_FAILURE
+minmpt_error minmpt_eval_batch(const minmpt_handle *handles,
+                               const uint32_t *const *tokens,
+                               const size_t *n_tokens, size_t n_seqs,
+                               float *const *logits, minmpt_error *errors);
+// classifier-free guidance. evaluates pos_tokens in pos and neg_tokens in
+// neg, a fork of it, as a batch of two, and writes the guided logits
+// cfg_scale * (pos - neg) + neg to logits. either both sessions take their
+// tokens or, on error, neither does
+minmpt_error minmpt_eval_cfg(minmpt_handle pos, const uint32_t *pos_tokens,
+                             size_t n_pos, minmpt_handle neg,
+                             const uint32_t *neg_tokens, size_t n_neg,
+                             float cfg_scale, float *logits);
+// blocks of the kv cache pool shared by this session and its forks
+void minmpt_get_kv_usage(minmpt_handle handle, minmpt_kv_usage *usage);
+// counters of the prefix cache shared by this session and its forks
+void minmpt_get_prefix_cache_stats(minmpt_handle handle,
+                                   minmpt_prefix_cache_stats *stats);
+// disk i/o of the kv cache pool shared by this session and its forks
+void minmpt_get_kv_io_stats(minmpt_handle handle, minmpt_kv_io_stats *stats);
+// copies the n_past tokens in the kv cache to tokens
+void minmpt_tokens(minmpt_handle handle, uint32_t *tokens);
+// writes the tokens, the used part of the kv cache and the last logits to a
+// file, so a later session can continue without evaluating them again
+minmpt_error minmpt_save_state(minmpt_handle handle, const char *filename,
+                               size_t fnlen);
+// replaces the session's context with a saved state. the model and the kv
+// layout and types must match the saved session, the block size may differ.
+// the saved logits are copied to logits (n_vocab floats) unless it is NULL
+minmpt_error minmpt_load_state(minmpt_handle handle, const char *filename,
+                               size_t fnlen, float *logits);
 void minmpt_free(minmpt_handle handle);
+
+// continuous batching over forks of one session. sequences are submitted
+// and finished at any time; each step evaluates one token for every
+// sequence that is decoding and fills the rest of the batch with chunks of
+// the prompts still being prefilled, so long prompts do not stall the
+// others. prompts wait in a queue until the kv cache pool has room for them
+typedef void *minmpt_sched_handle;
+
+typedef struct minmpt_sched_params {
+  // most sequences holding a kv cache at once
+  size_t max_seqs;
+  // tokens evaluated per step, at least max_seqs
+  size_t max_batch_tokens;
+  // most prompt tokens one sequence prefills per step
+  size_t prefill_chunk;
+  // split this many cores between a prefill pool, run by a thread of the
+  // scheduler, and a decode pool, run by the thread calling
+  // minmpt_sched_step. prompts handed off to decoding keep their kv cache.
+  // at most the cores the creating thread may run on. 0 evaluates prompts
+  // and decode tokens together on the calling thread
+  size_t n_split_threads;
+  // the pools are resized by load, each keeping at least this many threads
+  size_t n_min_pool_threads;
+  // with a dense kv cache, where every sequence holds all n_ctx positions,
+  // most bytes of kv cache the running sequences may hold. 0 for no limit.
+  // a paged cache is bounded by the max_blocks of its pool instead
+  size_t max_kv_bytes;
+} minmpt_sched_params;
+
+typedef struct minmpt_sched_stats {
+  // sequences waiting for a kv cache and sequences holding one
+  size_t n_queued;
+  size_t n_running;
+  size_t n_steps;
+  // sequences sent back to the queue when the pool ran out
+  size_t n_preempted;
+  // the last step. with split pools n_prefill_tokens counts the last batch
+  // of the prefill pool
+  size_t n_batch_seqs;
+  size_t n_batch_tokens;
+  size_t n_prefill_tokens;
+  uint64_t step_us;
+  // over all steps
+  size_t n_tokens_total;
+  uint64_t step_us_total;
+  uint64_t step_us_max;
+  // the current split of n_split_threads
+  size_t n_decode_threads;
+  size_t n_prefill_threads;
+} minmpt_sched_stats;
+
+minmpt_sched_params minmpt_sched_default_params(void);
+// sequences start as forks of base, continuing its context. base must
+// outlive the scheduler
+minmpt_error minmpt_sched_create(minmpt_handle base,
+                                 const minmpt_sched_params *params,
+                                 minmpt_sched_handle *sched);
+// queues a sequence starting with prompt[0, n_tokens)
+minmpt_error minmpt_sched_submit(minmpt_sched_handle sched,
+                                 const uint32_t *prompt, size_t n_tokens,
+                                 uint64_t *id);
+// admits queued sequences and evaluates one batch. n_ready, unless NULL, is
+// set to the number of sequences waiting for a token. with split pools, the
+// batch holds only decode tokens, and a step with none waits for a prompt
+// to be evaluated
+minmpt_error minmpt_sched_step(minmpt_sched_handle sched, size_t *n_ready);
+// writes up to max_ids of the sequences waiting for a token to ids, in
+// submission order, and returns how many there are. sequences that failed
+// are included until finished
+size_t minmpt_sched_ready(minmpt_sched_handle sched, uint64_t *ids,
+                          size_t max_ids);
+// the logits after the last token of a waiting sequence, valid until its
+// next step. returns the error of a failed sequence
+minmpt_error minmpt_sched_logits(minmpt_sched_handle sched, uint64_t id,
+                                 const float **logits);
+// appends a token to a waiting sequence, evaluated by a later step
+minmpt_error minmpt_sched_push(minmpt_sched_handle sched, uint64_t id,
+                               uint32_t token);
+// drops a sequence, queued or not, and its kv cache
+void minmpt_sched_finish(minmpt_sched_handle sched, uint64_t id);
+void minmpt_sched_get_stats(minmpt_sched_handle sched,
+                            minmpt_sched_stats *stats);
+void minmpt_sched_free(minmpt_sched_handle sched);
+
+// speculative decoding. a draft model, smaller and sharing the vocabulary,
+// proposes n_draft tokens which the target evaluates in one pass, keeping
+// those that rejection sampling accepts. the tokens are distributed as if
+// sampled from the target alone at the given temperature. without a draft
+// model, the tokens that followed an earlier occurrence of the last few
+// tokens of the context are proposed instead (prompt lookup)
+typedef void *minmpt_spec_handle;
+
+typedef struct minmpt_spec_params {
+  // tokens drafted per round
+  size_t n_draft;
+  // 0 for greedy
+  float temperature;
+  // 0 for a random seed
+  uint64_t seed;
+  // lengths of the n-grams prompt lookup matches, the longest found wins
+  size_t ngram_min;
+  size_t ngram_max;
+} minmpt_spec_params;
+
+typedef struct minmpt_spec_stats {
+  size_t n_rounds;
+  size_t n_drafted;
+  size_t n_accepted;
+  // tokens written, the accepted drafts and one from the target per round
+  size_t n_tokens;
+  // time spent in minmpt_spec_step
+  uint64_t t_us;
+} minmpt_spec_stats;
+
+minmpt_spec_params minmpt_spec_default_params(void);
+minmpt_error minmpt_spec_create(const minmpt_spec_params *params,
+                                minmpt_spec_handle *spec);
+// evaluates input[0, n_input) in target and runs one round, writing 1 to
+// n_draft + 1 tokens to out and their number to n_out. the target is left
+// holding all but the last token written, which is the input of the next
+// round. draft is first brought in line with the target's tokens; a draft
+// that fails to evaluate only drafts fewer tokens. with draft NULL, the
+// proposals come from prompt lookup over the target's tokens and the input
+minmpt_error minmpt_spec_step(minmpt_spec_handle spec, minmpt_handle target,
+                              minmpt_handle draft, const uint32_t *input,
+                              size_t n_input, uint32_t *out, size_t *n_out);
+void minmpt_spec_get_stats(minmpt_spec_handle spec, minmpt_spec_stats *stats);
+void minmpt_spec_free(minmpt_spec_handle spec);
+
+// beam search over forks of one session. each step evaluates the newest
+// token of every live beam in one batch, keeps the n_beams most likely
+// extensions and frees the beams left without one. beams fork their
+// parent, so with a paged kv cache they share the blocks of their common
+// prefix, the beams forming a tree of blocks
+typedef void *minmpt_beam_handle;
+
+typedef struct minmpt_beam_params {
+  size_t n_beams;
+  // most tokens generated per beam
+  size_t max_tokens;
+  // ends a beam, which is set aside as finished
+  uint32_t eos_token;
+  // finished beams rank by log probability / n_tokens^length_penalty
+  float length_penalty;
+} minmpt_beam_params;
+
+minmpt_beam_params minmpt_beam_default_params(void);
+// beams continue the context of base with prompt[0, n_tokens), which the
+// first step evaluates. base must outlive the search
+minmpt_error minmpt_beam_create(minmpt_handle base, const uint32_t *prompt,
+                                size_t n_tokens,
+                                const minmpt_beam_params *params,
+                                minmpt_beam_handle *beam);
+// runs one step. n_live, unless NULL, is set to the number of live beams,
+// 0 once n_beams have finished or the beams reached max_tokens. if the step
+// fails, the beams that were evaluated keep their logits and calling it
+// again evaluates only the others
+minmpt_error minmpt_beam_step(minmpt_beam_handle beam, size_t *n_live);
+// the finished beams, best first
+size_t minmpt_beam_n_results(minmpt_beam_handle beam);
+// the tokens of finished beam i, without eos, valid until the next step,
+// and its score unless score is NULL
+minmpt_error minmpt_beam_result(minmpt_beam_handle beam, size_t i,
+                                const uint32_t **tokens, size_t *n_tokens,
+                                float *score);
+void minmpt_beam_free(minmpt_beam_handle beam);
+
+typedef struct minmpt_generate_params {
+  // continuations sampled
+  size_t n;
+  // most tokens per continuation
+  size_t max_tokens;
+  // 0 for greedy
+  float temperature;
+  // 0 for a random seed
+  uint64_t seed;
+  // ends a continuation, and is not part of it
+  uint32_t eos_token;
+} minmpt_generate_params;
+
+minmpt_generate_params minmpt_generate_default_params(void);
+// samples n continuations of base's context followed by prompt. the prompt
+// is evaluated once, and the continuations fork the session holding it,
+// sharing its blocks when the kv cache is paged. every step decodes all of
+// them in one batch. tokens[i] (max_tokens entries) receives continuation
+// i, n_tokens[i] its length and, unless logprobs is NULL, logprobs[i] the
+// sum of the model's log probabilities of its tokens. a continuation that
+// runs out of context or kv cache ends there, the others go on. base is
+// unchanged
+minmpt_error minmpt_generate_n(minmpt_handle base, const uint32_t *prompt,
+                               size_t n_prompt,
+                               const minmpt_generate_params *params,
+                               uint32_t *const *tokens, size_t *n_tokens,
+                               float *logprobs);
+
+// samples the next token from the logits a session keeps after its last
+// eval, without copying them out. the chain applies the repetition
+// penalty, then temperature, then either mirostat or top-k, min-p and
+// top-p in that order
+typedef void *minmpt_sampler_handle;
+
+typedef struct minmpt_sampler_params {
+  // 0 for greedy
+  float temperature;
+  // 0 keeps every token
+  size_t top_k;
+  // smallest set of tokens whose probability reaches top_p, 1 keeps all
+  float top_p;
+  // drops tokens less likely than min_p times the top token, 0 keeps all
+  float min_p;
+  // divides positive logits and multiplies negative ones of the tokens
+  // among the last repeat_last_n of the context, 1 is off
+  float repeat_penalty;
+  size_t repeat_last_n;
+  // mirostat (v1), replacing top-k, min-p and top-p. tau is the target
+  // surprise in bits and eta its learning rate
+  int mirostat;
+  float mirostat_tau;
+  float mirostat_eta;
+  // 0 for a random seed
+  uint64_t seed;
+} minmpt_sampler_params;
+
+minmpt_sampler_params minmpt_sampler_default_params(void);
+minmpt_error minmpt_sampler_create(const minmpt_sampler_params *params,
+                                   minmpt_sampler_handle *sampler);
+// sets token to a sample of the session's logits, and unless NULL logprob
+// to its log probability under the model. top_tokens and top_logprobs,
+// unless NULL, receive the n_top most likely tokens of the model, most
+// likely first. the token is not evaluated. the sampler keeps mirostat's
+// state, so it should stay with one stream
+minmpt_error minmpt_sample_next(minmpt_handle handle,
+                                minmpt_sampler_handle sampler, uint32_t *token,
+                                float *logprob, size_t n_top,
+                                uint32_t *top_tokens, float *top_logprobs);
+void minmpt_sampler_free(minmpt_sampler_handle sampler);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,497 @@
+#include "mpt-attn.h"
+#include "mpt-util.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <new>
+
+struct mpt_attn_params {
+  // this layer's keys and values in each kv block, either
+  // [block_size][n_embd] for both or [n_head][block_size][head_dim] keys and
+  // [n_head][head_dim][block_size] F16 values
+  const char **k_blocks;
+  const char **v_blocks;
+  int block_size;
+  bool head_major;
+
+  // byte offsets between heads and between positions
+  size_t k_head_stride;
+  size_t k_pos_stride;
+  size_t v_head_stride;
+  size_t v_pos_stride;
+
+  // F16 or quantized
+  ggml_type type_k;
+  ggml_type type_v;
+  quantize_fns_t k_fns;
+  quantize_fns_t v_fns;
+  // quantizes query rows for k_fns.vec_dot_q
+  quantize_row_q_t quantize_q;
+
+  int n_past;
+  int N;
+  int n_head;
+  int head_dim;
+
+  // kv positions [0, n_past + N) are cut into n_split slices of this length
+  int n_split;
+  int slice;
+
+  float scale;
+  const float *slopes; // [n_head]
+  // [n_head] keys further than this behind a query are skipped
+  const int *windows;
+
+  // [n_head * N][n_split][max, sum, acc[head_dim]], only used if n_split > 1
+  float *partials;
+
+  // attention mass tracking, both null unless tracked. mass [n_past + N]
+  // gathers the softmax weight of each position over heads and rows, given
+  // the final max and sum of each row in norms [N * n_head][2]
+  float *mass;
+  float *norms;
+  // [n_threads][MPT_ATTN_ROWS + 1][slice] attention scores, plus a row of
+  // transposed values
+  float *scores;
+};
+
+// below this, expf underflows to a denormal
+#define MPT_ATTN_MIN_EXP -80.0f
+
+static void *mpt_attn_alloc(struct ggml_context *ctx, size_t size) {
+  return ggml_new_tensor_1d(ctx, GGML_TYPE_I8, size)->data;
+}
+
+static inline float mpt_vec_dot_f32(const float *x, const float *y,
+                                    const int n) {
+  // independent accumulators so the compiler can vectorize the reduction
+  float sum[8] = {0};
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    for (int k = 0; k < 8; ++k) {
+      sum[k] += x[i + k] * y[i + k];
+    }
+  }
+  float s = 0.0f;
+  for (; i < n; ++i) {
+    s += x[i] * y[i];
+  }
+  for (int k = 0; k < 8; ++k) {
+    s += sum[k];
+  }
+  return s;
+}
+
+static inline void mpt_vec_mad_f32(float *y, const float *x, const float v,
+                                   const int n) {
+  for (int i = 0; i < n; ++i) {
+    y[i] += x[i] * v;
+  }
+}
+
+static inline void mpt_attn_to_f32(ggml_type type, const quantize_fns_t &fns,
+                                   const char *x, float *y, int n) {
+  if (type == GGML_TYPE_F16) {
+    ggml_fp16_to_fp32_row((const ggml_fp16_t *)x, y, n);
+  } else {
+    fns.dequantize_row_q(x, y, n);
+  }
+}
+
+// softmax numerator over kv positions [j0, j1) for one head and query rows
+// [r0, r1). for each row, writes the slice max, sum and weighted sum of values
+// to out[0], out[1] and out[2..2+head_dim], with rows out_stride apart
+static void mpt_attn_slice(const mpt_attn_params &p, const float *Q, int h,
+                           int r0, int r1, int j0, int j1, float *scores,
+                           float *out, size_t out_stride) {
+  const int hd = p.head_dim;
+  const int nr = r1 - r0;
+  const float slope = p.slopes[h];
+  const int window = p.windows[h];
+
+  // keys before the first row's window are skipped for every row, keys
+  // past the last row's position are masked for every row
+  j0 = std::max(j0, std::min(j1, p.n_past + r0 - window));
+  const int len = j1 - j0;
+  j1 = std::min(j1, p.n_past + r1);
+
+  float max[MPT_ATTN_ROWS];
+  for (int rr = 0; rr < nr; ++rr) {
+    max[rr] = -INFINITY;
+  }
+
+  float row[MPT_ATTN_MAX_HEAD_DIM];
+
+  // quantized keys are dotted with the query rows quantized to match
+  const bool k_quantized = p.type_k != GGML_TYPE_F16;
+  alignas(32) char qq[MPT_ATTN_ROWS][2 * MPT_ATTN_MAX_HEAD_DIM];
+  if (k_quantized) {
+    for (int rr = 0; rr < nr; ++rr) {
+      p.quantize_q(Q + ((size_t)(r0 + rr) * p.n_head + h) * hd, qq[rr], hd);
+    }
+  }
+
+  // positions are walked one kv block at a time
+  for (int j = j0; j < j1;) {
+    const int b = j / p.block_size;
+    const int jb = b * p.block_size;
+    const int je = std::min(j1, jb + p.block_size);
+    const char *k = p.k_blocks[b] + h * p.k_head_stride;
+    for (; j < je; ++j) {
+      const char *krow = k + (size_t)(j - jb) * p.k_pos_stride;
+      if (!k_quantized) {
+        ggml_fp16_to_fp32_row((const ggml_fp16_t *)krow, row, hd);
+      }
+      for (int rr = 0; rr < nr; ++rr) {
+        const int qpos = p.n_past + r0 + rr;
+        float s = -INFINITY;
+        if (j <= qpos && j >= qpos - window) {
+          if (k_quantized) {
+            p.k_fns.vec_dot_q(hd, &s, krow, qq[rr]);
+          } else {
+            const float *q = Q + ((size_t)(r0 + rr) * p.n_head + h) * hd;
+            s = mpt_vec_dot_f32(q, row, hd);
+          }
+          s = s * p.scale - slope * (qpos - j);
+          max[rr] = std::max(max[rr], s);
+        }
+        scores[rr * len + j - j0] = s;
+      }
+    }
+  }
+
+  for (int rr = 0; rr < nr; ++rr) {
+    float *o = out + rr * out_stride;
+    float *sc = scores + rr * len;
+    float sum = 0.0f;
+    for (int j = 0; j < j1 - j0; ++j) {
+      // weights this small would be denormal, which is very slow to
+      // accumulate and does not change the result
+      const float e = sc[j] == -INFINITY || sc[j] - max[rr] < MPT_ATTN_MIN_EXP
+                          ? 0.0f
+                          : expf(sc[j] - max[rr]);
+      sc[j] = e;
+      sum += e;
+    }
+    o[0] = max[rr];
+    o[1] = sum;
+    memset(o + 2, 0, hd * sizeof(float));
+  }
+
+  float *vrow = scores + nr * len;
+  for (int j = j0; j < j1;) {
+    const int b = j / p.block_size;
+    const int jb = b * p.block_size;
+    const int je = std::min(j1, jb + p.block_size);
+    const char *v = p.v_blocks[b] + h * p.v_head_stride;
+
+    if (p.head_major) {
+      // each value dimension is a contiguous run over the block's positions
+      const ggml_fp16_t *vd = (const ggml_fp16_t *)v + (j - jb);
+      for (int d = 0; d < hd; ++d) {
+        ggml_fp16_to_fp32_row(vd + (size_t)d * p.block_size, vrow, je - j);
+        for (int rr = 0; rr < nr; ++rr) {
+          out[rr * out_stride + 2 + d] +=
+              mpt_vec_dot_f32(scores + rr * len + j - j0, vrow, je - j);
+        }
+      }
+      j = je;
+      continue;
+    }
+
+    for (; j < je; ++j) {
+      mpt_attn_to_f32(p.type_v, p.v_fns,
+                      v + (size_t)(j - jb) * p.v_pos_stride, row, hd);
+      for (int rr = 0; rr < nr; ++rr) {
+        const float e = scores[rr * len + j - j0];
+        if (e != 0.0f) {
+          mpt_vec_mad_f32(out + rr * out_stride + 2, row, e, hd);
+        }
+      }
+    }
+  }
+}
+
+static void mpt_attn_partial_op(struct ggml_tensor *dst,
+                                const struct ggml_tensor *Q, int ith, int nth,
+                                void *userdata) {
+  const mpt_attn_params &p = *(const mpt_attn_params *)userdata;
+  const int hd = p.head_dim;
+  const int n_blocks = (p.N + MPT_ATTN_ROWS - 1) / MPT_ATTN_ROWS;
+  const int n_tasks = p.n_head * n_blocks * p.n_split;
+  float *scores = p.scores + (size_t)ith * (MPT_ATTN_ROWS + 1) * p.slice;
+
+  float direct[MPT_ATTN_ROWS][2 + MPT_ATTN_MAX_HEAD_DIM];
+
+  for (int t = ith; t < n_tasks; t += nth) {
+    const int s = t % p.n_split;
+    const int h = (t / p.n_split) % p.n_head;
+    const int rb = t / p.n_split / p.n_head;
+
+    const int r0 = rb * MPT_ATTN_ROWS;
+    const int r1 = std::min(r0 + MPT_ATTN_ROWS, p.N);
+    const int j0 = s * p.slice;
+    const int j1 = std::min(j0 + p.slice, p.n_past + p.N);
+
+    if (p.n_split == 1) {
+      mpt_attn_slice(p, (const float *)Q->data, h, r0, r1, j0, j1, scores,
+                     direct[0], 2 + MPT_ATTN_MAX_HEAD_DIM);
+      for (int r = r0; r < r1; ++r) {
+        const float *d = direct[r - r0];
+        float *o = (float *)dst->data + ((size_t)r * p.n_head + h) * hd;
+        if (p.norms) {
+          p.norms[2 * ((size_t)r * p.n_head + h)] = d[0];
+          p.norms[2 * ((size_t)r * p.n_head + h) + 1] = d[1];
+        }
+        const float norm = 1.0f / d[1];
+        for (int i = 0; i < hd; ++i) {
+          o[i] = d[2 + i] * norm;
+        }
+      }
+    } else {
+      // partials are laid out [row][head][slice]
+      const size_t stride = 2 + hd;
+      float *out =
+          p.partials + (((size_t)r0 * p.n_head + h) * p.n_split + s) * stride;
+      mpt_attn_slice(p, (const float *)Q->data, h, r0, r1, j0, j1, scores,
+                     out, p.n_head * p.n_split * stride);
+    }
+  }
+}
+
+static void mpt_attn_reduce_op(struct ggml_tensor *dst,
+                               const struct ggml_tensor * /*partial*/, int ith,
+                               int nth, void *userdata) {
+  const mpt_attn_params &p = *(const mpt_attn_params *)userdata;
+  const int hd = p.head_dim;
+  const int stride = 2 + hd;
+
+  for (int hr = ith; hr < p.n_head * p.N; hr += nth) {
+    const float *part = p.partials + (size_t)hr * p.n_split * stride;
+
+    float max = -INFINITY;
+    for (int s = 0; s < p.n_split; ++s) {
+      max = std::max(max, part[s * stride]);
+    }
+
+    float *o = (float *)dst->data + (size_t)hr * hd;
+    memset(o, 0, hd * sizeof(float));
+    float sum = 0.0f;
+    for (int s = 0; s < p.n_split; ++s) {
+      const float *ps = part + s * stride;
+      if (ps[1] == 0.0f) {
+        continue;
+      }
+      const float w = expf(ps[0] - max);
+      sum += ps[1] * w;
+      mpt_vec_mad_f32(o, ps + 2, w, hd);
+    }
+
+    const float norm = 1.0f / sum;
+    for (int d = 0; d < hd; ++d) {
+      o[d] *= norm;
+    }
+    if (p.norms) {
+      p.norms[2 * hr] = max;
+      p.norms[2 * hr + 1] = sum;
+    }
+  }
+}
+
+// passes the attention output through and adds each row's softmax weights
+// to the mass of the positions. the scores are computed again from Q rather
+// than kept from the first pass, which would take n_head * N * (n_past + N)
+// floats. threads take interleaved runs of positions, so the causal mask
+// does not leave most of the work to the one holding the first positions
+static void mpt_attn_mass_op(struct ggml_tensor *dst,
+                             const struct ggml_tensor *src,
+                             const struct ggml_tensor *Q, int ith, int nth,
+                             void *userdata) {
+  const mpt_attn_params &p = *(const mpt_attn_params *)userdata;
+  const int hd = p.head_dim;
+  const int n_kv = p.n_past + p.N;
+  const float *q_data = (const float *)Q->data;
+
+  const size_t n = ggml_nelements(src);
+  const size_t c0 = n * ith / nth;
+  const size_t c1 = n * (ith + 1) / nth;
+  memcpy((float *)dst->data + c0, (const float *)src->data + c0,
+         (c1 - c0) * sizeof(float));
+
+  float row[MPT_ATTN_MAX_HEAD_DIM];
+  const bool k_quantized = p.type_k != GGML_TYPE_F16;
+  alignas(32) char qq[MPT_ATTN_ROWS][2 * MPT_ATTN_MAX_HEAD_DIM];
+
+  for (int lo = ith * MPT_ATTN_MIN_SLICE; lo < n_kv;
+       lo += nth * MPT_ATTN_MIN_SLICE) {
+    const int hi = std::min(n_kv, lo + MPT_ATTN_MIN_SLICE);
+    for (int h = 0; h < p.n_head; ++h) {
+      const float slope = p.slopes[h];
+      const int window = p.windows[h];
+      for (int r0 = 0; r0 < p.N; r0 += MPT_ATTN_ROWS) {
+        const int r1 = std::min(r0 + MPT_ATTN_ROWS, p.N);
+        const int j0 = std::max(lo, p.n_past + r0 - window);
+        const int j1 = std::min(hi, p.n_past + r1);
+        if (j0 >= j1) {
+          continue;
+        }
+        if (k_quantized) {
+          for (int r = r0; r < r1; ++r) {
+            p.quantize_q(q_data + ((size_t)r * p.n_head + h) * hd,
+                         qq[r - r0], hd);
+          }
+        }
+        for (int j = j0; j < j1; ++j) {
+          const int b = j / p.block_size;
+          const char *krow = p.k_blocks[b] + h * p.k_head_stride +
+                             (size_t)(j - b * p.block_size) * p.k_pos_stride;
+          if (!k_quantized) {
+            ggml_fp16_to_fp32_row((const ggml_fp16_t *)krow, row, hd);
+          }
+          float m = 0.0f;
+          for (int r = r0; r < r1; ++r) {
+            const int qpos = p.n_past + r;
+            if (j > qpos || j < qpos - window) {
+              continue;
+            }
+            float s;
+            if (k_quantized) {
+              p.k_fns.vec_dot_q(hd, &s, krow, qq[r - r0]);
+            } else {
+              s = mpt_vec_dot_f32(q_data + ((size_t)r * p.n_head + h) * hd,
+                                  row, hd);
+            }
+            const float *norm = p.norms + 2 * ((size_t)r * p.n_head + h);
+            s = s * p.scale - slope * (qpos - j) - norm[0];
+            if (s >= MPT_ATTN_MIN_EXP) {
+              m += expf(s) / norm[1];
+            }
+          }
+          p.mass[j] += m;
+        }
+      }
+    }
+  }
+}
+
+// per-head ALiBi slopes, as in ggml_alibi
+static void mpt_alibi_slopes(float *slopes, int n_head, float max_bias) {
+  const int n_heads_log2_floor = 1 << (int)floor(log2(n_head));
+  const float m0 = powf(2.0f, -(max_bias) / n_heads_log2_floor);
+  const float m1 = powf(2.0f, -(max_bias / 2.0f) / n_heads_log2_floor);
+  for (int h = 0; h < n_head; ++h) {
+    slopes[h] = h < n_heads_log2_floor
+                    ? powf(m0, h + 1)
+                    : powf(m1, 2 * (h - n_heads_log2_floor) + 1);
+  }
+}
+
+struct ggml_tensor *mpt_attn(struct ggml_context *ctx, struct ggml_tensor *Q,
+                             const mpt_hparams &hparams,
+                             const mpt_kvcache &kvcache, int il, int n_past,
+                             int n_threads, float *mass) {
+  const int n_embd = hparams.n_embd;
+  const int n_head = hparams.n_head;
+  const int head_dim = n_embd / n_head;
+  const int N = Q->ne[2];
+  const int n_kv = n_past + N;
+
+  MPT_ASSERT(head_dim <= MPT_ATTN_MAX_HEAD_DIM);
+  MPT_ASSERT(Q->type == GGML_TYPE_F32 && ggml_is_contiguous(Q));
+
+  auto *p = new (mpt_attn_alloc(ctx, sizeof(mpt_attn_params)))
+      mpt_attn_params;
+  const ggml_type type_k = kvcache.params.type_k;
+  const ggml_type type_v = kvcache.params.type_v;
+  const size_t k_row = mpt_kv_row_size(type_k, head_dim);
+  const size_t v_row = mpt_kv_row_size(type_v, head_dim);
+  const int bs = kvcache.block_size;
+  const int n_blocks = (n_kv + bs - 1) / bs;
+  p->k_blocks =
+      (const char **)mpt_attn_alloc(ctx, n_blocks * sizeof(const char *));
+  p->v_blocks =
+      (const char **)mpt_attn_alloc(ctx, n_blocks * sizeof(const char *));
+  for (int b = 0; b < n_blocks; ++b) {
+    p->k_blocks[b] = kvcache.k_data(b, il);
+    p->v_blocks[b] = kvcache.v_data(b, il);
+  }
+  p->block_size = bs;
+  p->head_major = kvcache.params.layout == MPT_KV_HEAD_MAJOR;
+  if (p->head_major) {
+    p->k_head_stride = (size_t)bs * k_row;
+    p->k_pos_stride = k_row;
+    p->v_head_stride = (size_t)bs * v_row;
+    p->v_pos_stride = ggml_type_size(type_v);
+  } else {
+    p->k_head_stride = k_row;
+    p->k_pos_stride = n_head * k_row;
+    p->v_head_stride = v_row;
+    p->v_pos_stride = n_head * v_row;
+  }
+  p->type_k = type_k;
+  p->type_v = type_v;
+  p->k_fns = {};
+  p->v_fns = {};
+  p->quantize_q = nullptr;
+  if (type_k != GGML_TYPE_F16) {
+    p->k_fns = ggml_internal_get_quantize_fn(type_k);
+    p->quantize_q =
+        ggml_internal_get_quantize_fn(p->k_fns.vec_dot_type).quantize_row_q;
+  }
+  if (type_v != GGML_TYPE_F16) {
+    p->v_fns = ggml_internal_get_quantize_fn(type_v);
+  }
+  p->n_past = n_past;
+  p->N = N;
+  p->n_head = n_head;
+  p->head_dim = head_dim;
+  p->scale = 1.0f / sqrtf(float(head_dim));
+
+  float *slopes = (float *)mpt_attn_alloc(ctx, n_head * sizeof(float));
+  mpt_alibi_slopes(slopes, n_head, hparams.alibi_bias_max);
+  p->slopes = slopes;
+
+  // past this distance the bias alone scales a key's weight by less than
+  // the tolerance, compared to the query's own position
+  int *windows = (int *)mpt_attn_alloc(ctx, n_head * sizeof(int));
+  const float prune_tol = kvcache.params.attn_prune_tol;
+  for (int h = 0; h < n_head; ++h) {
+    windows[h] = n_kv;
+    if (prune_tol > 0.0f && slopes[h] > 0.0f) {
+      const float window = ceilf(logf(1.0f / prune_tol) / slopes[h]);
+      if (window < (float)n_kv) {
+        windows[h] = (int)window;
+      }
+    }
+  }
+  p->windows = windows;
+
+  // aim for a few tasks per thread; with N = 1 and more threads than heads
+  // this is what spreads the sequence axis across the cores
+  const int rows = n_head * ((N + MPT_ATTN_ROWS - 1) / MPT_ATTN_ROWS);
+  const int max_split = std::max(1, n_kv / MPT_ATTN_MIN_SLICE);
+  p->n_split = std::min(max_split, (4 * n_threads + rows - 1) / rows);
+  p->slice = (n_kv + p->n_split - 1) / p->n_split;
+  p->partials = nullptr;
+  if (p->n_split > 1) {
+    p->partials = (float *)mpt_attn_alloc(
+        ctx, (size_t)n_head * N * p->n_split * (2 + head_dim) * sizeof(float));
+  }
+  p->mass = mass;
+  p->norms = mass ? (float *)mpt_attn_alloc(ctx, (size_t)n_head * N * 2 *
+                                                     sizeof(float))
+                  : nullptr;
+  p->scores = (float *)mpt_attn_alloc(
+      ctx, (size_t)n_threads * (MPT_ATTN_ROWS + 1) * p->slice * sizeof(float));
+
+  struct ggml_tensor *cur =
+      ggml_map_custom1(ctx, Q, mpt_attn_partial_op, n_threads, p);
+  if (p->n_split > 1) {
+    cur = ggml_map_custom1(ctx, cur, mpt_attn_reduce_op, n_threads, p);
+  }
+  if (mass) {
+    cur = ggml_map_custom2(ctx, cur, Q, mpt_attn_mass_op, n_threads, p);
+  }
+  return cur;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "mpt-kv.h"
+
+// Fused ALiBi self-attention over the kv cache, run as custom ggml ops.
+//
+// Work is split over (head, query row, kv slice). Each slice produces a
+// partial softmax (running max, sum and weighted V) which a second op merges,
+// flash-decoding style, so a single decode token still keeps every thread
+// busy at long context lengths.
+
+// use the fused kernel instead of the ggml op chain for batches this small
+#define MPT_ATTN_MAX_N 8
+
+// query rows sharing one pass over a kv slice
+#define MPT_ATTN_ROWS 8
+
+// kv slices are never made shorter than this
+#define MPT_ATTN_MIN_SLICE 128
+
+// largest supported n_embd / n_head
+#define MPT_ATTN_MAX_HEAD_DIM 256
+
+// Q:      [head_dim, n_head, N] F32, contiguous
+// returns [head_dim, n_head, N] F32
+//
+// the copies writing this batch's keys and values into the cache must
+// already be in the graph, and the cache must have blocks for n_past + N
+//
+// with mass set, the softmax weight each of the n_past + N positions gets is
+// added to it, summed over heads and query rows. this scores every key a
+// second time, but needs no scratch beyond the op's own
+struct ggml_tensor *mpt_attn(struct ggml_context *ctx, struct ggml_tensor *Q,
+                             const mpt_hparams &hparams,
+                             const mpt_kvcache &kvcache, int il, int n_past,
+                             int n_threads, float *mass = nullptr);
@@ -0,0 +1,423 @@
+#include "mpt-head.h"
+#include "mpt-util.h"
+
+#include <algorithm>
+#include <cmath>
+#include <new>
+#include <numeric>
+#include <thread>
+
+// vocabulary rows a thread takes at a time
+#define MPT_HEAD_CHUNK 64
+
+// k-means of the index trains on up to this many rows per cluster
+#define MPT_HEAD_KMEANS_ROWS 32
+#define MPT_HEAD_KMEANS_ITERS 8
+
+struct mpt_head_entry {
+  float logit;
+  int32_t token;
+};
+
+struct mpt_head_params {
+  const float *wte;
+  int n_embd;
+  int n_vocab;
+  int n_out;
+  int k;
+  int n_threads;
+
+  // [n_out][n_threads] running max and sum of exp, and min-heaps of the k
+  // largest logits, [n_out][n_threads][k]
+  float *maxes;
+  float *sums;
+  mpt_head_entry *heaps;
+
+  uint32_t *tokens;
+  float *logprobs;
+};
+
+static void *mpt_head_alloc(struct ggml_context *ctx, size_t size) {
+  return ggml_new_tensor_1d(ctx, GGML_TYPE_I8, size)->data;
+}
+
+static inline float mpt_head_dot(const float *x, const float *y, int n) {
+  // independent accumulators so the compiler can vectorize the reduction
+  float sum[8] = {0};
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    for (int j = 0; j < 8; ++j) {
+      sum[j] += x[i + j] * y[i + j];
+    }
+  }
+  float total = 0.0f;
+  for (; i < n; ++i) {
+    total += x[i] * y[i];
+  }
+  for (int j = 0; j < 8; ++j) {
+    total += sum[j];
+  }
+  return total;
+}
+
+// replaces the smallest entry of a full min-heap and restores it
+static void mpt_head_replace_min(mpt_head_entry *heap, int k,
+                                 mpt_head_entry entry) {
+  int i = 0;
+  while (true) {
+    const int l = 2 * i + 1;
+    if (l >= k) {
+      break;
+    }
+    const int c = l + 1 < k && heap[l + 1].logit < heap[l].logit ? l + 1 : l;
+    if (heap[c].logit >= entry.logit) {
+      break;
+    }
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = entry;
+}
+
+static void mpt_head_partial_op(struct ggml_tensor * /*dst*/,
+                                const struct ggml_tensor *x, int ith, int nth,
+                                void *userdata) {
+  const mpt_head_params &p = *(const mpt_head_params *)userdata;
+  // ggml may run fewer threads than there are partials; the others are
+  // left empty
+  for (int t = ith; t < p.n_threads; t += nth) {
+    for (int r = 0; r < p.n_out; ++r) {
+      const size_t i = (size_t)r * p.n_threads + t;
+      p.maxes[i] = -INFINITY;
+      p.sums[i] = 0.0f;
+      std::fill(p.heaps + i * p.k, p.heaps + (i + 1) * p.k,
+                mpt_head_entry{-INFINITY, -1});
+    }
+  }
+  float *maxes = p.maxes + ith;
+  float *sums = p.sums + ith;
+  mpt_head_entry *heaps = p.heaps + (size_t)ith * p.k;
+  const size_t row_stride = p.n_threads;
+
+  const int n_chunks = (p.n_vocab + MPT_HEAD_CHUNK - 1) / MPT_HEAD_CHUNK;
+  float logits[MPT_HEAD_CHUNK];
+  for (int c = ith; c < n_chunks; c += nth) {
+    const int v0 = c * MPT_HEAD_CHUNK;
+    const int n = std::min(p.n_vocab - v0, MPT_HEAD_CHUNK);
+    for (int r = 0; r < p.n_out; ++r) {
+      const float *xr = (const float *)x->data + (size_t)r * p.n_embd;
+      float chunk_max = -INFINITY;
+      for (int i = 0; i < n; ++i) {
+        logits[i] = mpt_head_dot(xr, p.wte + (size_t)(v0 + i) * p.n_embd,
+                                 p.n_embd);
+        chunk_max = std::max(chunk_max, logits[i]);
+      }
+      // the chunk joins the running sum of exp at the larger max
+      float &max = maxes[r * row_stride];
+      float &sum = sums[r * row_stride];
+      const float new_max = std::max(max, chunk_max);
+      float chunk_sum = 0.0f;
+      for (int i = 0; i < n; ++i) {
+        chunk_sum += expf(logits[i] - new_max);
+      }
+      sum = sum * expf(max - new_max) + chunk_sum;
+      max = new_max;
+
+      mpt_head_entry *heap = heaps + r * row_stride * p.k;
+      for (int i = 0; i < n; ++i) {
+        if (logits[i] > heap[0].logit) {
+          mpt_head_replace_min(heap, p.k, {logits[i], v0 + i});
+        }
+      }
+    }
+  }
+}
+
+static void mpt_head_reduce_op(struct ggml_tensor * /*dst*/,
+                               const struct ggml_tensor * /*partial*/,
+                               int ith, int nth, void *userdata) {
+  const mpt_head_params &p = *(const mpt_head_params *)userdata;
+  for (int r = ith; r < p.n_out; r += nth) {
+    const float *maxes = p.maxes + (size_t)r * p.n_threads;
+    const float *sums = p.sums + (size_t)r * p.n_threads;
+    const float max = *std::max_element(maxes, maxes + p.n_threads);
+    float sum = 0.0f;
+    for (int t = 0; t < p.n_threads; ++t) {
+      if (sums[t] > 0.0f) {
+        sum += sums[t] * expf(maxes[t] - max);
+      }
+    }
+    const float lse = max + logf(sum);
+
+    mpt_head_entry *entries = p.heaps + (size_t)r * p.n_threads * p.k;
+    std::partial_sort(entries, entries + p.k, entries + p.n_threads * p.k,
+                      [](const mpt_head_entry &a, const mpt_head_entry &b) {
+                        return a.logit > b.logit;
+                      });
+    for (int j = 0; j < p.k; ++j) {
+      p.tokens[(size_t)r * p.k + j] = entries[j].token;
+      p.logprobs[(size_t)r * p.k + j] = entries[j].logit - lse;
+    }
+  }
+}
+
+struct ggml_tensor *mpt_head_top_k(struct ggml_context *ctx,
+                                   struct ggml_tensor *x,
+                                   struct ggml_tensor *wte, int k,
+                                   int n_threads, uint32_t *tokens,
+                                   float *logprobs) {
+  MPT_ASSERT(x->type == GGML_TYPE_F32 && ggml_is_contiguous(x));
+  MPT_ASSERT(wte->type == GGML_TYPE_F32 && ggml_is_contiguous(wte));
+  MPT_ASSERT(x->ne[0] == wte->ne[0] && k > 0 && k <= wte->ne[1]);
+
+  auto *p = new (mpt_head_alloc(ctx, sizeof(mpt_head_params)))
+      mpt_head_params;
+  p->wte = (const float *)wte->data;
+  p->n_embd = x->ne[0];
+  p->n_vocab = wte->ne[1];
+  p->n_out = x->ne[1];
+  p->k = k;
+  p->n_threads = n_threads;
+  const size_t n_partials = (size_t)p->n_out * n_threads;
+  p->maxes = (float *)mpt_head_alloc(ctx, n_partials * sizeof(float));
+  p->sums = (float *)mpt_head_alloc(ctx, n_partials * sizeof(float));
+  p->heaps = (mpt_head_entry *)mpt_head_alloc(
+      ctx, n_partials * k * sizeof(mpt_head_entry));
+  p->tokens = tokens;
+  p->logprobs = logprobs;
+
+  struct ggml_tensor *cur =
+      ggml_map_custom1(ctx, x, mpt_head_partial_op, n_threads, p);
+  return ggml_map_custom1(ctx, cur, mpt_head_reduce_op, n_threads, p);
+}
+
+// runs f(i) for i in [0, n) on n_threads threads
+template <typename F>
+static void mpt_head_parallel(int n_threads, size_t n, const F &f) {
+  std::vector<std::thread> threads;
+  for (int t = 1; t < n_threads; ++t) {
+    threads.emplace_back([&, t]() {
+      for (size_t i = t; i < n; i += n_threads) {
+        f(i);
+      }
+    });
+  }
+  for (size_t i = 0; i < n; i += n_threads) {
+    f(i);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+// the cluster whose centroid is closest in direction to row
+static int mpt_head_nearest(const mpt_head_index &index, const float *row) {
+  int best = 0;
+  float best_dot = -INFINITY;
+  for (int c = 0; c < index.n_clusters; ++c) {
+    const float dot = mpt_head_dot(
+        row, index.centroids.data() + (size_t)c * index.n_embd, index.n_embd);
+    if (dot > best_dot) {
+      best_dot = dot;
+      best = c;
+    }
+  }
+  return best;
+}
+
+std::shared_ptr<mpt_head_index>
+mpt_head_index_build(const struct ggml_tensor *wte, int n_clusters,
+                     int n_threads) {
+  MPT_ASSERT(wte->type == GGML_TYPE_F32 && ggml_is_contiguous(wte));
+  const int n_embd = wte->ne[0];
+  const int n_vocab = wte->ne[1];
+  const float *w = (const float *)wte->data;
+  auto index = std::make_shared<mpt_head_index>();
+  index->n_embd = n_embd;
+  index->n_clusters = std::max(1, std::min(n_clusters, n_vocab));
+  const int nc = index->n_clusters;
+
+  // train on an even sample of the rows, starting from an even sample of
+  // those. the nearest centroid by dot product does not depend on the
+  // length of the row, so only the centroids are normalized
+  const size_t n_train =
+      std::min((size_t)n_vocab, (size_t)nc * MPT_HEAD_KMEANS_ROWS);
+  std::vector<uint32_t> train(n_train);
+  for (size_t i = 0; i < n_train; ++i) {
+    train[i] = i * n_vocab / n_train;
+  }
+  auto &centroids = index->centroids;
+  centroids.resize((size_t)nc * n_embd);
+  for (int c = 0; c < nc; ++c) {
+    const float *row = w + (size_t)train[c * n_train / nc] * n_embd;
+    std::copy(row, row + n_embd, centroids.begin() + (size_t)c * n_embd);
+  }
+  std::vector<float> sums(centroids.size());
+  std::vector<int> assigned(n_train);
+  for (int iter = 0; iter <= MPT_HEAD_KMEANS_ITERS; ++iter) {
+    // normalize the new centroids, keeping the old one of an empty cluster
+    for (int c = 0; c < nc; ++c) {
+      float *centroid = centroids.data() + (size_t)c * n_embd;
+      float *sum = sums.data() + (size_t)c * n_embd;
+      const float *src = iter == 0 ? centroid : sum;
+      const float norm = sqrtf(mpt_head_dot(src, src, n_embd));
+      if (norm > 0.0f) {
+        std::transform(src, src + n_embd, centroid,
+                       [norm](float x) { return x / norm; });
+      }
+    }
+    if (iter == MPT_HEAD_KMEANS_ITERS) {
+      break;
+    }
+    mpt_head_parallel(n_threads, n_train, [&](size_t i) {
+      assigned[i] = mpt_head_nearest(*index, w + (size_t)train[i] * n_embd);
+    });
+    std::fill(sums.begin(), sums.end(), 0.0f);
+    for (size_t i = 0; i < n_train; ++i) {
+      const float *row = w + (size_t)train[i] * n_embd;
+      const float norm = sqrtf(mpt_head_dot(row, row, n_embd));
+      if (norm == 0.0f) {
+        continue;
+      }
+      float *sum = sums.data() + (size_t)assigned[i] * n_embd;
+      for (int j = 0; j < n_embd; ++j) {
+        sum[j] += row[j] / norm;
+      }
+    }
+  }
+
+  // group the whole vocabulary by nearest centroid
+  std::vector<int> cluster(n_vocab);
+  mpt_head_parallel(n_threads, n_vocab, [&](size_t v) {
+    cluster[v] = mpt_head_nearest(*index, w + v * n_embd);
+  });
+  index->offsets.assign(nc + 1, 0);
+  for (int v = 0; v < n_vocab; ++v) {
+    index->offsets[cluster[v] + 1]++;
+  }
+  std::partial_sum(index->offsets.begin(), index->offsets.end(),
+                   index->offsets.begin());
+  index->rows.resize(n_vocab);
+  std::vector<uint32_t> next(index->offsets.begin(), index->offsets.end() - 1);
+  for (int v = 0; v < n_vocab; ++v) {
+    index->rows[next[cluster[v]]++] = v;
+  }
+  return index;
+}
+
+struct mpt_head_ivf_params {
+  const float *wte;
+  const mpt_head_index *index;
+  int n_vocab;
+  int n_out;
+
+  // [n_out] budgets, and [n_out][n_clusters] centroid scores and clusters
+  // in the order rows are scored, the n_probe[r] probed ones first
+  int *n_candidates;
+  float *scores;
+  int *order;
+  int *n_probe;
+};
+
+static void mpt_head_score_op(struct ggml_tensor * /*dst*/,
+                              const struct ggml_tensor *x, int ith, int nth,
+                              void *userdata) {
+  const mpt_head_ivf_params &p = *(const mpt_head_ivf_params *)userdata;
+  const mpt_head_index &index = *p.index;
+  const size_t n = (size_t)p.n_out * index.n_clusters;
+  for (size_t i = ith; i < n; i += nth) {
+    const size_t r = i / index.n_clusters;
+    const size_t c = i % index.n_clusters;
+    p.scores[i] = mpt_head_dot((const float *)x->data + r * index.n_embd,
+                               index.centroids.data() + c * index.n_embd,
+                               index.n_embd);
+  }
+}
+
+static void mpt_head_probe_op(struct ggml_tensor * /*dst*/,
+                              const struct ggml_tensor * /*scores*/, int ith,
+                              int nth, void *userdata) {
+  const mpt_head_ivf_params &p = *(const mpt_head_ivf_params *)userdata;
+  const mpt_head_index &index = *p.index;
+  const int nc = index.n_clusters;
+  for (int r = ith; r < p.n_out; r += nth) {
+    int *order = p.order + (size_t)r * nc;
+    std::iota(order, order + nc, 0);
+    const int budget = p.n_candidates[r];
+    if (budget <= 0 || budget >= p.n_vocab) {
+      p.n_probe[r] = nc;
+      continue;
+    }
+    const float *scores = p.scores + (size_t)r * nc;
+    std::sort(order, order + nc,
+              [scores](int a, int b) { return scores[a] > scores[b]; });
+    int n_probe = 0;
+    for (int n = 0; n < budget; ++n_probe) {
+      n += index.offsets[order[n_probe] + 1] - index.offsets[order[n_probe]];
+    }
+    p.n_probe[r] = n_probe;
+  }
+}
+
+static void mpt_head_ivf_op(struct ggml_tensor *dst,
+                            const struct ggml_tensor * /*logits*/,
+                            const struct ggml_tensor *x,
+                            const struct ggml_tensor * /*probes*/, int ith,
+                            int nth, void *userdata) {
+  const mpt_head_ivf_params &p = *(const mpt_head_ivf_params *)userdata;
+  const mpt_head_index &index = *p.index;
+  const int nc = index.n_clusters;
+  // the clusters partition the vocabulary, so the threads write each logit
+  // once without waiting on each other: computed for the probed clusters,
+  // -INFINITY for the rest
+  const size_t n = (size_t)p.n_out * nc;
+  for (size_t i = ith; i < n; i += nth) {
+    const size_t r = i / nc;
+    const uint32_t *v0 = index.rows.data() + index.offsets[p.order[i]];
+    const uint32_t *v1 = index.rows.data() + index.offsets[p.order[i] + 1];
+    float *logits = (float *)dst->data + r * p.n_vocab;
+    if ((int)(i % nc) >= p.n_probe[r]) {
+      for (const uint32_t *v = v0; v < v1; ++v) {
+        logits[*v] = -INFINITY;
+      }
+      continue;
+    }
+    const float *xr = (const float *)x->data + r * index.n_embd;
+    for (const uint32_t *v = v0; v < v1; ++v) {
+      logits[*v] =
+          mpt_head_dot(xr, p.wte + (size_t)*v * index.n_embd, index.n_embd);
+    }
+  }
+}
+
+struct ggml_tensor *mpt_head_ivf(struct ggml_context *ctx,
+                                 struct ggml_tensor *x,
+                                 struct ggml_tensor *wte,
+                                 const mpt_head_index *index,
+                                 const int *n_candidates, int n_threads) {
+  MPT_ASSERT(x->type == GGML_TYPE_F32 && ggml_is_contiguous(x));
+  MPT_ASSERT(wte->type == GGML_TYPE_F32 && ggml_is_contiguous(wte));
+  MPT_ASSERT(x->ne[0] == index->n_embd && wte->ne[0] == index->n_embd);
+
+  auto *p = new (mpt_head_alloc(ctx, sizeof(mpt_head_ivf_params)))
+      mpt_head_ivf_params;
+  p->wte = (const float *)wte->data;
+  p->index = index;
+  p->n_vocab = wte->ne[1];
+  p->n_out = x->ne[1];
+  const size_t n_scores = (size_t)p->n_out * index->n_clusters;
+  p->n_candidates = (int *)mpt_head_alloc(ctx, p->n_out * sizeof(int));
+  std::copy(n_candidates, n_candidates + p->n_out, p->n_candidates);
+  p->scores = (float *)mpt_head_alloc(ctx, n_scores * sizeof(float));
+  p->order = (int *)mpt_head_alloc(ctx, n_scores * sizeof(int));
+  p->n_probe = (int *)mpt_head_alloc(ctx, p->n_out * sizeof(int));
+
+  struct ggml_tensor *cur =
+      ggml_map_custom1(ctx, x, mpt_head_score_op, n_threads, p);
+  cur = ggml_map_custom1(ctx, cur, mpt_head_probe_op, n_threads, p);
+  // the logits are written in place, into the only n_vocab x n_out tensor
+  struct ggml_tensor *logits =
+      ggml_new_tensor_2d(ctx, GGML_TYPE_F32, p->n_vocab, p->n_out);
+  return ggml_map_custom3_inplace(ctx, logits, x, cur, mpt_head_ivf_op,
+                                  n_threads, p);
+}
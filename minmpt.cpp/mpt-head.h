@@ -0,0 +1,57 @@
+#pragma once
+#include "ggml.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Fused LM head with top-k selection, run as custom ggml ops.
+//
+// Threads take turns on chunks of the vocabulary. For each vocabulary row a
+// thread computes the logit of every output row, adding it to a running
+// log-sum-exp and keeping the k largest in a min-heap. A second op merges
+// the threads' heaps and sums for each output row, so the n_out * n_vocab
+// logits are never written out or passed over again by a softmax.
+
+// x:   [n_embd, n_out] F32, contiguous, hidden states after the final norm
+// wte: [n_embd, n_vocab] F32
+//
+// once the graph has run, tokens and logprobs [n_out][k] hold the k most
+// likely tokens of each row, most likely first, and their log
+// probabilities. k must be at most n_vocab
+struct ggml_tensor *mpt_head_top_k(struct ggml_context *ctx,
+                                   struct ggml_tensor *x,
+                                   struct ggml_tensor *wte, int k,
+                                   int n_threads, uint32_t *tokens,
+                                   float *logprobs);
+
+// Approximate head over a clustered vocabulary, an IVF index.
+//
+// At load the rows of wte are clustered by direction with spherical k-means.
+// An eval then scores the centroids against each output row and computes
+// exact logits only for the rows of the best scoring clusters, until it has
+// at least n_candidates of them. The rest of the vocabulary is -INFINITY.
+struct mpt_head_index {
+  int n_embd = 0;
+  int n_clusters = 0;
+  // [n_clusters][n_embd], unit length
+  std::vector<float> centroids;
+  // vocabulary ids grouped by cluster, cluster c holding
+  // rows[offsets[c], offsets[c + 1])
+  std::vector<uint32_t> offsets;
+  std::vector<uint32_t> rows;
+};
+
+// clusters the rows of wte, [n_embd, n_vocab] F32, on n_threads threads
+std::shared_ptr<mpt_head_index>
+mpt_head_index_build(const struct ggml_tensor *wte, int n_clusters,
+                     int n_threads);
+
+// logits [n_vocab, n_out] for x [n_embd, n_out] F32, contiguous. row r
+// scores at least n_candidates[r] vocabulary rows, all of them for 0.
+// n_candidates is copied into ctx
+struct ggml_tensor *mpt_head_ivf(struct ggml_context *ctx,
+                                 struct ggml_tensor *x,
+                                 struct ggml_tensor *wte,
+                                 const mpt_head_index *index,
+                                 const int *n_candidates, int n_threads);
@@ -0,0 +1,617 @@
+#include "mpt-kv.h"
+#include "mpt-util.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static void mpt_kv_check_params(const mpt_hparams &hparams,
+                                const mpt_kvcache_params &params) {
+  const int head_dim = hparams.n_embd / hparams.n_head;
+
+  // quantized blocks may not straddle heads
+  if (head_dim % ggml_blck_size(params.type_k) != 0 ||
+      head_dim % ggml_blck_size(params.type_v) != 0) {
+    throw std::runtime_error("kv cache type does not divide head_dim");
+  }
+  // transposed values are written one column at a time
+  if (params.layout == MPT_KV_HEAD_MAJOR && params.type_v != GGML_TYPE_F16) {
+    throw std::runtime_error("head-major kv cache needs F16 values");
+  }
+}
+
+mpt_kv_pool::mpt_kv_pool(const mpt_hparams &hparams,
+                         const mpt_kvcache_params &params)
+    : hparams(hparams), params(params) {
+  mpt_kv_check_params(hparams, params);
+  if (params.block_size <= 0) {
+    throw std::runtime_error("paged kv cache needs a block size");
+  }
+  k_layer_bytes = (size_t)params.block_size *
+                  mpt_kv_row_size(params.type_k, hparams.n_embd);
+  v_layer_bytes = (size_t)params.block_size *
+                  mpt_kv_row_size(params.type_v, hparams.n_embd);
+  const size_t block_bytes =
+      hparams.n_layer * (k_layer_bytes + v_layer_bytes);
+  v_offset = hparams.n_layer * k_layer_bytes;
+  printf("%s: block_size = %d, %8.2f MB per block\n", __func__,
+         params.block_size, block_bytes / 1024.0 / 1024.0);
+
+  if (!params.disk_path.empty()) {
+    // blocks are mapped separately, each starting on a page
+    const size_t page = sysconf(_SC_PAGESIZE);
+    v_offset = (v_offset + page - 1) / page * page;
+    block_span = (v_offset + hparams.n_layer * v_layer_bytes + page - 1) /
+                 page * page;
+    ram_blocks = std::max<size_t>(1, params.ram_bytes / block_bytes);
+    fd = open(params.disk_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+      throw std::runtime_error("failed to create kv cache file " +
+                               params.disk_path);
+    }
+    // the file is scratch, gone once the pool closes it
+    unlink(params.disk_path.c_str());
+    printf("%s: kv blocks on disk at '%s', %d blocks per cache in RAM\n",
+           __func__, params.disk_path.c_str(), ram_blocks);
+  }
+}
+
+mpt_kv_pool::~mpt_kv_pool() {
+  for (char *m : mem) {
+    if (on_disk()) {
+      munmap(m, block_span);
+    } else {
+      delete[] m;
+    }
+  }
+  if (on_disk()) {
+    close(fd);
+  }
+}
+
+bool mpt_kv_pool::alloc(mpt_kv_block &block) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (free_ids.empty()) {
+    if (params.max_blocks > 0 && (int)mem.size() >= params.max_blocks) {
+      return false;
+    }
+    char *m;
+    if (on_disk()) {
+      const off_t offset = (off_t)mem.size() * block_span;
+      if (ftruncate(fd, offset + block_span) != 0) {
+        return false;
+      }
+      void *addr = mmap(nullptr, block_span, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, offset);
+      if (addr == MAP_FAILED) {
+        return false;
+      }
+      m = (char *)addr;
+    } else {
+      m = new char[v_offset + hparams.n_layer * v_layer_bytes];
+    }
+    free_ids.push_back(mem.size());
+    mem.push_back(m);
+    refs.push_back(0);
+  }
+  block.id = free_ids.back();
+  block.k = mem[block.id];
+  block.v = mem[block.id] + v_offset;
+  refs[block.id] = 1;
+  free_ids.pop_back();
+  return true;
+}
+
+void mpt_kv_pool::retain(const mpt_kv_block &block) {
+  std::lock_guard<std::mutex> lock(mutex);
+  refs[block.id]++;
+}
+
+void mpt_kv_pool::release(const mpt_kv_block &block) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (--refs[block.id] == 0) {
+    free_ids.push_back(block.id);
+  }
+}
+
+bool mpt_kv_pool::shared(const mpt_kv_block &block) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return refs[block.id] > 1;
+}
+
+size_t mpt_kv_pool::n_used() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return mem.size() - free_ids.size();
+}
+
+size_t mpt_kv_pool::n_allocated() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return mem.size();
+}
+
+// the pages of [addr, addr + size), those only partly in it included if
+// outward. returns the number of pages and their residency
+static size_t mpt_kv_pages(const char *addr, size_t size, bool outward,
+                           char **start, std::vector<unsigned char> &resident) {
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const uintptr_t a = (uintptr_t)addr;
+  const uintptr_t p0 = outward ? a / page * page : (a + page - 1) / page * page;
+  const uintptr_t p1 =
+      outward ? (a + size + page - 1) / page * page : (a + size) / page * page;
+  if (p1 <= p0) {
+    return 0;
+  }
+  *start = (char *)p0;
+  const size_t n_pages = (p1 - p0) / page;
+  resident.resize(n_pages);
+  if (mincore(*start, p1 - p0, resident.data()) != 0) {
+    std::fill(resident.begin(), resident.end(), 0);
+  }
+  return n_pages;
+}
+
+void mpt_kv_pool::prefetch(const mpt_kv_block &block, int il) {
+  const size_t page = sysconf(_SC_PAGESIZE);
+  std::vector<unsigned char> resident;
+  size_t n_read = 0;
+  for (int kv = 0; kv < 2; ++kv) {
+    const char *data = kv == 0 ? block.k + (size_t)il * k_layer_bytes
+                               : block.v + (size_t)il * v_layer_bytes;
+    char *start;
+    const size_t n_pages = mpt_kv_pages(
+        data, kv == 0 ? k_layer_bytes : v_layer_bytes, true, &start, resident);
+    const size_t n_missing =
+        std::count_if(resident.begin(), resident.begin() + n_pages,
+                      [](unsigned char r) { return (r & 1) == 0; });
+    if (n_missing > 0) {
+      madvise(start, n_pages * page, MADV_WILLNEED);
+      n_read += n_missing * page;
+    }
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  io.n_read_bytes += n_read;
+}
+
+void mpt_kv_pool::fetch(const mpt_kv_block &block, int il) {
+  const size_t page = sysconf(_SC_PAGESIZE);
+  std::vector<unsigned char> resident;
+  const auto t0 = std::chrono::steady_clock::now();
+  bool waited = false;
+  for (int kv = 0; kv < 2; ++kv) {
+    const char *data = kv == 0 ? block.k + (size_t)il * k_layer_bytes
+                               : block.v + (size_t)il * v_layer_bytes;
+    char *start;
+    const size_t n_pages = mpt_kv_pages(
+        data, kv == 0 ? k_layer_bytes : v_layer_bytes, true, &start, resident);
+    for (size_t i = 0; i < n_pages; ++i) {
+      if ((resident[i] & 1) == 0) {
+        // faults the page in, or waits for the prefetch already reading it
+        (void)*(volatile char *)(start + i * page);
+        waited = true;
+      }
+    }
+  }
+  if (waited) {
+    const auto t1 = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mutex);
+    io.stall_us +=
+        std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count();
+  }
+}
+
+void mpt_kv_pool::page_out(const mpt_kv_block &block, int il) {
+  const size_t page = sysconf(_SC_PAGESIZE);
+  std::vector<unsigned char> resident;
+  size_t n_out = 0;
+  for (int kv = 0; kv < 2; ++kv) {
+    const char *data = kv == 0 ? block.k + (size_t)il * k_layer_bytes
+                               : block.v + (size_t)il * v_layer_bytes;
+    // pages shared with the next layer stay, it may be in use
+    char *start;
+    const size_t n_pages =
+        mpt_kv_pages(data, kv == 0 ? k_layer_bytes : v_layer_bytes, false,
+                     &start, resident);
+    const size_t n_resident =
+        std::count_if(resident.begin(), resident.begin() + n_pages,
+                      [](unsigned char r) { return (r & 1) != 0; });
+    if (n_resident == 0) {
+      continue;
+    }
+    // dirty pages are not dropped, so write them back first
+    const off_t offset = (off_t)block.id * block_span + (start - block.k);
+    msync(start, n_pages * page, MS_SYNC);
+    madvise(start, n_pages * page, MADV_DONTNEED);
+    posix_fadvise(fd, offset, n_pages * page, POSIX_FADV_DONTNEED);
+    n_out += n_resident * page;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  io.n_paged_out_bytes += n_out;
+}
+
+void mpt_kv_pool::count_tokens(int n_tokens) {
+  std::lock_guard<std::mutex> lock(mutex);
+  io.n_tokens += n_tokens;
+}
+
+mpt_kv_io_stats mpt_kv_pool::io_stats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return io;
+}
+
+mpt_kvcache::mpt_kvcache(mpt_model &model, const mpt_kvcache_params &params)
+    : params(params) {
+  const auto &hparams = model.hparams;
+  const int n_embd = hparams.n_embd;
+  const int n_layer = hparams.n_layer;
+  const int n_ctx = hparams.n_ctx;
+
+  mpt_kv_check_params(hparams, params);
+
+  block_size = n_ctx;
+  k_layer_bytes = (size_t)n_ctx * mpt_kv_row_size(params.type_k, n_embd);
+  v_layer_bytes = (size_t)n_ctx * mpt_kv_row_size(params.type_v, n_embd);
+
+  size_t ctx_size = 0;
+  ctx_size += n_layer * k_layer_bytes; // memory_k
+  ctx_size += n_layer * v_layer_bytes; // memory_v
+  ctx_size += ggml_tensor_overhead() * 2;
+  ggml_init_params init_params{ctx_size, nullptr, 0};
+  ctx = ggml_init(init_params);
+
+  const int n_mem = n_layer * n_ctx;
+  const size_t n_elements = (size_t)n_embd * n_mem;
+  memory_k = ggml_new_tensor_1d(ctx, params.type_k, n_elements);
+  memory_v = ggml_new_tensor_1d(ctx, params.type_v, n_elements);
+  const size_t memory_size = ggml_nbytes(memory_k) + ggml_nbytes(memory_v);
+  printf("%s: memory_size = %8.2f MB, n_mem = %d\n", __func__,
+         memory_size / 1024.0 / 1024.0, n_mem);
+
+  blocks.push_back(
+      {-1, (char *)memory_k->data, (char *)memory_v->data});
+  if (params.track_attn) {
+    attn_mass.resize(n_mem);
+  }
+}
+
+mpt_kvcache::mpt_kvcache(std::shared_ptr<mpt_kv_pool> pool)
+    : params(pool->params), block_size(pool->params.block_size),
+      k_layer_bytes(pool->k_layer_bytes), v_layer_bytes(pool->v_layer_bytes),
+      pool(std::move(pool)) {
+  if (params.track_attn) {
+    const auto &hparams = this->pool->hparams;
+    attn_mass.resize((size_t)hparams.n_layer * hparams.n_ctx);
+  }
+}
+
+mpt_kvcache::~mpt_kvcache() {
+  if (paged()) {
+    truncate(0);
+  }
+  if (ctx) {
+    ggml_free(ctx);
+  }
+}
+
+bool mpt_kvcache::reserve(int n_past, int n_tokens) {
+  const int n_pos = n_past + n_tokens;
+  if (!paged()) {
+    return n_pos <= block_size;
+  }
+  const int n_layer = pool->hparams.n_layer;
+  for (int b = n_past / block_size;
+       n_tokens > 0 && b < (int)blocks.size() && b * block_size < n_pos; ++b) {
+    if (!pool->shared(blocks[b])) {
+      continue;
+    }
+    mpt_kv_block copy;
+    if (!pool->alloc(copy)) {
+      return false;
+    }
+    memcpy(copy.k, blocks[b].k, n_layer * k_layer_bytes);
+    memcpy(copy.v, blocks[b].v, n_layer * v_layer_bytes);
+    pool->release(blocks[b]);
+    blocks[b] = copy;
+  }
+  while ((int)blocks.size() * block_size < n_pos) {
+    mpt_kv_block block;
+    if (!pool->alloc(block)) {
+      return false;
+    }
+    blocks.push_back(block);
+  }
+  return true;
+}
+
+void mpt_kvcache::truncate(int n_pos) {
+  if (!paged()) {
+    return;
+  }
+  const size_t n_keep = (n_pos + block_size - 1) / block_size;
+  while (blocks.size() > n_keep) {
+    pool->release(blocks.back());
+    blocks.pop_back();
+  }
+}
+
+// copies positions [0, n_pos) of every layer between dense caches
+static void mpt_kv_copy_prefix(mpt_kvcache &dst, const mpt_kvcache &src,
+                               const mpt_hparams &hparams, int n_pos) {
+  const int n_embd = hparams.n_embd;
+  const int n_head = hparams.n_head;
+  const int bs = src.block_size;
+  const size_t k_row = mpt_kv_row_size(src.params.type_k, n_embd / n_head);
+  const size_t v_row = mpt_kv_row_size(src.params.type_v, n_embd);
+  const size_t es = ggml_type_size(src.params.type_v);
+
+  for (int il = 0; il < hparams.n_layer; ++il) {
+    char *dk = dst.k_data(0, il);
+    char *dv = dst.v_data(0, il);
+    const char *sk = src.k_data(0, il);
+    const char *sv = src.v_data(0, il);
+    if (src.params.layout == MPT_KV_HEAD_MAJOR) {
+      // K [n_head][bs][head_dim], V [n_embd][bs]
+      for (int h = 0; h < n_head; ++h) {
+        const size_t off = (size_t)h * bs * k_row;
+        memcpy(dk + off, sk + off, n_pos * k_row);
+      }
+      for (int r = 0; r < n_embd; ++r) {
+        const size_t off = (size_t)r * bs * es;
+        memcpy(dv + off, sv + off, n_pos * es);
+      }
+    } else {
+      memcpy(dk, sk, n_pos * n_head * k_row);
+      memcpy(dv, sv, n_pos * v_row);
+    }
+  }
+}
+
+std::unique_ptr<mpt_kvcache> mpt_kv_fork(mpt_model &model,
+                                         const mpt_kvcache &parent,
+                                         int n_pos) {
+  if (parent.paged()) {
+    auto child = std::make_unique<mpt_kvcache>(parent.pool);
+    const size_t n_blocks = (n_pos + parent.block_size - 1) / parent.block_size;
+    for (size_t b = 0; b < n_blocks; ++b) {
+      parent.pool->retain(parent.blocks[b]);
+      child->blocks.push_back(parent.blocks[b]);
+    }
+    child->attn_mass = parent.attn_mass;
+    return child;
+  }
+  auto child = std::make_unique<mpt_kvcache>(model, parent.params);
+  mpt_kv_copy_prefix(*child, parent, model.hparams, n_pos);
+  child->attn_mass = parent.attn_mass;
+  return child;
+}
+
+// moves positions [src, src + n) of layer il down to [dst, dst + n). the
+// run must stay within one source and one destination block
+static void mpt_kv_move(mpt_kvcache &kvcache, const mpt_hparams &hparams,
+                        int il, int dst, int src, int n) {
+  const int n_embd = hparams.n_embd;
+  const int n_head = hparams.n_head;
+  const int bs = kvcache.block_size;
+  const auto &params = kvcache.params;
+  const size_t k_row = mpt_kv_row_size(params.type_k, n_embd / n_head);
+  const size_t v_row = mpt_kv_row_size(params.type_v, n_embd);
+  const size_t es = ggml_type_size(params.type_v);
+  const int sb = src / bs, so = src % bs;
+  const int db = dst / bs, dof = dst % bs;
+
+  char *dk = kvcache.k_data(db, il);
+  char *dv = kvcache.v_data(db, il);
+  const char *sk = kvcache.k_data(sb, il);
+  const char *sv = kvcache.v_data(sb, il);
+  if (params.layout == MPT_KV_HEAD_MAJOR) {
+    // K [n_head][bs][head_dim], V [n_embd][bs]
+    for (int h = 0; h < n_head; ++h) {
+      const size_t off = (size_t)h * bs * k_row;
+      memmove(dk + off + dof * k_row, sk + off + so * k_row, n * k_row);
+    }
+    for (int r = 0; r < n_embd; ++r) {
+      const size_t off = (size_t)r * bs * es;
+      memmove(dv + off + dof * es, sv + off + so * es, n * es);
+    }
+  } else {
+    memmove(dk + dof * n_head * k_row, sk + so * n_head * k_row,
+            n * n_head * k_row);
+    memmove(dv + dof * v_row, sv + so * v_row, n * v_row);
+  }
+
+  if (!kvcache.attn_mass.empty()) {
+    float *mass = kvcache.attn_mass.data() + (size_t)il * hparams.n_ctx;
+    memmove(mass + dst, mass + src, n * sizeof(float));
+  }
+}
+
+bool mpt_kv_shift(mpt_kvcache &kvcache, const mpt_hparams &hparams,
+                  int n_keep, int n_discard, int n_past) {
+  const int n_moved = n_past - n_keep - n_discard;
+  // blocks written to must not be shared with other caches
+  if (!kvcache.reserve(n_keep, n_moved)) {
+    return false;
+  }
+
+  const int bs = kvcache.block_size;
+  // runs of positions that stay within one source and one destination block
+  for (int i = 0; i < n_moved;) {
+    const int src = n_keep + n_discard + i;
+    const int dst = n_keep + i;
+    const int n = std::min({n_moved - i, bs - src % bs, bs - dst % bs});
+    for (int il = 0; il < hparams.n_layer; ++il) {
+      mpt_kv_move(kvcache, hparams, il, dst, src, n);
+    }
+    i += n;
+  }
+
+  kvcache.truncate(n_keep + n_moved);
+  return true;
+}
+
+bool mpt_kv_evict(mpt_kvcache &kvcache, const mpt_hparams &hparams,
+                  const std::vector<std::vector<int>> &keep, int n_past) {
+  const int n_new = keep[0].size();
+  MPT_ASSERT(n_new <= n_past);
+
+  // positions below the first one to change stay where they are
+  int n_same = n_new;
+  for (const auto &k : keep) {
+    int i = 0;
+    while (i < n_same && k[i] == i) {
+      ++i;
+    }
+    n_same = i;
+  }
+  if (!kvcache.reserve(n_same, n_new - n_same)) {
+    return false;
+  }
+
+  const int bs = kvcache.block_size;
+  for (int il = 0; il < hparams.n_layer; ++il) {
+    const auto &k = keep[il];
+    MPT_ASSERT((int)k.size() == n_new);
+    for (int i = n_same; i < n_new;) {
+      // a run of consecutive kept positions, cut at block boundaries
+      const int src = k[i];
+      const int max_n = std::min(bs - src % bs, bs - i % bs);
+      int n = 1;
+      while (n < max_n && i + n < n_new && k[i + n] == src + n) {
+        ++n;
+      }
+      if (src != i) {
+        mpt_kv_move(kvcache, hparams, il, i, src, n);
+      }
+      i += n;
+    }
+  }
+
+  kvcache.truncate(n_new);
+  return true;
+}
+
+struct mpt_kv_tier_params {
+  const mpt_kvcache *kvcache;
+  int il;
+  // blocks [0, n_cold) are outside the RAM window
+  int n_cold;
+};
+
+static void mpt_kv_fetch_op(struct ggml_tensor *dst,
+                            const struct ggml_tensor *src, int /*ith*/,
+                            int /*nth*/, void *userdata) {
+  const mpt_kv_tier_params &p = *(const mpt_kv_tier_params *)userdata;
+  mpt_kv_pool &pool = *p.kvcache->pool;
+  const auto &blocks = p.kvcache->blocks;
+  memcpy(dst->data, src->data, ggml_nbytes(src));
+
+  if (p.il == 0) {
+    for (int b = 0; b < p.n_cold; ++b) {
+      pool.prefetch(blocks[b], 0);
+    }
+  }
+  // the next layer reads in while this one waits and computes
+  if (p.il + 1 < pool.hparams.n_layer) {
+    for (int b = 0; b < p.n_cold; ++b) {
+      pool.prefetch(blocks[b], p.il + 1);
+    }
+  }
+  for (int b = 0; b < p.n_cold; ++b) {
+    pool.fetch(blocks[b], p.il);
+  }
+}
+
+static void mpt_kv_page_out_op(struct ggml_tensor *dst,
+                               const struct ggml_tensor *src, int /*ith*/,
+                               int /*nth*/, void *userdata) {
+  const mpt_kv_tier_params &p = *(const mpt_kv_tier_params *)userdata;
+  memcpy(dst->data, src->data, ggml_nbytes(src));
+  for (int b = 0; b < p.n_cold; ++b) {
+    p.kvcache->pool->page_out(p.kvcache->blocks[b], p.il);
+  }
+}
+
+static struct ggml_tensor *mpt_kv_tier_op(struct ggml_context *ctx,
+                                          struct ggml_tensor *cur,
+                                          const mpt_kvcache &kvcache, int il,
+                                          int n_pos, ggml_custom1_op_t fun) {
+  if (!kvcache.paged() || !kvcache.pool->on_disk()) {
+    return cur;
+  }
+  const int n_blocks = (n_pos + kvcache.block_size - 1) / kvcache.block_size;
+  const int n_cold = n_blocks - kvcache.pool->ram_blocks;
+  if (n_cold <= 0) {
+    return cur;
+  }
+  auto *p = new (ggml_new_tensor_1d(ctx, GGML_TYPE_I8,
+                                    sizeof(mpt_kv_tier_params))
+                     ->data) mpt_kv_tier_params;
+  p->kvcache = &kvcache;
+  p->il = il;
+  p->n_cold = n_cold;
+  return ggml_map_custom1(ctx, cur, fun, 1, p);
+}
+
+struct ggml_tensor *mpt_kv_fetch(struct ggml_context *ctx,
+                                 struct ggml_tensor *cur,
+                                 const mpt_kvcache &kvcache, int il,
+                                 int n_pos) {
+  return mpt_kv_tier_op(ctx, cur, kvcache, il, n_pos, mpt_kv_fetch_op);
+}
+
+struct ggml_tensor *mpt_kv_page_out(struct ggml_context *ctx,
+                                    struct ggml_tensor *cur,
+                                    const mpt_kvcache &kvcache, int il,
+                                    int n_pos) {
+  return mpt_kv_tier_op(ctx, cur, kvcache, il, n_pos, mpt_kv_page_out_op);
+}
+
+void mpt_kv_visit(const mpt_kvcache &kvcache, const mpt_hparams &hparams,
+                  int n_pos, const std::function<void(char *, size_t)> &fn) {
+  const int n_embd = hparams.n_embd;
+  const int n_head = hparams.n_head;
+  const int bs = kvcache.block_size;
+  const auto &params = kvcache.params;
+  const size_t k_row = mpt_kv_row_size(params.type_k, n_embd / n_head);
+  const size_t v_row = mpt_kv_row_size(params.type_v, n_embd);
+  const size_t es = ggml_type_size(params.type_v);
+  const int n_blocks = (n_pos + bs - 1) / bs;
+
+  // positions of block b
+  auto n_in = [&](int b) { return std::min(bs, n_pos - b * bs); };
+
+  for (int il = 0; il < hparams.n_layer; ++il) {
+    if (params.layout == MPT_KV_HEAD_MAJOR) {
+      // K [n_head][bs][head_dim], V [n_embd][bs]
+      for (int h = 0; h < n_head; ++h) {
+        for (int b = 0; b < n_blocks; ++b) {
+          fn(kvcache.k_data(b, il) + (size_t)h * bs * k_row, n_in(b) * k_row);
+        }
+      }
+      for (int r = 0; r < n_embd; ++r) {
+        for (int b = 0; b < n_blocks; ++b) {
+          fn(kvcache.v_data(b, il) + (size_t)r * bs * es, n_in(b) * es);
+        }
+      }
+    } else {
+      for (int b = 0; b < n_blocks; ++b) {
+        fn(kvcache.k_data(b, il), n_in(b) * n_head * k_row);
+      }
+      for (int b = 0; b < n_blocks; ++b) {
+        fn(kvcache.v_data(b, il), n_in(b) * v_row);
+      }
+    }
+  }
+}
+
+size_t mpt_kv_visit_size(const mpt_kvcache_params &params,
+                         const mpt_hparams &hparams, int n_pos) {
+  const size_t k_row = mpt_kv_row_size(params.type_k, hparams.n_embd);
+  const size_t v_row = mpt_kv_row_size(params.type_v, hparams.n_embd);
+  return (size_t)hparams.n_layer * n_pos * (k_row + v_row);
+}
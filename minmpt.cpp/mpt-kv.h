@@ -0,0 +1,197 @@
+#pragma once
+#include "mpt.h"
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum mpt_kv_layout {
+  // K and V as [n_layer][n_ctx][n_embd]
+  MPT_KV_FLAT = 0,
+  // K as [n_layer][n_head][n_ctx][head_dim], V pre-transposed as
+  // [n_layer][n_head][head_dim][n_ctx]
+  MPT_KV_HEAD_MAJOR = 1,
+};
+
+struct mpt_kvcache_params {
+  mpt_kv_layout layout = MPT_KV_FLAT;
+  // F16 or a quantized type; quantized values need the flat layout
+  ggml_type type_k = GGML_TYPE_F16;
+  ggml_type type_v = GGML_TYPE_F16;
+  // positions per block of a paged cache, 0 for one dense block of n_ctx
+  int block_size = 0;
+  // most blocks a paged cache pool may hand out, 0 for no limit
+  int max_blocks = 0;
+  // back the blocks of a paged cache with a memory-mapped scratch file
+  // created at this path, instead of RAM
+  std::string disk_path;
+  // with disk_path, each cache keeps its last blocks up to this many bytes
+  // resident. older blocks are paged out after every layer reads them
+  size_t ram_bytes = 0;
+  // keep the attention mass of every position, for evicting by it
+  bool track_attn = false;
+  // attention skips keys whose ALiBi bias alone weighs them down by more
+  // than this, relative to the query's own position. 0 reads every key
+  float attn_prune_tol = 0.0f;
+};
+
+// bytes taken by n consecutive kv cache values of this type
+inline size_t mpt_kv_row_size(ggml_type type, int n) {
+  return ggml_type_size(type) * n / ggml_blck_size(type);
+}
+
+// kv memory for block_size positions of every layer. within a block each
+// layer is laid out like a dense cache with n_ctx = block_size
+struct mpt_kv_block {
+  int id; // pool index, -1 for the block of a dense cache
+  char *k;
+  char *v;
+};
+
+struct mpt_kv_io_stats {
+  // tokens evaluated against a disk-backed pool
+  size_t n_tokens = 0;
+  // bytes read back in ahead of use, and resident bytes paged out
+  size_t n_read_bytes = 0;
+  size_t n_paged_out_bytes = 0;
+  // time attention waited for blocks that were not resident yet
+  uint64_t stall_us = 0;
+};
+
+// blocks shared by all the paged caches of a model. blocks are allocated
+// the first time they are needed, refcounted while caches share them, and
+// reused after the last reference is released
+struct mpt_kv_pool {
+  mpt_kv_pool(const mpt_hparams &hparams, const mpt_kvcache_params &params);
+  mpt_kv_pool(const mpt_kv_pool &) = delete;
+  mpt_kv_pool &operator=(const mpt_kv_pool &) = delete;
+  ~mpt_kv_pool();
+
+  // false if max_blocks are in use
+  bool alloc(mpt_kv_block &block);
+  void retain(const mpt_kv_block &block);
+  void release(const mpt_kv_block &block);
+  // true if more than one cache holds the block
+  bool shared(const mpt_kv_block &block) const;
+
+  // blocks handed out and blocks allocated
+  size_t n_used() const;
+  size_t n_allocated() const;
+
+  bool on_disk() const { return fd >= 0; }
+  // for the layer il keys and values of a block on disk: starts reading
+  // them in, waits until they are resident, or pages them out
+  void prefetch(const mpt_kv_block &block, int il);
+  void fetch(const mpt_kv_block &block, int il);
+  void page_out(const mpt_kv_block &block, int il);
+  void count_tokens(int n_tokens);
+  mpt_kv_io_stats io_stats() const;
+
+  const mpt_hparams hparams;
+  const mpt_kvcache_params params;
+  // bytes of one layer's keys or values within a block
+  size_t k_layer_bytes;
+  size_t v_layer_bytes;
+  // blocks at the end of a cache that stay resident, if on disk
+  int ram_blocks = 0;
+
+private:
+  mutable std::mutex mutex;
+  // keys then values of each block, at v_offset
+  std::vector<char *> mem;
+  size_t v_offset;
+  std::vector<int> refs;
+  std::vector<int> free_ids;
+
+  // scratch file, block i mapped from i * block_span
+  int fd = -1;
+  size_t block_span = 0;
+  mpt_kv_io_stats io;
+};
+
+// key + value memory of one session, as a table of blocks
+struct mpt_kvcache {
+  // a single dense block holding all n_ctx positions
+  mpt_kvcache(mpt_model &model, const mpt_kvcache_params &params = {});
+  // blocks drawn from the pool as the context grows
+  mpt_kvcache(std::shared_ptr<mpt_kv_pool> pool);
+  mpt_kvcache(const mpt_kvcache &) = delete;
+  mpt_kvcache &operator=(const mpt_kvcache &) = delete;
+  ~mpt_kvcache();
+
+  bool paged() const { return pool != nullptr; }
+
+  // makes room for writing positions [n_past, n_past + n_tokens), copying
+  // any block shared with another cache first. false if the pool ran out
+  bool reserve(int n_past, int n_tokens);
+  // returns the blocks past position n_pos to the pool
+  void truncate(int n_pos);
+
+  // layer il of block b
+  char *k_data(int b, int il) const {
+    return blocks[b].k + (size_t)il * k_layer_bytes;
+  }
+  char *v_data(int b, int il) const {
+    return blocks[b].v + (size_t)il * v_layer_bytes;
+  }
+
+  mpt_kvcache_params params;
+  int block_size;
+  size_t k_layer_bytes;
+  size_t v_layer_bytes;
+  std::vector<mpt_kv_block> blocks;
+
+  std::shared_ptr<mpt_kv_pool> pool;
+
+  // [n_layer][n_ctx] softmax weight each position has received, if tracked
+  std::vector<float> attn_mass;
+
+  // dense cache only
+  struct ggml_tensor *memory_k = nullptr;
+  struct ggml_tensor *memory_v = nullptr;
+  struct ggml_context *ctx = nullptr;
+};
+
+// a new cache holding the first n_pos positions of parent. paged caches
+// share the parent's blocks until one of them writes to a block
+std::unique_ptr<mpt_kvcache> mpt_kv_fork(mpt_model &model,
+                                         const mpt_kvcache &parent, int n_pos);
+
+// drops positions [n_keep, n_keep + n_discard) of a cache holding n_past,
+// moving the later ones down. with ALiBi the bias only depends on the
+// distance between cache positions, so the moved keys need no fixing up.
+// false if copying shared blocks ran the pool out
+bool mpt_kv_shift(mpt_kvcache &kvcache, const mpt_hparams &hparams,
+                  int n_keep, int n_discard, int n_past);
+
+// compacts each layer of a cache holding n_past down to the positions in
+// keep[il], which are increasing and the same number for every layer. the
+// attention mass moves with them. false if copying shared blocks ran the
+// pool out
+bool mpt_kv_evict(mpt_kvcache &kvcache, const mpt_hparams &hparams,
+                  const std::vector<std::vector<int>> &keep, int n_past);
+
+// with a disk-backed pool, pass cur through after making layer il of the
+// blocks of kvcache outside its RAM window resident and prefetching layer
+// il + 1, or after paging layer il of those blocks out again. these bracket
+// the attention of layer il over n_pos positions. no-ops for RAM caches
+struct ggml_tensor *mpt_kv_fetch(struct ggml_context *ctx,
+                                 struct ggml_tensor *cur,
+                                 const mpt_kvcache &kvcache, int il,
+                                 int n_pos);
+struct ggml_tensor *mpt_kv_page_out(struct ggml_context *ctx,
+                                    struct ggml_tensor *cur,
+                                    const mpt_kvcache &kvcache, int il,
+                                    int n_pos);
+
+// calls fn on the memory holding positions [0, n_pos) of every layer, keys
+// then values, in the order a dense cache of n_ctx = n_pos would store them.
+// the cache must have blocks for n_pos
+void mpt_kv_visit(const mpt_kvcache &kvcache, const mpt_hparams &hparams,
+                  int n_pos, const std::function<void(char *, size_t)> &fn);
+
+// bytes visited by mpt_kv_visit
+size_t mpt_kv_visit_size(const mpt_kvcache_params &params,
+                         const mpt_hparams &hparams, int n_pos);
@@ -0,0 +1,165 @@
+#include "mpt-prefix.h"
+
+#include <algorithm>
+#include <functional>
+
+mpt_prefix_cache::mpt_prefix_cache(std::shared_ptr<mpt_kv_pool> pool,
+                                   size_t max_blocks)
+    : pool(std::move(pool)), block_size(this->pool->params.block_size),
+      max_blocks(max_blocks) {}
+
+mpt_prefix_cache::~mpt_prefix_cache() {
+  std::function<void(mpt_prefix_node &)> release_all =
+      [&](mpt_prefix_node &node) {
+        for (auto &child : node.children) {
+          pool->release(child.second->block);
+          release_all(*child.second);
+        }
+      };
+  release_all(root);
+}
+
+int mpt_prefix_cache::attach(mpt_kvcache &kvcache, const uint32_t *tokens,
+                             int n_past, int n_known) {
+  const int bs = block_size;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  counters.n_lookups++;
+  tick++;
+
+  // whole blocks first, then a block whose tokens start with the rest of
+  // tokens. positions past n_known in that block are overwritten before
+  // they are read, through copy-on-write
+  mpt_prefix_node *node = &root;
+  std::vector<uint32_t> key;
+  int n_match = 0;
+  int n_cover = 0;
+  while (n_cover < n_known) {
+    const int n_key = std::min(bs, n_known - n_cover);
+    key.assign(tokens + n_cover, tokens + n_cover + n_key);
+    auto it = node->children.lower_bound(key);
+    if (it == node->children.end() ||
+        !std::equal(key.begin(), key.end(), it->first.begin())) {
+      break;
+    }
+    node = it->second.get();
+    node->last_used = tick;
+    n_match++;
+    n_cover += n_key;
+  }
+  // the last token is always evaluated, for its logits
+  const int n_new = std::min(n_cover, n_known - 1);
+  if (n_new <= n_past) {
+    return n_past;
+  }
+
+  // blocks [b0, n_match) are new to the session. the block holding n_past
+  // may be partly filled by the session itself, the cached one is whole
+  const int b0 = n_past / bs;
+  std::vector<mpt_kv_block> found(n_match - b0);
+  for (int b = n_match - 1; b >= b0; --b) {
+    found[b - b0] = node->block;
+    node = node->parent;
+  }
+  auto &blocks = kvcache.blocks;
+  for (int b = b0; b < n_match; ++b) {
+    const mpt_kv_block &block = found[b - b0];
+    if (b < (int)blocks.size()) {
+      if (blocks[b].id == block.id) {
+        continue;
+      }
+      pool->release(blocks[b]);
+      blocks[b] = block;
+    } else {
+      blocks.push_back(block);
+    }
+    pool->retain(block);
+  }
+
+  // the session has not attended to the positions it took yet
+  if (!kvcache.attn_mass.empty()) {
+    const auto &hparams = pool->hparams;
+    for (int il = 0; il < hparams.n_layer; ++il) {
+      float *mass = kvcache.attn_mass.data() + (size_t)il * hparams.n_ctx;
+      std::fill(mass + n_past, mass + n_new, 0.0f);
+    }
+  }
+
+  counters.n_hits++;
+  counters.n_tokens_reused += n_new - n_past;
+  return n_new;
+}
+
+void mpt_prefix_cache::insert(const mpt_kvcache &kvcache,
+                              const uint32_t *tokens, int n_past) {
+  const int bs = block_size;
+  const int n_full = n_past / bs;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  tick++;
+
+  mpt_prefix_node *node = &root;
+  std::vector<uint32_t> key;
+  for (int b = 0; b < n_full; ++b) {
+    key.assign(tokens + b * bs, tokens + (b + 1) * bs);
+    auto &child = node->children[key];
+    if (!child) {
+      child = std::make_unique<mpt_prefix_node>();
+      child->block = kvcache.blocks[b];
+      child->parent = node;
+      pool->retain(child->block);
+      counters.n_blocks++;
+    }
+    node = child.get();
+    node->last_used = tick;
+  }
+
+  while (counters.n_blocks > max_blocks && evict_locked(false)) {
+  }
+}
+
+bool mpt_prefix_cache::evict() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return evict_locked(true);
+}
+
+bool mpt_prefix_cache::evict_locked(bool unshared_only) {
+  // only leaves are dropped, so every node keeps the path to its prefix
+  mpt_prefix_node *lru = nullptr;
+  std::function<void(mpt_prefix_node &)> find_lru =
+      [&](mpt_prefix_node &node) {
+        for (auto &child : node.children) {
+          mpt_prefix_node *c = child.second.get();
+          if (c->children.empty()) {
+            if (unshared_only && pool->shared(c->block)) {
+              continue;
+            }
+            if (!lru || c->last_used < lru->last_used) {
+              lru = c;
+            }
+          } else {
+            find_lru(*c);
+          }
+        }
+      };
+  find_lru(root);
+  if (!lru) {
+    return false;
+  }
+
+  pool->release(lru->block);
+  auto &siblings = lru->parent->children;
+  for (auto it = siblings.begin(); it != siblings.end(); ++it) {
+    if (it->second.get() == lru) {
+      siblings.erase(it);
+      break;
+    }
+  }
+  counters.n_blocks--;
+  return true;
+}
+
+mpt_prefix_cache_stats mpt_prefix_cache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return counters;
+}
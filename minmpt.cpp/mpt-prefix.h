@@ -0,0 +1,63 @@
+#pragma once
+#include "mpt-kv.h"
+
+#include <map>
+
+// Prefix cache shared by the paged sessions of a model.
+//
+// A tree over token ids whose edges are one kv block worth of tokens. Each
+// node holds a reference to the pool block caching those positions, so a
+// session starting with the same tokens can take the blocks instead of
+// evaluating them again. Writes to a taken block go through the pool's
+// copy-on-write, so sessions never see each other's changes.
+
+struct mpt_prefix_node {
+  mpt_kv_block block;
+  mpt_prefix_node *parent = nullptr;
+  std::map<std::vector<uint32_t>, std::unique_ptr<mpt_prefix_node>> children;
+  uint64_t last_used = 0;
+};
+
+struct mpt_prefix_cache_stats {
+  // batches of more than one token looked up
+  size_t n_lookups = 0;
+  size_t n_hits = 0;
+  size_t n_tokens_reused = 0;
+  // blocks referenced by the cache
+  size_t n_blocks = 0;
+};
+
+struct mpt_prefix_cache {
+  // holds at most max_blocks blocks, evicting the least recently used first
+  mpt_prefix_cache(std::shared_ptr<mpt_kv_pool> pool, size_t max_blocks);
+  mpt_prefix_cache(const mpt_prefix_cache &) = delete;
+  mpt_prefix_cache &operator=(const mpt_prefix_cache &) = delete;
+  ~mpt_prefix_cache();
+
+  // moves kvcache, holding tokens[0, n_past), as far along
+  // tokens[0, n_known) as cached blocks allow, short of the last token.
+  // returns the new n_past
+  int attach(mpt_kvcache &kvcache, const uint32_t *tokens, int n_past,
+             int n_known);
+  // caches the whole blocks of kvcache, holding tokens[0, n_past)
+  void insert(const mpt_kvcache &kvcache, const uint32_t *tokens, int n_past);
+  // drops the least recently used leaf whose block no session holds, which
+  // returns that block to the pool. false if there is none
+  bool evict();
+
+  mpt_prefix_cache_stats stats() const;
+
+private:
+  // with unshared_only, leaves whose block is also held by a session are
+  // skipped, as dropping them frees nothing
+  bool evict_locked(bool unshared_only);
+
+  const std::shared_ptr<mpt_kv_pool> pool;
+  const int block_size;
+  const size_t max_blocks;
+
+  mutable std::mutex mutex;
+  mpt_prefix_node root;
+  uint64_t tick = 0;
+  mpt_prefix_cache_stats counters;
+};
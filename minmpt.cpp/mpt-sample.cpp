@@ -0,0 +1,236 @@
+#include "mpt-sample.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+void mpt_probs(const float *logits, size_t n_vocab, float temperature,
+               float *probs) {
+  const float *top = std::max_element(logits, logits + n_vocab);
+  if (temperature <= 0.0f) {
+    std::fill(probs, probs + n_vocab, 0.0f);
+    probs[top - logits] = 1.0f;
+    return;
+  }
+  float sum = 0.0f;
+  for (size_t i = 0; i < n_vocab; ++i) {
+    probs[i] = expf((logits[i] - *top) / temperature);
+    sum += probs[i];
+  }
+  for (size_t i = 0; i < n_vocab; ++i) {
+    probs[i] /= sum;
+  }
+}
+
+uint32_t mpt_sample(const float *weights, size_t n_vocab,
+                    std::mt19937_64 &rng) {
+  float sum = 0.0f;
+  for (size_t i = 0; i < n_vocab; ++i) {
+    sum += weights[i];
+  }
+  float u = std::uniform_real_distribution<float>(0.0f, 1.0f)(rng) * sum;
+  size_t last = 0;
+  for (size_t i = 0; i < n_vocab; ++i) {
+    if (weights[i] > 0.0f) {
+      last = i;
+      if (u < weights[i]) {
+        return i;
+      }
+      u -= weights[i];
+    }
+  }
+  return last;
+}
+
+float mpt_logprob(const float *logits, size_t n_vocab, uint32_t token) {
+  const float top = *std::max_element(logits, logits + n_vocab);
+  float sum = 0.0f;
+  for (size_t i = 0; i < n_vocab; ++i) {
+    sum += expf(logits[i] - top);
+  }
+  return logits[token] - top - logf(sum);
+}
+
+static float sample_max(const float *x, size_t n) {
+  float top = -INFINITY;
+  for (size_t i = 0; i < n; ++i) {
+    top = std::max(top, x[i]);
+  }
+  return top;
+}
+
+static void sampler_penalize(mpt_sampler &s, size_t n_vocab,
+                             const uint32_t *history, size_t n_history) {
+  if (s.repeat_penalty == 1.0f || s.repeat_last_n == 0) {
+    return;
+  }
+  // each token is penalized once, however often it repeats
+  const size_t n = std::min(s.repeat_last_n, n_history);
+  s.recent.assign(history + (n_history - n), history + n_history);
+  std::sort(s.recent.begin(), s.recent.end());
+  s.recent.erase(std::unique(s.recent.begin(), s.recent.end()),
+                 s.recent.end());
+  for (const uint32_t token : s.recent) {
+    if (token < n_vocab) {
+      float &l = s.logits[token];
+      l = l > 0.0f ? l / s.repeat_penalty : l * s.repeat_penalty;
+    }
+  }
+}
+
+// sorts a growing head of the candidates until it holds the smallest set
+// whose probability reaches top_p, and drops the rest
+static void sampler_top_p(mpt_sampler &s, float lmax) {
+  auto &candidates = s.candidates;
+  const float *l = s.logits.data();
+  float sum = 0.0f;
+  for (const uint32_t token : candidates) {
+    sum += expf(l[token] - lmax);
+  }
+  const float target = s.top_p * sum;
+  const auto by_logit = [l](uint32_t a, uint32_t b) { return l[a] > l[b]; };
+  const size_t n = candidates.size();
+  for (size_t n_head = std::min<size_t>(64, n);;
+       n_head = std::min(n_head * 4, n)) {
+    std::partial_sort(candidates.begin(), candidates.begin() + n_head,
+                      candidates.end(), by_logit);
+    float cumsum = 0.0f;
+    for (size_t j = 0; j < n_head; ++j) {
+      cumsum += expf(l[candidates[j]] - lmax);
+      if (cumsum >= target) {
+        candidates.resize(j + 1);
+        return;
+      }
+    }
+    if (n_head == n) {
+      return;
+    }
+  }
+}
+
+// mirostat v1: estimates the zipf exponent of the distribution from its
+// top 100 tokens, keeps the k tokens that bring the expected surprise to
+// mu, and moves mu towards tau by the surprise of the sampled token
+static uint32_t sampler_mirostat(mpt_sampler &s, float lmax) {
+  auto &candidates = s.candidates;
+  const float *l = s.logits.data();
+  const size_t n = candidates.size();
+  float sum = 0.0f;
+  for (const uint32_t token : candidates) {
+    sum += expf(l[token] - lmax);
+  }
+  const auto by_logit = [l](uint32_t a, uint32_t b) { return l[a] > l[b]; };
+  const size_t m = std::min<size_t>(100, n);
+  std::partial_sort(candidates.begin(), candidates.begin() + m,
+                    candidates.end(), by_logit);
+  float num = 0.0f;
+  float den = 0.0f;
+  for (size_t i = 0; i + 1 < m; ++i) {
+    const float t = logf((i + 2.0f) / (i + 1.0f));
+    num += t * (l[candidates[i]] - l[candidates[i + 1]]);
+    den += t * t;
+  }
+  const float s_hat = num / den;
+  const float eps = s_hat - 1.0f;
+  const float k = powf(eps * powf(2.0f, s.mirostat_mu) /
+                           (1.0f - powf((float)n, -eps)),
+                       1.0f / s_hat);
+  size_t n_keep = n;
+  if (k >= 0.0f && k < n) {
+    n_keep = (size_t)roundf(k) + 1;
+  }
+  if (n_keep > m && n_keep < n) {
+    std::nth_element(candidates.begin() + m, candidates.begin() + n_keep,
+                     candidates.end(), by_logit);
+  }
+  candidates.resize(std::min(n_keep, n));
+
+  s.weights.resize(candidates.size());
+  for (size_t j = 0; j < candidates.size(); ++j) {
+    s.weights[j] = expf(l[candidates[j]] - lmax);
+  }
+  const uint32_t token =
+      candidates[mpt_sample(s.weights.data(), s.weights.size(), s.rng)];
+  const float surprise = (logf(sum) - (l[token] - lmax)) / logf(2.0f);
+  s.mirostat_mu -= s.mirostat_eta * (surprise - s.mirostat_tau);
+  return token;
+}
+
+uint32_t mpt_sampler_next(mpt_sampler &s, const float *logits,
+                          size_t n_vocab, const uint32_t *history,
+                          size_t n_history) {
+  s.logits.assign(logits, logits + n_vocab);
+  sampler_penalize(s, n_vocab, history, n_history);
+  float *l = s.logits.data();
+  if (s.temperature <= 0.0f) {
+    return std::max_element(l, l + n_vocab) - l;
+  }
+  const float inv_temperature = 1.0f / s.temperature;
+  for (size_t i = 0; i < n_vocab; ++i) {
+    l[i] *= inv_temperature;
+  }
+  const float lmax = sample_max(l, n_vocab);
+
+  // min-p is a bound on the logits, taken while gathering the candidates;
+  // top-k and top-p select among them without sorting the vocabulary
+  const float threshold = !s.mirostat && s.min_p > 0.0f
+                              ? lmax + logf(s.min_p)
+                              : -INFINITY;
+  auto &candidates = s.candidates;
+  candidates.clear();
+  for (size_t i = 0; i < n_vocab; ++i) {
+    if (l[i] >= threshold) {
+      candidates.push_back(i);
+    }
+  }
+  if (s.mirostat) {
+    return sampler_mirostat(s, lmax);
+  }
+  if (s.top_k > 0 && s.top_k < candidates.size()) {
+    std::nth_element(candidates.begin(), candidates.begin() + s.top_k,
+                     candidates.end(),
+                     [l](uint32_t a, uint32_t b) { return l[a] > l[b]; });
+    candidates.resize(s.top_k);
+  }
+  if (s.top_p < 1.0f) {
+    sampler_top_p(s, lmax);
+  }
+  s.weights.resize(candidates.size());
+  for (size_t j = 0; j < candidates.size(); ++j) {
+    s.weights[j] = expf(l[candidates[j]] - lmax);
+  }
+  return candidates[mpt_sample(s.weights.data(), s.weights.size(), s.rng)];
+}
+
+void mpt_sampler_logprobs(mpt_sampler &s, const float *logits,
+                          size_t n_vocab, uint32_t token, float *logprob,
+                          size_t n_top, uint32_t *top_tokens,
+                          float *top_logprobs) {
+  const float lmax = sample_max(logits, n_vocab);
+  float sum = 0.0f;
+  for (size_t i = 0; i < n_vocab; ++i) {
+    sum += expf(logits[i] - lmax);
+  }
+  const float lse = lmax + logf(sum);
+  if (logprob) {
+    *logprob = logits[token] - lse;
+  }
+  if (n_top == 0 || (!top_tokens && !top_logprobs)) {
+    return;
+  }
+  n_top = std::min(n_top, n_vocab);
+  auto &candidates = s.candidates;
+  candidates.resize(n_vocab);
+  std::iota(candidates.begin(), candidates.end(), 0);
+  std::partial_sort(
+      candidates.begin(), candidates.begin() + n_top, candidates.end(),
+      [logits](uint32_t a, uint32_t b) { return logits[a] > logits[b]; });
+  for (size_t j = 0; j < n_top; ++j) {
+    if (top_tokens) {
+      top_tokens[j] = candidates[j];
+    }
+    if (top_logprobs) {
+      top_logprobs[j] = logits[candidates[j]] - lse;
+    }
+  }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+// Sampling over a row of n_vocab logits.
+
+// the distribution sampled at temperature, all on the top token when it is 0
+void mpt_probs(const float *logits, size_t n_vocab, float temperature,
+               float *probs);
+
+// samples from weights that need not sum to 1
+uint32_t mpt_sample(const float *weights, size_t n_vocab,
+                    std::mt19937_64 &rng);
+
+// log of the softmax of logits at token
+float mpt_logprob(const float *logits, size_t n_vocab, uint32_t token);
+
+// a sampler chain: repetition penalty, temperature, then mirostat or top-k,
+// min-p and top-p. the buffers are reused from token to token
+struct mpt_sampler {
+  float temperature = 1.0f;
+  size_t top_k = 0;
+  float top_p = 1.0f;
+  float min_p = 0.0f;
+  float repeat_penalty = 1.0f;
+  size_t repeat_last_n = 0;
+  bool mirostat = false;
+  float mirostat_tau = 0.0f;
+  float mirostat_eta = 0.0f;
+  // mirostat's maximum surprise, in bits
+  float mirostat_mu = 0.0f;
+  std::mt19937_64 rng;
+  // scratch
+  std::vector<float> logits;
+  std::vector<uint32_t> candidates;
+  std::vector<float> weights;
+  std::vector<uint32_t> recent;
+};
+
+// samples a token from logits, penalizing the last repeat_last_n tokens of
+// history
+uint32_t mpt_sampler_next(mpt_sampler &sampler, const float *logits,
+                          size_t n_vocab, const uint32_t *history,
+                          size_t n_history);
+
+// the log probability of token under logits, unless logprob is NULL, and
+// the n_top most likely tokens, most likely first, with theirs. either of
+// top_tokens and top_logprobs may be NULL
+void mpt_sampler_logprobs(mpt_sampler &sampler, const float *logits,
+                          size_t n_vocab, uint32_t token, float *logprob,
+                          size_t n_top, uint32_t *top_tokens,
+                          float *top_logprobs);
@@ -1,6 +1,10 @@
 #include "mpt.h"
+#include "mpt-attn.h"
+#include "mpt-head.h"
+#include "mpt-kv.h"
 #include "mpt-util.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdio>
@@ -264,6 +268,162 @@ bool mpt_model_load(const std::string &fname, mpt_model &model,
   return true;
 }
 
+// a tensor over the keys or values of layer il in one kv cache block
+static struct ggml_tensor *mpt_kv_block_tensor(struct ggml_context *ctx0,
+                                               ggml_type type, size_t n,
+                                               char *data) {
+  ggml_set_no_alloc(ctx0, true);
+  struct ggml_tensor *t = ggml_new_tensor_1d(ctx0, type, n);
+  ggml_set_no_alloc(ctx0, false);
+  t->data = data;
+  return t;
+}
+
+// add the copies writing this batch's keys and values into the kv cache at
+// position n_past to the graph, one per block the batch touches
+static void mpt_kv_store(struct ggml_context *ctx0, struct ggml_cgraph *gf,
+                         const mpt_hparams &hparams, const mpt_kvcache &kvcache,
+                         const int il, const int n_past,
+                         struct ggml_tensor *Kcur, struct ggml_tensor *Vcur) {
+  const int N = Kcur->ne[1];
+  const int n_embd = hparams.n_embd;
+  const int n_head = hparams.n_head;
+  const int head_dim = n_embd / n_head;
+  const int bs = kvcache.block_size;
+  const ggml_type type_k = kvcache.params.type_k;
+  const ggml_type type_v = kvcache.params.type_v;
+  const size_t k_row = mpt_kv_row_size(type_k, head_dim);
+  const size_t v_row = mpt_kv_row_size(type_v, n_embd);
+
+  for (int p0 = n_past; p0 < n_past + N;) {
+    const int b = p0 / bs;
+    const int p1 = std::min(n_past + N, (b + 1) * bs);
+    const int n = p1 - p0;
+    const int off = p0 - b * bs;
+
+    struct ggml_tensor *kb = mpt_kv_block_tensor(
+        ctx0, type_k, (size_t)bs * n_embd, kvcache.k_data(b, il));
+    struct ggml_tensor *vb = mpt_kv_block_tensor(
+        ctx0, type_v, (size_t)bs * n_embd, kvcache.v_data(b, il));
+    struct ggml_tensor *ks = ggml_view_2d(ctx0, Kcur, n_embd, n, Kcur->nb[1],
+                                          (p0 - n_past) * Kcur->nb[1]);
+    struct ggml_tensor *vs = ggml_view_2d(ctx0, Vcur, n_embd, n, Vcur->nb[1],
+                                          (p0 - n_past) * Vcur->nb[1]);
+
+    struct ggml_tensor *k;
+    struct ggml_tensor *v;
+    if (kvcache.params.layout == MPT_KV_HEAD_MAJOR) {
+      const size_t es = ggml_type_size(type_v);
+      // Kcur [head_dim, n_head, n] -> [n_head][bs][head_dim]
+      ks = ggml_reshape_3d(ctx0, ks, head_dim, n_head, n);
+      k = ggml_view_3d(ctx0, kb, head_dim, n_head, n, (size_t)bs * k_row,
+                       k_row, (size_t)off * k_row);
+      // Vcur^T [n, n_embd] -> [n_head][head_dim][bs]
+      vs = ggml_transpose(ctx0, vs);
+      v = ggml_view_2d(ctx0, vb, n, n_embd, (size_t)bs * es,
+                       (size_t)off * es);
+    } else {
+      k = ggml_view_1d(ctx0, kb, n * n_embd, (size_t)off * n_head * k_row);
+      v = ggml_view_1d(ctx0, vb, n * n_embd, (size_t)off * v_row);
+    }
+
+    // converts to the cache types, quantizing one head row at a time
+    ggml_build_forward_expand(gf, ggml_cpy(ctx0, ks, k));
+    ggml_build_forward_expand(gf, ggml_cpy(ctx0, vs, v));
+
+    p0 = p1;
+  }
+}
+
+// self-attention for layer il as a chain of ggml ops, reading keys and values
+// for positions [0, n_past + N) from an F16 kv cache. returns [n_embd, N]
+static struct ggml_tensor *mpt_attn_ggml(struct ggml_context *ctx0,
+                                         struct ggml_tensor *Qcur,
+                                         const mpt_hparams &hparams,
+                                         const mpt_kvcache &kvcache,
+                                         const int il, const int n_past) {
+  const int N = Qcur->ne[1];
+  const int n_embd = hparams.n_embd;
+  const int n_ctx = hparams.n_ctx;
+  const int n_head = hparams.n_head;
+
+  // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0, 2, 1, 3)
+  struct ggml_tensor *Q = ggml_permute(
+      ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd / n_head, n_head, N), 0, 2, 1,
+      3);
+
+  const int head_dim = n_embd / n_head;
+  const bool head_major = kvcache.params.layout == MPT_KV_HEAD_MAJOR;
+  const size_t es = ggml_element_size(kvcache.memory_k);
+  const size_t layer_offs = (size_t)il * n_ctx * n_embd * es;
+
+  struct ggml_tensor *K;
+  if (head_major) {
+    K = ggml_view_3d(ctx0, kvcache.memory_k, head_dim, n_past + N, n_head,
+                     head_dim * es, (size_t)n_ctx * head_dim * es, layer_offs);
+  } else {
+    K = ggml_permute(
+        ctx0,
+        ggml_reshape_3d(ctx0,
+                        ggml_view_1d(ctx0, kvcache.memory_k,
+                                     (n_past + N) * n_embd, layer_offs),
+                        head_dim, n_head, n_past + N),
+        0, 2, 1, 3);
+  }
+
+  // K * Q
+  struct ggml_tensor *KQ = ggml_mul_mat(ctx0, K, Q);
+
+  // KQ_scaled = KQ / sqrt(n_embd/n_head)
+  struct ggml_tensor *KQ_scaled = ggml_scale(
+      ctx0, KQ, ggml_new_f32(ctx0, 1.0f / sqrt(float(n_embd) / n_head)));
+
+  // Alibi
+  struct ggml_tensor *KQ_scaled_biased =
+      ggml_alibi(ctx0, ggml_cont(ctx0, KQ_scaled), n_past, n_head,
+                 hparams.alibi_bias_max);
+  ggml_set_name(KQ_scaled_biased, "alibi");
+
+  // KQ_masked = mask_past(KQ_scaled)
+  struct ggml_tensor *KQ_masked =
+      ggml_diag_mask_inf(ctx0, KQ_scaled_biased, n_past);
+
+  // KQ = soft_max(KQ_masked)
+  struct ggml_tensor *KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+
+  struct ggml_tensor *V_trans;
+  if (head_major) {
+    // already stored transposed, read it in place
+    V_trans = ggml_view_3d(ctx0, kvcache.memory_v, n_past + N, head_dim,
+                           n_head, (size_t)n_ctx * es,
+                           (size_t)n_ctx * head_dim * es, layer_offs);
+  } else {
+    // V_trans = Vmem.view(n_embd/n_head, n_head, n_past + N).permute(1, 2, 0,
+    // 3).contiguous()
+    V_trans = ggml_cpy(
+        ctx0,
+        ggml_permute(ctx0,
+                     ggml_reshape_3d(ctx0,
+                                     ggml_view_1d(ctx0, kvcache.memory_v,
+                                                  (n_past + N) * n_embd,
+                                                  layer_offs),
+                                     head_dim, n_head, n_past + N),
+                     1, 2, 0, 3),
+        ggml_new_tensor_3d(ctx0, kvcache.memory_v->type, n_past + N, head_dim,
+                           n_head));
+  }
+
+  // KQV = transpose(V) * KQ_soft_max
+  struct ggml_tensor *KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
+
+  // KQV_merged = KQV.permute(0, 2, 1, 3)
+  struct ggml_tensor *KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+  // cur = KQV_merged.contiguous().view(n_embd, N)
+  return ggml_cpy(ctx0, KQV_merged,
+                  ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
+}
+
 // evaluate the transformer
 //
 //   - model:     the model
@@ -278,16 +438,117 @@ bool mpt_model_load(const std::string &fname, mpt_model &model,
 bool mpt_eval(const mpt_model &model, mpt_kvcache &kvcache, const int n_threads,
               const int n_past, const uint32_t *embd_inp,
               const size_t n_embd_inp, float *embd_w, size_t &mem_per_token) {
-  const int N = n_embd_inp;
+  const mpt_eval_seq seq = {&kvcache, n_past, embd_inp, (int)n_embd_inp,
+                            embd_w};
+  return mpt_eval_batch(model, n_threads, &seq, 1, mem_per_token);
+}
 
-  const auto &hparams = model.hparams;
+// self-attention of one sequence's rows [row0, row0 + N) of the batch
+static struct ggml_tensor *
+mpt_eval_attn(struct ggml_context *ctx0, struct ggml_cgraph *gf,
+              const mpt_hparams &hparams, const mpt_eval_seq &seq, int il,
+              int row0, struct ggml_tensor *Qcur, struct ggml_tensor *Kcur,
+              struct ggml_tensor *Vcur, int n_threads) {
+  const int n_embd = hparams.n_embd;
+  const int n_head = hparams.n_head;
+  const int N = seq.n_tokens;
+  const int n_past = seq.n_past;
+  mpt_kvcache &kvcache = *seq.kvcache;
+  const bool kv_fused_only = kvcache.paged() || kvcache.params.track_attn ||
+                             kvcache.params.attn_prune_tol > 0.0f ||
+                             kvcache.params.type_k != GGML_TYPE_F16 ||
+                             kvcache.params.type_v != GGML_TYPE_F16;
+
+  if (N != Qcur->ne[1]) {
+    Qcur = ggml_view_2d(ctx0, Qcur, n_embd, N, Qcur->nb[1], row0 * Qcur->nb[1]);
+    Kcur = ggml_view_2d(ctx0, Kcur, n_embd, N, Kcur->nb[1], row0 * Kcur->nb[1]);
+    Vcur = ggml_view_2d(ctx0, Vcur, n_embd, N, Vcur->nb[1], row0 * Vcur->nb[1]);
+  }
+
+  // TODO: qk_ln? (seems to be False in MPT-7B configs)
+  mpt_kv_store(ctx0, gf, hparams, kvcache, il, n_past, Kcur, Vcur);
+  if (N > MPT_ATTN_MAX_N && !kv_fused_only) {
+    return mpt_attn_ggml(ctx0, Qcur, hparams, kvcache, il, n_past);
+  }
+  // decode: fused kernel that also splits the kv sequence over threads.
+  // it is also the only path that reads a quantized or paged cache,
+  // tracks attention mass or prunes distant keys
+  struct ggml_tensor *Q =
+      ggml_reshape_3d(ctx0, Qcur, n_embd / n_head, n_head, N);
+  // disk-backed blocks are brought in around the attention
+  Q = mpt_kv_fetch(ctx0, Q, kvcache, il, n_past + N);
+  float *mass = nullptr;
+  if (kvcache.params.track_attn) {
+    mass = kvcache.attn_mass.data() + (size_t)il * hparams.n_ctx;
+  }
+  struct ggml_tensor *cur = mpt_attn(ctx0, Q, hparams, kvcache, il, n_past,
+                                     n_threads, mass);
+  cur = mpt_kv_page_out(ctx0, cur, kvcache, il, n_past + N);
+  return ggml_reshape_2d(ctx0, cur, n_embd, N);
+}
 
+// copies the logits of seq, whose first row is row j of the head's output
+// out. out has n_vocab logits per row, or with the gathered rows of wte
+// n_gathered, token t in columns[t]. tokens outside seq's own list are set
+// to -INFINITY
+static void mpt_copy_logits(const mpt_eval_seq &seq, const float *out,
+                            size_t j, size_t n_vocab, size_t n_gathered,
+                            const int *columns) {
+  const size_t n_row = columns ? n_gathered : n_vocab;
+  for (int r = 0; r < seq.n_logits; ++r) {
+    const float *row = out + (j + r) * n_row;
+    float *logits = seq.logits + (size_t)r * n_vocab;
+    if (!seq.allowed) {
+      memcpy(logits, row, sizeof(float) * n_vocab);
+      continue;
+    }
+    std::fill(logits, logits + n_vocab, -INFINITY);
+    for (int k = 0; k < seq.n_allowed; ++k) {
+      const uint32_t token = seq.allowed[k];
+      logits[token] = row[columns ? columns[token] : token];
+    }
+  }
+}
+
+bool mpt_eval_batch(const mpt_model &model, const int n_threads,
+                    const mpt_eval_seq *seqs, size_t n_seqs,
+                    size_t &mem_per_token) {
+  const auto &hparams = model.hparams;
   const int n_embd = hparams.n_embd;
   const int n_layer = hparams.n_layer;
-  const int n_ctx = hparams.n_ctx;
-  const int n_head = hparams.n_head;
   const int n_vocab = hparams.n_vocab;
 
+  // rows of the batch, and how far back the sequences reach
+  int N = 0;
+  size_t n_past_sum = 0;
+  int top_k = 0;
+  for (size_t i = 0; i < n_seqs; ++i) {
+    const mpt_eval_seq &seq = seqs[i];
+    if ((seq.top_k > 0) != (seqs[0].top_k > 0)) {
+      fprintf(stderr, "%s: a batch takes logits or top_k, not both\n",
+              __func__);
+      return false;
+    }
+    top_k = std::max(top_k, seq.top_k);
+    mpt_kvcache &kvcache = *seq.kvcache;
+    if (!kvcache.reserve(seq.n_past, seq.n_tokens)) {
+      fprintf(stderr, "%s: out of kv cache blocks\n", __func__);
+      return false;
+    }
+    if (kvcache.paged() && kvcache.pool->on_disk()) {
+      kvcache.pool->count_tokens(seq.n_tokens);
+    }
+    // the new positions start without attention mass
+    if (kvcache.params.track_attn) {
+      for (int il = 0; il < n_layer; ++il) {
+        float *mass = kvcache.attn_mass.data() + (size_t)il * hparams.n_ctx;
+        std::fill(mass + seq.n_past, mass + seq.n_past + seq.n_tokens, 0.0f);
+      }
+    }
+    N += seq.n_tokens;
+    n_past_sum += seq.n_past;
+  }
+
   size_t buf_size = 256u * 1024 * 1024;
 
   // TODO - better approach to guess required mem.
@@ -296,8 +557,8 @@ bool mpt_eval(const mpt_model &model, mpt_kvcache &kvcache, const int n_threads,
   // some known good values for given model sizes
   if (mem_per_token > 0) {
     const size_t buf_size_new =
-        1.1 * (mem_per_token * 1.3 * N) +
-        (mem_per_token * n_past); // add 10% to account for ggml object overhead
+        1.1 * (mem_per_token * 1.3 * N) + // 10% for ggml object overhead
+        (mem_per_token * n_past_sum);
     if (buf_size_new > buf_size) {
       buf_size = buf_size_new;
     }
@@ -313,7 +574,10 @@ bool mpt_eval(const mpt_model &model, mpt_kvcache &kvcache, const int n_threads,
   struct ggml_cgraph gf = {.n_threads = n_threads};
 
   struct ggml_tensor *embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-  memcpy(embd->data, embd_inp, N * ggml_element_size(embd));
+  for (size_t i = 0, row = 0; i < n_seqs; row += seqs[i].n_tokens, ++i) {
+    memcpy((int32_t *)embd->data + row, seqs[i].tokens,
+           seqs[i].n_tokens * ggml_element_size(embd));
+  }
 
   // wte
   struct ggml_tensor *inpL = ggml_get_rows(ctx0, model.wte, embd);
@@ -346,82 +610,23 @@ bool mpt_eval(const mpt_model &model, mpt_kvcache &kvcache, const int n_threads,
           ggml_cont(ctx0, ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1],
                                        2 * ggml_element_size(cur) * n_embd));
 
-      // TODO: qk_ln? (seems to be False in MPT-7B configs)
-      {
-        struct ggml_tensor *k =
-            ggml_view_1d(ctx0, kvcache.memory_k, N * n_embd,
-                         (ggml_element_size(kvcache.memory_k) * n_embd) *
-                             (il * n_ctx + n_past));
-        struct ggml_tensor *v =
-            ggml_view_1d(ctx0, kvcache.memory_v, N * n_embd,
-                         (ggml_element_size(kvcache.memory_v) * n_embd) *
-                             (il * n_ctx + n_past));
-
-        ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
-        ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
+      if (n_seqs == 1) {
+        cur = mpt_eval_attn(ctx0, &gf, hparams, seqs[0], il, 0, Qcur, Kcur,
+                            Vcur, n_threads);
+      } else {
+        // each sequence attends over its own cache, writing its rows of the
+        // output before the projection reads them
+        cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N);
+        for (size_t i = 0, row = 0; i < n_seqs; row += seqs[i].n_tokens, ++i) {
+          struct ggml_tensor *attn =
+              mpt_eval_attn(ctx0, &gf, hparams, seqs[i], il, row, Qcur, Kcur,
+                            Vcur, n_threads);
+          ggml_build_forward_expand(
+              &gf, ggml_cpy(ctx0, attn,
+                            ggml_view_2d(ctx0, cur, n_embd, seqs[i].n_tokens,
+                                         cur->nb[1], row * cur->nb[1])));
+        }
       }
-      // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0, 2, 1,
-      // 3)
-      struct ggml_tensor *Q = ggml_permute(
-          ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd / n_head, n_head, N), 0, 2,
-          1, 3);
-
-      struct ggml_tensor *K = ggml_permute(
-          ctx0,
-          ggml_reshape_3d(
-              ctx0,
-              ggml_view_1d(ctx0, kvcache.memory_k, (n_past + N) * n_embd,
-                           il * n_ctx * ggml_element_size(kvcache.memory_k) *
-                               n_embd),
-              n_embd / n_head, n_head, n_past + N),
-          0, 2, 1, 3);
-
-      // K * Q
-      struct ggml_tensor *KQ = ggml_mul_mat(ctx0, K, Q);
-
-      // KQ_scaled = KQ / sqrt(n_embd/n_head)
-      struct ggml_tensor *KQ_scaled = ggml_scale(
-          ctx0, KQ, ggml_new_f32(ctx0, 1.0f / sqrt(float(n_embd) / n_head)));
-
-      // Alibi
-      struct ggml_tensor *KQ_scaled_biased =
-          ggml_alibi(ctx0, ggml_cont(ctx0, KQ_scaled), n_past, n_head,
-                     model.hparams.alibi_bias_max);
-      ggml_set_name(KQ_scaled_biased, "alibi");
-
-      // KQ_masked = mask_past(KQ_scaled)
-      struct ggml_tensor *KQ_masked =
-          ggml_diag_mask_inf(ctx0, KQ_scaled_biased, n_past);
-
-      // KQ = soft_max(KQ_masked)
-      struct ggml_tensor *KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
-
-      // V_trans = Vmem.view(n_embd/n_head, n_head, n_past + N).permute(1, 2, 0,
-      // 3).contiguous()
-      struct ggml_tensor *V_trans = ggml_cpy(
-          ctx0,
-          ggml_permute(
-              ctx0,
-              ggml_reshape_3d(
-                  ctx0,
-                  ggml_view_1d(ctx0, kvcache.memory_v, (n_past + N) * n_embd,
-                               il * n_ctx *
-                                   ggml_element_size(kvcache.memory_v) *
-                                   n_embd),
-                  n_embd / n_head, n_head, n_past + N),
-              1, 2, 0, 3),
-          ggml_new_tensor_3d(ctx0, kvcache.memory_v->type, n_past + N,
-                             n_embd / n_head, n_head));
-
-      // KQV = transpose(V) * KQ_soft_max
-      struct ggml_tensor *KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
-
-      // KQV_merged = KQV.permute(0, 2, 1, 3)
-      struct ggml_tensor *KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
-
-      // cur = KQV_merged.contiguous().view(n_embd, N)
-      cur = ggml_cpy(ctx0, KQV_merged,
-                     ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
 
       // projection (no bias)
       cur = ggml_mul_mat(ctx0, model.layers[il].attn_out_proj_w, cur);
@@ -446,21 +651,98 @@ bool mpt_eval(const mpt_model &model, mpt_kvcache &kvcache, const int n_threads,
     inpL = ggml_add(ctx0, cur, resSA);
   }
 
-  struct ggml_tensor *out = inpL;
-  // -> logits
+  // only the last n_logits tokens of each sequence need logits
+  int n_out = 0;
+  for (size_t i = 0; i < n_seqs; ++i) {
+    n_out += seqs[i].n_logits;
+  }
+  struct ggml_tensor *last = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_out);
+  for (size_t i = 0, row = 0, j = 0; i < n_seqs; ++i) {
+    row += seqs[i].n_tokens;
+    for (int k = seqs[i].n_logits; k > 0; --k) {
+      ((int32_t *)last->data)[j++] = row - k;
+    }
+  }
+  struct ggml_tensor *out = ggml_get_rows(ctx0, inpL, last);
+  // -> logits, or only the top_k of them
+  std::vector<uint32_t> top_tokens((size_t)n_out * top_k);
+  std::vector<float> top_logprobs((size_t)n_out * top_k);
+  // each output row's candidate budget for the approximate head. rows with
+  // an allow-list take the exact head, which cannot leave out an allowed
+  // token
+  std::vector<int> n_candidates;
+  for (size_t i = 0; model.head_index && top_k == 0 && i < n_seqs; ++i) {
+    n_candidates.insert(n_candidates.end(), seqs[i].n_logits,
+                        seqs[i].allowed ? 0 : seqs[i].n_candidates);
+  }
+  const bool approx =
+      std::any_of(n_candidates.begin(), n_candidates.end(),
+                  [](int n) { return n > 0; });
+  // the tokens allowed in any sequence, in order, when every sequence has a
+  // list and gathering their rows costs less than the full head, and the
+  // column of each in the gathered logits
+  std::vector<uint32_t> allowed;
+  std::vector<int> columns;
+  bool gather = top_k == 0;
+  size_t n_allowed = 0;
+  for (size_t i = 0; gather && i < n_seqs; ++i) {
+    gather = seqs[i].allowed != nullptr;
+    n_allowed += seqs[i].n_allowed;
+  }
+  if (gather && n_allowed <= (size_t)n_vocab / 2) {
+    columns.assign(n_vocab, -1);
+    for (size_t i = 0; i < n_seqs; ++i) {
+      for (int k = 0; k < seqs[i].n_allowed; ++k) {
+        columns[seqs[i].allowed[k]] = 0;
+      }
+    }
+    for (int token = 0; token < n_vocab; ++token) {
+      if (columns[token] == 0) {
+        columns[token] = allowed.size();
+        allowed.push_back(token);
+      }
+    }
+  }
+  gather = !allowed.empty();
   {
     out = ggml_norm(ctx0, out);
     out = ggml_mul(ctx0, ggml_repeat(ctx0, model.norm_f_w, out), out);
-    out = ggml_mul_mat(ctx0, model.wte, out);
+    if (top_k > 0) {
+      out = mpt_head_top_k(ctx0, out, model.wte, top_k, n_threads,
+                           top_tokens.data(), top_logprobs.data());
+    } else if (gather) {
+      struct ggml_tensor *rows =
+          ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, allowed.size());
+      memcpy(rows->data, allowed.data(), allowed.size() * sizeof(uint32_t));
+      out = ggml_mul_mat(ctx0, ggml_get_rows(ctx0, model.wte, rows), out);
+    } else if (approx) {
+      out = mpt_head_ivf(ctx0, out, model.wte, model.head_index.get(),
+                         n_candidates.data(), n_threads);
+    } else {
+      out = ggml_mul_mat(ctx0, model.wte, out);
+    }
   }
 
   // run the computation
   ggml_build_forward_expand(&gf, out);
   ggml_graph_compute(ctx0, &gf);
 
-  // return result for just the last token
-  memcpy(embd_w, (float *)ggml_get_data(out) + (n_vocab * (N - 1)),
-         sizeof(float) * n_vocab);
+  for (size_t i = 0, j = 0; i < n_seqs; j += seqs[i].n_logits, ++i) {
+    const mpt_eval_seq &seq = seqs[i];
+    if (top_k == 0) {
+      mpt_copy_logits(seq, (const float *)ggml_get_data(out), j, n_vocab,
+                      allowed.size(), gather ? columns.data() : nullptr);
+      continue;
+    }
+    for (int r = 0; r < seq.n_logits; ++r) {
+      const size_t row = (j + r) * top_k;
+      std::copy(top_tokens.begin() + row, top_tokens.begin() + row + seq.top_k,
+                seq.top_tokens + (size_t)r * seq.top_k);
+      std::copy(top_logprobs.begin() + row,
+                top_logprobs.begin() + row + seq.top_k,
+                seq.top_logprobs + (size_t)r * seq.top_k);
+    }
+  }
 
   if (mem_per_token == 0) {
     mem_per_token = ggml_used_mem(ctx0) / N;
@@ -2,6 +2,7 @@
 #include "ggml.h"
 
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -32,6 +33,8 @@ struct mpt_layer {
   struct ggml_tensor *ffn_down_proj_w;
 };
 
+struct mpt_head_index;
+
 struct mpt_model {
   mpt_hparams hparams;
 
@@ -43,6 +46,9 @@ struct mpt_model {
 
   std::vector<mpt_layer> layers;
 
+  // clusters of the rows of wte for an approximate head, if built
+  std::shared_ptr<mpt_head_index> head_index;
+
   struct ggml_context *ctx;
   std::map<std::string, struct ggml_tensor *> tensors;
 
@@ -53,48 +59,46 @@ struct mpt_model {
   }
 };
 
-// key + value memory
-struct mpt_kvcache {
-  mpt_kvcache(mpt_model &model) {
-    const auto &hparams = model.hparams;
-    const int n_embd = hparams.n_embd;
-    const int n_layer = hparams.n_layer;
-    const int n_ctx = hparams.n_ctx;
-
-    size_t ctx_size = 0;
-    ctx_size += (size_t)n_ctx * n_layer * n_embd *
-                ggml_type_size(GGML_TYPE_F16); // memory_k
-    ctx_size += (size_t)n_ctx * n_layer * n_embd *
-                ggml_type_size(GGML_TYPE_F16); // memory_v
-    ctx_size += ggml_tensor_overhead() * 2;
-    ggml_init_params params{ctx_size, nullptr, 0};
-    ctx = ggml_init(params);
-
-    const int n_mem = n_layer * n_ctx;
-    const size_t n_elements = (size_t)n_embd * n_mem;
-    memory_k = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
-    memory_v = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
-    const size_t memory_size = ggml_nbytes(memory_k) + ggml_nbytes(memory_v);
-    printf("%s: memory_size = %8.2f MB, n_mem = %d\n", __func__,
-           memory_size / 1024.0 / 1024.0, n_mem);
-  }
-
-  ~mpt_kvcache() {
-    if (ctx) {
-      ggml_free(ctx);
-    }
-  }
-
-  struct ggml_tensor *memory_k;
-  struct ggml_tensor *memory_v;
-  struct ggml_context *ctx;
-};
+struct mpt_kvcache;
 
 bool mpt_model_load(const std::string &fname, mpt_model &model,
                     size_t n_ctx_override = 0);
 bool mpt_eval(const mpt_model &model, mpt_kvcache &kvcache, const int n_threads,
               const int n_past, const uint32_t *embd_inp,
               const size_t n_embd_inp, float *embd_w, size_t &mem_per_token);
+
+// one sequence of a batched eval
+struct mpt_eval_seq {
+  mpt_kvcache *kvcache;
+  int n_past;
+  const uint32_t *tokens;
+  int n_tokens;
+  // n_vocab logits for each of the last n_logits tokens
+  float *logits;
+  int n_logits = 1;
+  // with the model's head index, compute the logits of at least this many
+  // tokens, from the clusters nearest the output, and -INFINITY for the
+  // rest. 0 for all of them. ignored with allowed set
+  int n_candidates = 0;
+  // unless NULL, compute logits only for these n_allowed tokens and set the
+  // rest to -INFINITY. a batch whose lists together are short gathers only
+  // their rows of wte into the head
+  const uint32_t *allowed = nullptr;
+  int n_allowed = 0;
+  // with top_k set, the top_k most likely tokens after each of the last
+  // n_logits tokens, most likely first, and their log probabilities, in
+  // place of the logits. a batch either takes logits or top_k for all of its
+  // sequences
+  int top_k = 0;
+  uint32_t *top_tokens = nullptr;
+  float *top_logprobs = nullptr;
+};
+
+// evaluates several sequences, each against its own kv cache, in one graph
+// whose matrix multiplications run over the rows of all of them
+bool mpt_eval_batch(const mpt_model &model, const int n_threads,
+                    const mpt_eval_seq *seqs, size_t n_seqs,
+                    size_t &mem_per_token);
 bool mpt_eval_cpp(const mpt_model &model, mpt_kvcache &kvcache,
                   const int n_threads, const int n_past,
                   const std::vector<uint32_t> &embd_inp,
@@ -37,6 +37,34 @@ struct Opt {
     chat_format: Option<ChatMode>,
     #[structopt(long)]
     threads: Option<u32>,
+    #[structopt(long, help = "store the kv cache head-major")]
+    kv_head_major: bool,
+    #[structopt(long, default_value = "f16", help = "kv cache key type: f16, q8_0, q4_0, q4_1")]
+    kv_type_k: minmpt::KvType,
+    #[structopt(long, default_value = "f16", help = "kv cache value type: f16, q8_0, q4_0, q4_1")]
+    kv_type_v: minmpt::KvType,
+    #[structopt(long, help = "when the context is full, drop old tokens instead of stopping")]
+    ctx_shift: bool,
+    #[structopt(long, default_value = "4", help = "tokens kept at the start when the context shifts")]
+    ctx_keep: usize,
+    #[structopt(long, default_value = "oldest", help = "what a context shift drops: oldest, h2o")]
+    kv_evict: minmpt::KvEvict,
+    #[structopt(long, default_value = "0", help = "shift once the kv cache holds this many positions")]
+    kv_budget: usize,
+    #[structopt(long, help = "skip keys whose ALiBi bias scales their weight below this, e.g. 1e-4")]
+    attn_prune_tol: Option<f32>,
+    #[structopt(long, help = "approximate the LM head, computing logits for about this many tokens")]
+    head_candidates: Option<usize>,
+    #[structopt(long, default_value = "256", help = "vocabulary clusters indexed at load for --head-candidates")]
+    head_clusters: usize,
+    #[structopt(long, help = "page the kv cache in blocks of this many positions")]
+    kv_block_size: Option<usize>,
+    #[structopt(long, help = "keep kv blocks in a scratch file at this path, needs --kv-block-size")]
+    kv_disk: Option<String>,
+    #[structopt(long, default_value = "1024", help = "MB of recent kv blocks kept in RAM with --kv-disk")]
+    kv_ram_mb: usize,
+    #[structopt(long, help = "cache up to this many MB of kv blocks by prefix, needs --kv-block-size")]
+    prefix_cache_mb: Option<usize>,
     #[structopt(long, default_value = "1.0")]
     cfg_scale: f32,
     #[structopt(long)]
@@ -82,9 +110,31 @@ fn main() -> Result<()> {
     if let Some(nth) = opt.threads {
         loadopts = loadopts.n_threads(nth)
     }
+    if opt.kv_head_major {
+        loadopts = loadopts.kv_layout(minmpt::KvLayout::HeadMajor);
+    }
+    loadopts = loadopts.kv_types(opt.kv_type_k, opt.kv_type_v);
+    if opt.ctx_shift {
+        loadopts = loadopts.ctx_shift(opt.ctx_keep, 0);
+        loadopts = loadopts.kv_evict(opt.kv_evict, opt.kv_budget, 32);
+    }
+    if let Some(tol) = opt.attn_prune_tol {
+        loadopts = loadopts.attn_prune_tol(tol);
+    }
+    if let Some(candidates) = opt.head_candidates {
+        loadopts = loadopts.head_index(opt.head_clusters, candidates);
+    }
+    if let Some(block_size) = opt.kv_block_size {
+        loadopts = loadopts.kv_block_size(block_size);
+    }
+    if let Some(ref path) = opt.kv_disk {
+        loadopts = loadopts.kv_disk(path, opt.kv_ram_mb << 20);
+    }
+    if let Some(mb) = opt.prefix_cache_mb {
+        loadopts = loadopts.prefix_cache_bytes(mb << 20);
+    }
     let mut mptmodel = minmpt::MinMPT::load_model(&modelpathstr, Some(loadopts))?;
     let mut logits = Vec::new();
-    let mut logits_cfg_neg = Vec::new();
     let sysprompt_default = match mode {
         ChatMode::ChatML => "you are a helpful assistant", 
         ChatMode::Instruct => "Below is an instruction that describes a task. Write a response that appropriately completes the request."
@@ -120,9 +170,7 @@ fn main() -> Result<()> {
                 .target_surprise(opt.mirostat_tau),
         )
     } else {
-        Box::new(sampling::BasicSampler {
-            temperature: opt.temperature,
-        })
+        Box::new(sampling::BasicSampler::new().temperature(opt.temperature))
     };
 
     let stop_signal = Arc::new(AtomicBool::new(false));
@@ -145,6 +193,16 @@ fn main() -> Result<()> {
         stop_signal.store(false, Ordering::SeqCst);
         if line == "/reset" {
             println!("Reset conversation context.");
+            if opt.prefix_cache_mb.is_some() {
+                let stats = mptmodel.prefix_cache_stats();
+                eprintln!(
+                    "Prefix cache: {}/{} hits, {} tokens reused, {} MB held",
+                    stats.hits,
+                    stats.lookups,
+                    stats.tokens_reused,
+                    stats.bytes >> 20
+                );
+            }
             transcript.clear();
             mptmodel.reset_ctx();
             if let Some(ref mut model_neg) = model_neg {
@@ -185,7 +243,7 @@ fn main() -> Result<()> {
         } else {
             false
         };
-        let mut do_input_eval = |model: &mut minmpt::MinMPT, neg: bool| -> Result<()> {
+        let encode_input = |neg: bool| -> Result<Vec<u32>> {
             let wrapped = {
                 let mut s = String::new();
                 if first_turn {
@@ -217,23 +275,18 @@ fn main() -> Result<()> {
             let encoding = tokenizer
                 .encode(wrapped, true)
                 .map_err(|_e| eyre!("Error tokenizing input"))?;
-            if !neg {
-                transcript.push((encoding.get_ids().to_vec(), true));
-            }
-            if neg {
-                model.eval(encoding.get_ids(), &mut logits_cfg_neg)?;
-            } else {
-                model.eval(encoding.get_ids(), &mut logits)?;
-            }
-            Ok(())
+            Ok(encoding.get_ids().to_vec())
         };
-        do_input_eval(&mut mptmodel, false)?;
+        let input_ids = encode_input(false)?;
+        // in cfg mode the positive and negative contexts are evaluated as one
+        // batch, and the guided logits come back from the library
         if let Some(ref mut mptmodel_n) = model_neg {
-            do_input_eval(mptmodel_n, true)?;
-            let cfg_logits =
-                sampling::apply_cfg(cfg_scale, logits.as_slice(), logits_cfg_neg.as_slice());
-            logits = cfg_logits;
+            let neg_ids = encode_input(true)?;
+            mptmodel.eval_cfg(&input_ids, mptmodel_n, &neg_ids, cfg_scale, &mut logits)?;
+        } else {
+            mptmodel.eval(&input_ids, &mut logits)?;
         }
+        transcript.push((input_ids, true));
         first_turn = false;
         let mut resp_toks = Vec::new();
         let mut lastlen = 0;
@@ -259,12 +312,11 @@ fn main() -> Result<()> {
             print!("{}", out);
             lastlen = respinprogress.as_bytes().len();
             std::io::stdout().flush()?;
-            mptmodel.eval(&resp_toks[resp_toks.len() - 1..], &mut logits)?;
+            let last = &resp_toks[resp_toks.len() - 1..];
             if let Some(ref mut mptmodel_n) = model_neg {
-                mptmodel_n.eval(&resp_toks[resp_toks.len() - 1..], &mut logits_cfg_neg)?;
-                let cfg_logits =
-                    sampling::apply_cfg(cfg_scale, logits.as_slice(), logits_cfg_neg.as_slice());
-                logits = cfg_logits;
+                mptmodel.eval_cfg(last, mptmodel_n, last, cfg_scale, &mut logits)?;
+            } else {
+                mptmodel.eval(last, &mut logits)?;
             }
         }
         transcript.push((resp_toks, false));
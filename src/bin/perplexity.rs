@@ -0,0 +1,99 @@
+use color_eyre::eyre::bail;
+use color_eyre::{eyre::eyre, Result};
+use mptgen::minmpt;
+use std::io::Write as IoWrite;
+use std::path::PathBuf;
+use structopt::StructOpt;
+use tokenizers::tokenizer::Tokenizer;
+
+#[derive(Debug, StructOpt)]
+#[structopt(name = "perplexity")]
+struct Opt {
+    #[structopt(parse(from_os_str))]
+    text: PathBuf,
+    #[structopt(short, long, parse(from_os_str))]
+    model: Option<PathBuf>,
+    #[structopt(long, short = "c", help = "tokens per window, max_seq_len by default")]
+    n_ctx: Option<usize>,
+    #[structopt(long)]
+    threads: Option<u32>,
+    #[structopt(long, help = "store the kv cache head-major")]
+    kv_head_major: bool,
+    #[structopt(long, default_value = "f16", help = "kv cache key type: f16, q8_0, q4_0, q4_1")]
+    kv_type_k: minmpt::KvType,
+    #[structopt(long, default_value = "f16", help = "kv cache value type: f16, q8_0, q4_0, q4_1")]
+    kv_type_v: minmpt::KvType,
+}
+
+// -log p(next) under logits
+fn nll(logits: &[f32], next: u32) -> f64 {
+    let max = logits.iter().copied().fold(f32::NEG_INFINITY, f32::max);
+    let sum: f64 = logits.iter().map(|&l| ((l - max) as f64).exp()).sum();
+    sum.ln() - (logits[next as usize] - max) as f64
+}
+
+fn main() -> Result<()> {
+    color_eyre::install()?;
+    let opt = Opt::from_args();
+    let modelpathstr = if let Some(ref pb) = opt.model {
+        pb.to_string_lossy()
+    } else {
+        std::borrow::Cow::from("minmpt.cpp/models/ggml-mpt-7b-storywriter-q5_1.bin")
+    };
+    let tokenizer = Tokenizer::from_pretrained("mosaicml/mpt-7b-storywriter", None)
+        .map_err(|e| eyre!("Error loading tokenizer: {e:?}"))?;
+    let text = std::fs::read_to_string(&opt.text)?;
+    let tokens = Vec::from(
+        tokenizer
+            .encode(text, false)
+            .map_err(|e| eyre!("Error tokenizing: {e:?}"))?
+            .get_ids(),
+    );
+    let mut loadopts = minmpt::MinMPTOptions::default();
+    if let Some(n_ctx) = opt.n_ctx {
+        loadopts = loadopts.override_n_ctx(n_ctx);
+    }
+    if let Some(nth) = opt.threads {
+        loadopts = loadopts.n_threads(nth)
+    }
+    if opt.kv_head_major {
+        loadopts = loadopts.kv_layout(minmpt::KvLayout::HeadMajor);
+    }
+    loadopts = loadopts.kv_types(opt.kv_type_k, opt.kv_type_v);
+    let mut mptmodel = minmpt::MinMPT::load_model(&modelpathstr, Some(loadopts))?;
+    let n_vocab = mptmodel.n_vocab();
+    // each window is evaluated from an empty context, and every token in it
+    // after the first is scored
+    let windows: Vec<&[u32]> = tokens
+        .chunks(mptmodel.n_ctx())
+        .filter(|w| w.len() > 1)
+        .collect();
+    if windows.is_empty() {
+        bail!("{} holds fewer than 2 tokens", opt.text.display());
+    }
+    let mut logits = Vec::new();
+    let (mut sum, mut count) = (0.0, 0);
+    for (i, window) in windows.iter().enumerate() {
+        mptmodel.reset_ctx();
+        mptmodel.eval_all(window, &mut logits)?;
+        for (pos, next) in window[1..].iter().enumerate() {
+            sum += nll(&logits[pos * n_vocab..(pos + 1) * n_vocab], *next);
+            count += 1;
+        }
+        print!(
+            "[{}/{}] {:.4} ",
+            i + 1,
+            windows.len(),
+            (sum / count as f64).exp()
+        );
+        std::io::stdout().flush()?;
+    }
+    println!();
+    println!(
+        "K {:?} / V {:?}: perplexity {:.4} over {count} tokens",
+        opt.kv_type_k,
+        opt.kv_type_v,
+        (sum / count as f64).exp()
+    );
+    Ok(())
+}
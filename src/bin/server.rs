@@ -0,0 +1,552 @@
+use color_eyre::{eyre::eyre, Result};
+use mptgen::minmpt;
+use mptgen::sampling;
+use mptgen::sampling::Sampler;
+use serde::Deserialize;
+use std::collections::{HashMap, HashSet};
+use std::io::{BufRead, BufReader, Read, Write};
+use std::net::TcpListener;
+use std::os::unix::fs::FileTypeExt;
+use std::os::unix::net::UnixListener;
+use std::path::PathBuf;
+use std::sync::mpsc;
+use std::sync::{Arc, Mutex};
+use structopt::clap::arg_enum;
+use structopt::StructOpt;
+use tokenizers::tokenizer::Tokenizer;
+
+arg_enum! {
+    #[derive(Debug, Eq, PartialEq, Clone, Copy)]
+    enum ChatMode {
+        Instruct,
+        ChatML
+    }
+}
+
+#[derive(Debug, StructOpt)]
+#[structopt(name = "mptgen-server")]
+struct Opt {
+    #[structopt(short, long, parse(from_os_str))]
+    model: Option<PathBuf>,
+    #[structopt(short, long, possible_values = &ChatMode::variants(), case_insensitive = true)]
+    chat_format: Option<ChatMode>,
+    #[structopt(long, default_value = "8080", help = "port to serve HTTP on, on localhost")]
+    port: u16,
+    #[structopt(long, parse(from_os_str), help = "serve on this Unix socket instead of a port")]
+    unix: Option<PathBuf>,
+    #[structopt(short, long)]
+    n_ctx: Option<usize>,
+    #[structopt(long)]
+    threads: Option<u32>,
+    #[structopt(long, default_value = "64", help = "page the kv cache in blocks of this many positions")]
+    kv_block_size: usize,
+    #[structopt(long, help = "most kv blocks held at once, requests queue beyond it")]
+    kv_max_blocks: Option<usize>,
+    #[structopt(long, default_value = "512", help = "MB of kv blocks cached by prefix, reused by later turns")]
+    prefix_cache_mb: usize,
+    #[structopt(long, default_value = "16", help = "most requests evaluated at once")]
+    max_seqs: usize,
+    #[structopt(long, default_value = "256", help = "tokens evaluated per step")]
+    max_batch_tokens: usize,
+    #[structopt(long, default_value = "128", help = "most prompt tokens a request prefills per step")]
+    prefill_chunk: usize,
+    #[structopt(long, help = "split this many cores between prompt and decode threads")]
+    split_threads: Option<usize>,
+    #[structopt(long, default_value = "64", help = "transcripts kept, the least recently used is forgotten")]
+    max_sessions: usize,
+    #[structopt(long, default_value = "256")]
+    max_tokens: usize,
+    #[structopt(short, long)]
+    temperature: Option<f32>,
+    #[structopt(long)]
+    system_prompt: Option<String>,
+}
+
+/// Largest request body read, bigger ones get 413
+const MAX_BODY_BYTES: usize = 1 << 20;
+
+/// Body of a POST to /completion, which continues `prompt` as is, or /chat, which sends it as
+/// the user's turn in the chat format. Requests naming a `session` continue its transcript
+#[derive(Debug, Deserialize)]
+struct CompletionRequest {
+    prompt: String,
+    session: Option<String>,
+    max_tokens: Option<usize>,
+    temperature: Option<f32>,
+}
+
+/// What the engine sends back for a request
+enum Reply {
+    /// a token of the response
+    Token(u32),
+    /// the end of the response, with the stop token that ended it, kept in the transcript but
+    /// not shown. None for endoftext and the token limit
+    Stop(Option<u32>),
+    Error(String),
+}
+
+struct Job {
+    prompt: Vec<u32>,
+    max_tokens: usize,
+    temperature: Option<f32>,
+    tokens: mpsc::Sender<Reply>,
+}
+
+struct Active {
+    sampler: sampling::BasicSampler,
+    max_tokens: usize,
+    n_generated: usize,
+    tokens: mpsc::Sender<Reply>,
+}
+
+/// Owns the model and the scheduler. Every request is a sequence of the scheduler, so the
+/// decode tokens of all of them share each pass over the weights. Ends when all senders of
+/// `jobs` are gone
+fn serve_jobs(
+    model: minmpt::MinMPT,
+    options: minmpt::SchedulerOptions,
+    stop_tokens: Vec<u32>,
+    jobs: mpsc::Receiver<Job>,
+) -> Result<()> {
+    let mut sched = minmpt::Scheduler::new(&model, options)?;
+    let mut active: HashMap<u64, Active> = HashMap::new();
+    let mut rng = rand::thread_rng();
+    loop {
+        // wait for work while idle
+        let mut new_jobs = Vec::new();
+        if active.is_empty() {
+            match jobs.recv() {
+                Ok(job) => new_jobs.push(job),
+                Err(_) => return Ok(()),
+            }
+        }
+        new_jobs.extend(jobs.try_iter());
+        for job in new_jobs {
+            match sched.submit(&job.prompt) {
+                Ok(id) => {
+                    active.insert(
+                        id,
+                        Active {
+                            sampler: sampling::BasicSampler::new().temperature(job.temperature),
+                            max_tokens: job.max_tokens,
+                            n_generated: 0,
+                            tokens: job.tokens,
+                        },
+                    );
+                }
+                Err(e) => {
+                    let _ = job.tokens.send(Reply::Error(e.to_string()));
+                }
+            }
+        }
+
+        // the sequences of a failed batch are still waiting, each with its error
+        let ready = match sched.step() {
+            Ok(ready) => ready,
+            Err(e) => {
+                eprintln!("step failed: {e}");
+                sched.ready()
+            }
+        };
+        for id in ready {
+            let Some(req) = active.get_mut(&id) else {
+                sched.finish(id);
+                continue;
+            };
+            let token = match sched.logits(id) {
+                Ok(logits) => req.sampler.sample(logits, &mut rng) as u32,
+                Err(e) => {
+                    let _ = req.tokens.send(Reply::Error(e.to_string()));
+                    sched.finish(id);
+                    active.remove(&id);
+                    continue;
+                }
+            };
+            req.n_generated += 1;
+            // a stop token goes to the transcript, endoftext is not kept
+            let reply = if stop_tokens.contains(&token) {
+                Reply::Stop(Some(token))
+            } else if token == 0 {
+                Reply::Stop(None)
+            } else {
+                Reply::Token(token)
+            };
+            let stop = matches!(reply, Reply::Stop(_));
+            // a closed connection ends the request too
+            let mut done = req.tokens.send(reply).is_err() || stop;
+            if !done && req.n_generated >= req.max_tokens {
+                let _ = req.tokens.send(Reply::Stop(None));
+                done = true;
+            }
+            if !done {
+                if let Err(e) = sched.push(id, token) {
+                    let _ = req.tokens.send(Reply::Error(e.to_string()));
+                    done = true;
+                }
+            }
+            if done {
+                sched.finish(id);
+                active.remove(&id);
+            }
+        }
+    }
+}
+
+/// Tokens of each named session so far, prompts and responses, keeping the `max_sessions`
+/// most recently used
+struct Sessions {
+    max_sessions: usize,
+    /// transcript and the use that last touched it
+    transcripts: HashMap<String, (u64, Vec<u32>)>,
+    n_uses: u64,
+    /// sessions a request is continuing
+    busy: HashSet<String>,
+}
+
+impl Sessions {
+    fn new(max_sessions: usize) -> Self {
+        Sessions {
+            max_sessions,
+            transcripts: HashMap::new(),
+            n_uses: 0,
+            busy: HashSet::new(),
+        }
+    }
+
+    fn get(&mut self, name: &str) -> Option<Vec<u32>> {
+        self.n_uses += 1;
+        let (last_use, tokens) = self.transcripts.get_mut(name)?;
+        *last_use = self.n_uses;
+        Some(tokens.clone())
+    }
+
+    fn insert(&mut self, name: String, tokens: Vec<u32>) {
+        self.n_uses += 1;
+        self.transcripts.insert(name, (self.n_uses, tokens));
+        while self.transcripts.len() > self.max_sessions {
+            let oldest = self
+                .transcripts
+                .iter()
+                .min_by_key(|(_, (last_use, _))| *last_use)
+                .map(|(name, _)| name.clone())
+                .unwrap();
+            self.transcripts.remove(&oldest);
+        }
+    }
+}
+
+/// Holds a session busy until dropped, so a second request on it cannot read the same
+/// transcript and overwrite the first one's turn
+struct SessionLock<'a> {
+    sessions: &'a Mutex<Sessions>,
+    name: String,
+}
+
+impl Drop for SessionLock<'_> {
+    fn drop(&mut self) {
+        self.sessions.lock().unwrap().busy.remove(&self.name);
+    }
+}
+
+struct Server {
+    tokenizer: Tokenizer,
+    mode: ChatMode,
+    system_prompt: String,
+    max_tokens: usize,
+    temperature: Option<f32>,
+    jobs: Mutex<mpsc::Sender<Job>>,
+    sessions: Mutex<Sessions>,
+}
+
+impl Server {
+    fn format_turn(&self, first_turn: bool, message: &str) -> String {
+        let mut s = String::new();
+        if first_turn {
+            s.push_str(&self.system_prompt);
+        }
+        match self.mode {
+            ChatMode::ChatML => s.push_str(&format!(
+                "<|im_start|>user\n{message}<|im_end|><|im_start|>assistant\n"
+            )),
+            ChatMode::Instruct => {
+                s.push_str(&format!("### Instruction:\n{message}\n### Response:\n"))
+            }
+        }
+        s
+    }
+
+    /// Streams the response to `req` as server-sent events, one per decoded piece of text. A
+    /// session takes one request at a time, others get 409
+    fn complete(&self, chat: bool, req: CompletionRequest, out: &mut impl Write) -> Result<()> {
+        let (history, _lock) = match &req.session {
+            Some(name) => {
+                let mut sessions = self.sessions.lock().unwrap();
+                if !sessions.busy.insert(name.clone()) {
+                    write!(
+                        out,
+                        "HTTP/1.1 409 Conflict\r\nConnection: close\r\n\r\nsession {name} is busy\n"
+                    )?;
+                    return Ok(());
+                }
+                let lock = SessionLock {
+                    sessions: &self.sessions,
+                    name: name.clone(),
+                };
+                (sessions.get(name), Some(lock))
+            }
+            None => (None, None),
+        };
+        let text = if chat {
+            self.format_turn(history.is_none(), &req.prompt)
+        } else {
+            req.prompt
+        };
+        let encoding = self
+            .tokenizer
+            .encode(text, true)
+            .map_err(|_e| eyre!("Error tokenizing input"))?;
+        // the whole transcript is evaluated again, the prefix cache takes the kv blocks of
+        // the earlier turns instead of computing them
+        let mut prompt = history.unwrap_or_default();
+        prompt.extend_from_slice(encoding.get_ids());
+        if prompt.is_empty() {
+            return Err(eyre!("empty prompt"));
+        }
+
+        let (tx, rx) = mpsc::channel();
+        self.jobs.lock().unwrap().send(Job {
+            prompt: prompt.clone(),
+            max_tokens: req.max_tokens.unwrap_or(self.max_tokens),
+            temperature: req.temperature.or(self.temperature),
+            tokens: tx,
+        })
+        .map_err(|_| eyre!("engine stopped"))?;
+        write!(
+            out,
+            "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n"
+        )?;
+        out.flush()?;
+
+        let mut resp_toks = Vec::new();
+        let mut stop = None;
+        let mut lastlen = 0;
+        let mut error = None;
+        let mut ended = false;
+        for reply in rx {
+            match reply {
+                Reply::Token(token) => resp_toks.push(token),
+                Reply::Stop(token) => {
+                    stop = token;
+                    ended = true;
+                    break;
+                }
+                Reply::Error(e) => {
+                    error = Some(e);
+                    break;
+                }
+            }
+            let mut respinprogress = self.tokenizer.decode(resp_toks.clone(), false).unwrap();
+            while respinprogress.ends_with('\u{FFFD}') {
+                respinprogress.pop();
+            }
+            let (_prev, piece) = respinprogress.split_at(lastlen);
+            if !piece.is_empty() {
+                let event = serde_json::json!({ "text": piece });
+                write!(out, "data: {event}\n\n")?;
+                out.flush()?;
+            }
+            lastlen = respinprogress.len();
+        }
+        // without a stop the response is cut short, and not kept
+        if !ended && error.is_none() {
+            error = Some("engine stopped".to_string());
+        }
+
+        if let (Some(name), None) = (req.session, &error) {
+            // the stop token closes the turn for the next one
+            prompt.extend_from_slice(&resp_toks);
+            prompt.extend(stop);
+            self.sessions.lock().unwrap().insert(name, prompt);
+        }
+        let event = match error {
+            Some(e) => serde_json::json!({ "error": e }),
+            None => serde_json::json!({ "done": true, "tokens": resp_toks.len() }),
+        };
+        write!(out, "data: {event}\n\n")?;
+        out.flush()?;
+        Ok(())
+    }
+
+    fn handle<S: Read + Write>(&self, stream: S) -> Result<()> {
+        let mut reader = BufReader::new(stream);
+        let mut request_line = String::new();
+        reader.read_line(&mut request_line)?;
+        let mut content_length = 0;
+        loop {
+            let mut header = String::new();
+            if reader.read_line(&mut header)? == 0 || header == "\r\n" || header == "\n" {
+                break;
+            }
+            if let Some((name, value)) = header.split_once(':') {
+                if name.eq_ignore_ascii_case("content-length") {
+                    content_length = value.trim().parse()?;
+                }
+            }
+        }
+        if content_length > MAX_BODY_BYTES {
+            write!(
+                reader.get_mut(),
+                "HTTP/1.1 413 Payload Too Large\r\nConnection: close\r\n\r\n"
+            )?;
+            return Ok(());
+        }
+        let mut body = vec![0; content_length];
+        reader.read_exact(&mut body)?;
+        let mut stream = reader.into_inner();
+
+        let mut parts = request_line.split_whitespace();
+        let chat = match (parts.next(), parts.next()) {
+            (Some("POST"), Some("/completion")) => false,
+            (Some("POST"), Some("/chat")) => true,
+            _ => {
+                write!(stream, "HTTP/1.1 404 Not Found\r\nConnection: close\r\n\r\n")?;
+                return Ok(());
+            }
+        };
+        match serde_json::from_slice::<CompletionRequest>(&body) {
+            Ok(req) => self.complete(chat, req, &mut stream),
+            Err(e) => {
+                write!(
+                    stream,
+                    "HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n{e}\n"
+                )?;
+                Ok(())
+            }
+        }
+    }
+}
+
+fn main() -> Result<()> {
+    color_eyre::install()?;
+    let opt = Opt::from_args();
+    let modelpathstr = if let Some(ref pb) = opt.model {
+        pb.to_string_lossy().into_owned()
+    } else {
+        "minmpt.cpp/models/ggml-mpt-7b-chat-q5_1.bin".to_string()
+    };
+    let mode = if let Some(mode) = opt.chat_format {
+        mode
+    } else if modelpathstr.contains("chat") {
+        ChatMode::ChatML
+    } else {
+        ChatMode::Instruct
+    };
+    eprintln!("Using {mode:?} prompting format.");
+    let tokenizer = Tokenizer::from_pretrained(
+        match mode {
+            ChatMode::ChatML => "mosaicml/mpt-7b-chat",
+            ChatMode::Instruct => "mosaicml/mpt-7b-instruct",
+        },
+        None,
+    )
+    .map_err(|_e| eyre!("error loading tokenizer"))?;
+    let sysprompt_default = match mode {
+        ChatMode::ChatML => "you are a helpful assistant",
+        ChatMode::Instruct => "Below is an instruction that describes a task. Write a response that appropriately completes the request."
+    };
+    let sysprompt = opt
+        .system_prompt
+        .clone()
+        .unwrap_or(sysprompt_default.to_string());
+    let system_prompt = match mode {
+        ChatMode::ChatML => format!("<|im_start|>system\n{sysprompt}<|im_end|>"),
+        ChatMode::Instruct => sysprompt,
+    };
+    let stop_tokens: Vec<u32> = match mode {
+        ChatMode::ChatML => tokenizer.token_to_id("<|im_end|>").into_iter().collect(),
+        ChatMode::Instruct => vec![],
+    };
+
+    let mut loadopts = minmpt::MinMPTOptions::default()
+        .kv_block_size(opt.kv_block_size)
+        .prefix_cache_bytes(opt.prefix_cache_mb << 20);
+    if let Some(n_ctx) = opt.n_ctx {
+        loadopts = loadopts.override_n_ctx(n_ctx);
+    }
+    if let Some(nth) = opt.threads {
+        loadopts = loadopts.n_threads(nth);
+    }
+    if let Some(max_blocks) = opt.kv_max_blocks {
+        loadopts = loadopts.kv_max_blocks(max_blocks);
+    }
+    let sched_options = minmpt::SchedulerOptions {
+        max_seqs: opt.max_seqs,
+        max_batch_tokens: opt.max_batch_tokens,
+        prefill_chunk: opt.prefill_chunk,
+        split_threads: opt.split_threads.unwrap_or(0),
+        ..Default::default()
+    };
+
+    // the model is loaded once, on the thread evaluating every request
+    let (jobs_tx, jobs_rx) = mpsc::channel();
+    let (loaded_tx, loaded_rx) = mpsc::channel();
+    let engine = std::thread::spawn(move || -> Result<()> {
+        let model = minmpt::MinMPT::load_model(&modelpathstr, Some(loadopts));
+        let _ = loaded_tx.send(model.as_ref().map(|_| ()).map_err(|e| e.to_string()));
+        // nothing can be served without the engine, so the server stops with it
+        if let Err(e) = serve_jobs(model?, sched_options, stop_tokens, jobs_rx) {
+            eprintln!("engine stopped: {e}");
+            std::process::exit(1);
+        }
+        Ok(())
+    });
+    if let Err(e) = loaded_rx.recv()? {
+        return Err(eyre!("error loading model: {e}"));
+    }
+
+    let server = Arc::new(Server {
+        tokenizer,
+        mode,
+        system_prompt,
+        max_tokens: opt.max_tokens,
+        temperature: opt.temperature,
+        jobs: Mutex::new(jobs_tx),
+        sessions: Mutex::new(Sessions::new(opt.max_sessions)),
+    });
+    let spawn_handler = |server: &Arc<Server>, stream: Box<dyn ReadWrite + Send>| {
+        let server = server.clone();
+        std::thread::spawn(move || {
+            if let Err(e) = server.handle(stream) {
+                eprintln!("request failed: {e}");
+            }
+        });
+    };
+    if let Some(ref path) = opt.unix {
+        // a socket left by an earlier run is replaced, any other file makes bind fail
+        if std::fs::symlink_metadata(path).map_or(false, |m| m.file_type().is_socket()) {
+            std::fs::remove_file(path)?;
+        }
+        let listener = UnixListener::bind(path)?;
+        eprintln!("Listening on {}", path.display());
+        for stream in listener.incoming() {
+            match stream {
+                Ok(stream) => spawn_handler(&server, Box::new(stream)),
+                Err(e) => eprintln!("accept failed: {e}"),
+            }
+        }
+    } else {
+        let listener = TcpListener::bind(("127.0.0.1", opt.port))?;
+        eprintln!("Listening on http://127.0.0.1:{}", opt.port);
+        for stream in listener.incoming() {
+            match stream {
+                Ok(stream) => spawn_handler(&server, Box::new(stream)),
+                Err(e) => eprintln!("accept failed: {e}"),
+            }
+        }
+    }
+    drop(server);
+    engine.join().map_err(|_| eyre!("engine thread panicked"))?
+}
+
+trait ReadWrite: Read + Write {}
+impl<T: Read + Write> ReadWrite for T {}
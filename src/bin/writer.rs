@@ -39,6 +39,47 @@ struct Opt {
     n_gen: usize,
     #[structopt(long)]
     threads: Option<u32>,
+    #[structopt(long, help = "store the kv cache head-major")]
+    kv_head_major: bool,
+    #[structopt(long, default_value = "f16", help = "kv cache key type: f16, q8_0, q4_0, q4_1")]
+    kv_type_k: minmpt::KvType,
+    #[structopt(long, default_value = "f16", help = "kv cache value type: f16, q8_0, q4_0, q4_1")]
+    kv_type_v: minmpt::KvType,
+    #[structopt(long, help = "when the context is full, drop old tokens instead of stopping")]
+    ctx_shift: bool,
+    #[structopt(long, default_value = "4", help = "tokens kept at the start when the context shifts")]
+    ctx_keep: usize,
+    #[structopt(long, default_value = "oldest", help = "what a context shift drops: oldest, h2o")]
+    kv_evict: minmpt::KvEvict,
+    #[structopt(long, default_value = "0", help = "shift once the kv cache holds this many positions")]
+    kv_budget: usize,
+    #[structopt(long, help = "skip keys whose ALiBi bias scales their weight below this, e.g. 1e-4")]
+    attn_prune_tol: Option<f32>,
+    #[structopt(long, help = "approximate the LM head, computing logits for about this many tokens")]
+    head_candidates: Option<usize>,
+    #[structopt(long, default_value = "256", help = "vocabulary clusters indexed at load for --head-candidates")]
+    head_clusters: usize,
+    #[structopt(long, help = "page the kv cache in blocks of this many positions")]
+    kv_block_size: Option<usize>,
+    #[structopt(long, help = "keep kv blocks in a scratch file at this path, needs --kv-block-size")]
+    kv_disk: Option<String>,
+    #[structopt(long, default_value = "1024", help = "MB of recent kv blocks kept in RAM with --kv-disk")]
+    kv_ram_mb: usize,
+    #[structopt(
+        long,
+        parse(from_os_str),
+        help = "restore the evaluated story from this file, and save it there on (w)rite and (q)uit"
+    )]
+    state: Option<PathBuf>,
+    #[structopt(long, help = "a small model with the same vocabulary, to draft tokens for speculative decoding")]
+    draft_model: Option<String>,
+    #[structopt(
+        long,
+        help = "draft tokens by looking up the last few tokens earlier in the story, without a draft model"
+    )]
+    prompt_lookup: bool,
+    #[structopt(long, default_value = "4", help = "tokens drafted per round with --draft-model or --prompt-lookup")]
+    n_draft: usize,
 }
 
 fn main() -> Result<()> {
@@ -63,7 +104,52 @@ fn main() -> Result<()> {
     if let Some(nth) = opt.threads {
         loadopts = loadopts.n_threads(nth)
     }
+    if opt.kv_head_major {
+        loadopts = loadopts.kv_layout(minmpt::KvLayout::HeadMajor);
+    }
+    loadopts = loadopts.kv_types(opt.kv_type_k, opt.kv_type_v);
+    if opt.ctx_shift {
+        loadopts = loadopts.ctx_shift(opt.ctx_keep, 0);
+        loadopts = loadopts.kv_evict(opt.kv_evict, opt.kv_budget, 32);
+    }
+    if let Some(tol) = opt.attn_prune_tol {
+        loadopts = loadopts.attn_prune_tol(tol);
+    }
+    if let Some(candidates) = opt.head_candidates {
+        loadopts = loadopts.head_index(opt.head_clusters, candidates);
+    }
+    if let Some(block_size) = opt.kv_block_size {
+        loadopts = loadopts.kv_block_size(block_size);
+    }
+    if let Some(ref path) = opt.kv_disk {
+        loadopts = loadopts.kv_disk(path, opt.kv_ram_mb << 20);
+    }
     let mut mptmodel = minmpt::MinMPT::load_model(&modelpathstr, Some(loadopts))?;
+    let mut speculative = if opt.draft_model.is_some() || opt.prompt_lookup {
+        if opt.mirostat {
+            bail!("speculative decoding samples at a temperature and cannot be used with --mirostat");
+        }
+        let draft = if let Some(ref path) = opt.draft_model {
+            let mut draftopts = minmpt::MinMPTOptions::default();
+            if let Some(n_ctx) = opt.n_ctx {
+                draftopts = draftopts.override_n_ctx(n_ctx);
+            }
+            if let Some(nth) = opt.threads {
+                draftopts = draftopts.n_threads(nth)
+            }
+            Some(minmpt::MinMPT::load_model(path, Some(draftopts))?)
+        } else {
+            None
+        };
+        let spec = minmpt::Speculative::new(minmpt::SpeculativeOptions {
+            n_draft: opt.n_draft,
+            temperature: opt.temperature.unwrap_or(1.0),
+            ..Default::default()
+        })?;
+        Some((spec, draft))
+    } else {
+        None
+    };
     let mut rng = rand::thread_rng();
     let mut sampler: Box<dyn Sampler<ThreadRng>> = if opt.mirostat {
         Box::new(
@@ -72,9 +158,7 @@ fn main() -> Result<()> {
                 .target_surprise(opt.mirostat_tau),
         )
     } else {
-        Box::new(sampling::BasicSampler {
-            temperature: opt.temperature,
-        })
+        Box::new(sampling::BasicSampler::new().temperature(opt.temperature))
     };
 
     let read_story = || {
@@ -97,6 +181,49 @@ fn main() -> Result<()> {
         })
     };
     let mut storytokens = read_story()?;
+    if let Some(ref state) = opt.state {
+        if state.exists() {
+            match mptmodel.load_state(&state.to_string_lossy(), &mut Vec::new()) {
+                Ok(()) => {
+                    let tokens = mptmodel.tokens();
+                    let dropped = mptmodel.n_dropped();
+                    let common_pfx_len = tokens
+                        .iter()
+                        .zip(storytokens.iter())
+                        .take_while(|(rt, st)| rt == st)
+                        .count();
+                    if dropped == 0 {
+                        // keep the part of the story that did not change, less one
+                        // token so the logits that follow it are recomputed
+                        let rwlen = mptmodel.n_past() - common_pfx_len.saturating_sub(1);
+                        mptmodel.rewind(rwlen);
+                    } else if tokens[common_pfx_len..]
+                        .iter()
+                        .enumerate()
+                        .all(|(i, t)| storytokens.get(common_pfx_len + dropped + i) == Some(t))
+                    {
+                        // a shifted context holds the start of the story and then a
+                        // window ending where it was saved, which must be unchanged
+                        mptmodel.rewind(1);
+                    } else {
+                        mptmodel.reset_ctx();
+                    }
+                    eprintln!(
+                        "Restored {} tokens from {state:?}",
+                        mptmodel.n_past() + mptmodel.n_dropped()
+                    );
+                }
+                Err(e) => eprintln!("Not restoring {state:?}: {e}"),
+            }
+        }
+    }
+    let save_state = |mptmodel: &minmpt::MinMPT| -> Result<()> {
+        if let Some(ref state) = opt.state {
+            mptmodel.save_state(&state.to_string_lossy())?;
+            eprintln!("Saved state to {state:?}");
+        }
+        Ok(())
+    };
     let mut stop = storytokens.len() + opt.n_gen;
     let mut resplen = 0;
     let stop_signal = Arc::new(AtomicBool::new(false));
@@ -105,40 +232,59 @@ fn main() -> Result<()> {
         r.store(true, Ordering::SeqCst);
     })?;
     loop {
-        let n_past = mptmodel.n_past();
+        // position in the story, which runs past n_ctx when the context shifts
+        let n_past = mptmodel.n_past() + mptmodel.n_dropped();
         //eprintln!("n_past={}, storytokens.len={}", n_past, storytokens.len());
         stop_signal.store(false, Ordering::SeqCst);
         let mut resp_toks = vec![];
         if n_past < stop {
             let mut logits = Vec::new();
-            for chunk in storytokens[n_past..].chunks(opt.input_batch_size) {
+            // speculative rounds take the last story token as their input
+            let n_prefill = storytokens.len() - speculative.is_some() as usize;
+            for chunk in storytokens[n_past..n_prefill].chunks(opt.input_batch_size) {
                 mptmodel.eval(chunk, &mut logits)?;
             }
+            let mut input = storytokens[n_prefill..].to_vec();
             let mut lastlen = 0;
-            loop {
-                //let tokid = sampling::greedy(logits.as_slice()) as u32;
-                let tokid = sampler.sample(logits.as_slice(), &mut rng) as u32;
-                if tokid == 0 {
-                    mptmodel.rewind(1); // don't keep endoftext in the context
-                    break;
-                }
-                resp_toks.push(tokid);
-                if stop_signal.load(Ordering::SeqCst) {
-                    eprintln!("(interrupted)");
-                    break;
-                }
-                let mut respinprogress = tokenizer.decode(resp_toks.clone(), false).unwrap();
-                while respinprogress.ends_with('\u{FFFD}') {
-                    respinprogress.pop();
+            'gen: loop {
+                let toks = if let Some((ref mut spec, ref mut draft)) = speculative {
+                    spec.step(&mut mptmodel, draft.as_mut(), &input)?
+                } else {
+                    //vec![sampling::greedy(logits.as_slice()) as u32]
+                    vec![sampler.sample(logits.as_slice(), &mut rng) as u32]
+                };
+                for tokid in toks {
+                    if tokid == 0 {
+                        break 'gen;
+                    }
+                    resp_toks.push(tokid);
+                    if stop_signal.load(Ordering::SeqCst) {
+                        eprintln!("(interrupted)");
+                        break 'gen;
+                    }
+                    let mut respinprogress = tokenizer.decode(resp_toks.clone(), false).unwrap();
+                    while respinprogress.ends_with('\u{FFFD}') {
+                        respinprogress.pop();
+                    }
+                    let (_prev, out) = respinprogress.split_at(lastlen);
+                    print!("{}", out);
+                    lastlen = respinprogress.as_bytes().len();
+                    std::io::stdout().flush()?;
+                    if n_past + resp_toks.len() >= stop {
+                        break 'gen;
+                    }
                 }
-                let (_prev, out) = respinprogress.split_at(lastlen);
-                print!("{}", out);
-                lastlen = respinprogress.as_bytes().len();
-                std::io::stdout().flush()?;
-                if n_past + resp_toks.len() >= stop {
-                    break;
+                input = resp_toks[resp_toks.len() - 1..].to_vec();
+                if speculative.is_none() {
+                    mptmodel.eval(&input, &mut logits)?;
                 }
-                mptmodel.eval(&resp_toks[resp_toks.len() - 1..], &mut logits)?;
+            }
+            // the model holds the story and the response less its last token. tokens after
+            // an endoftext or a stop, and endoftext itself, are not kept in the context
+            let pos = mptmodel.n_past() + mptmodel.n_dropped();
+            let keep = storytokens.len() + resp_toks.len() - 1;
+            if pos > keep {
+                mptmodel.rewind(pos - keep);
             }
             resplen = resp_toks.len();
         }
@@ -165,6 +311,7 @@ fn main() -> Result<()> {
                     .open(&storyfile)?
                     .write_all(storytext.as_bytes())?;
                 eprintln!("Saved to {storyfile:?}");
+                save_state(&mptmodel)?;
             }
             "d" => {
                 eprintln!("Story tokens: {storytokens:?}");
@@ -173,6 +320,26 @@ fn main() -> Result<()> {
                     .decode(storytokens.clone(), true)
                     .map_err(|e| eyre!("story detokenize {e:?}"))?;
                 println!("{storytext}");
+                let io = mptmodel.kv_io_stats();
+                if io.tokens > 0 {
+                    eprintln!(
+                        "kv disk: {} MB read, {} MB paged out, {} us stalled per token",
+                        io.read_bytes >> 20,
+                        io.paged_out_bytes >> 20,
+                        io.stall_us / io.tokens as u64
+                    );
+                }
+                if let Some((ref spec, _)) = speculative {
+                    let stats = spec.stats();
+                    eprintln!(
+                        "speculative: {}/{} drafts accepted ({:.1}%), {:.2} tokens per round, {:.1} tokens/s",
+                        stats.accepted,
+                        stats.drafted,
+                        100.0 * stats.acceptance_rate(),
+                        stats.tokens as f64 / stats.rounds.max(1) as f64,
+                        stats.tokens_per_sec()
+                    );
+                }
             }
             "r" => {
                 let readtokens = read_story()?;
@@ -186,7 +353,7 @@ fn main() -> Result<()> {
                 // since we don't cache the actual final logits
                 let common_pfx_len = common_pfx_len.saturating_sub(1);
                 storytokens = readtokens;
-                let rwlen = mptmodel.n_past() - common_pfx_len;
+                let rwlen = mptmodel.n_past() + mptmodel.n_dropped() - common_pfx_len;
                 eprintln!("Rewinding by {rwlen}");
                 mptmodel.rewind(rwlen);
             }
@@ -195,6 +362,7 @@ fn main() -> Result<()> {
                 mptmodel.rewind(resplen);
             }
             "q" => {
+                save_state(&mptmodel)?;
                 break;
             }
             _ => {
@@ -1,3 +1,4 @@
+use std::ffi::CString;
 use std::ptr::null_mut;
 use thiserror::Error;
 
@@ -11,6 +12,8 @@ mod binding {
 pub enum MinMPTError {
     #[error("Exceeded model context size")]
     ContextLimit,
+    #[error("Out of kv cache blocks")]
+    KvFull,
     #[error("Invalid input")]
     InvalidInput,
     #[error("Internal failure")]
@@ -25,15 +28,111 @@ impl MinMPTError {
             binding::MINMPT_FAILURE => Self::Failure,
             binding::MINMPT_INVALID => Self::InvalidInput,
             binding::MINMPT_CTX_LIMIT => Self::ContextLimit,
+            binding::MINMPT_KV_FULL => Self::KvFull,
             _ => Self::Unknown,
         }
     }
 }
 
+/// How the kv cache is laid out in memory
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum KvLayout {
+    /// K and V as `[n_layer][n_ctx][n_embd]`
+    Flat,
+    /// K head-major and V pre-transposed per head, so attention reads both
+    /// without copying
+    HeadMajor,
+}
+
+impl KvLayout {
+    fn to_raw(self) -> i32 {
+        match self {
+            KvLayout::Flat => binding::MINMPT_KV_LAYOUT_FLAT as i32,
+            KvLayout::HeadMajor => binding::MINMPT_KV_LAYOUT_HEAD_MAJOR as i32,
+        }
+    }
+}
+
+/// Storage type of the cached keys or values. The quantized types keep
+/// blocks of 32 values with a shared scale
+#[allow(non_camel_case_types)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum KvType {
+    F16,
+    Q8_0,
+    Q4_0,
+    Q4_1,
+}
+
+impl KvType {
+    fn to_raw(self) -> i32 {
+        match self {
+            KvType::F16 => binding::MINMPT_KV_TYPE_F16 as i32,
+            KvType::Q8_0 => binding::MINMPT_KV_TYPE_Q8_0 as i32,
+            KvType::Q4_0 => binding::MINMPT_KV_TYPE_Q4_0 as i32,
+            KvType::Q4_1 => binding::MINMPT_KV_TYPE_Q4_1 as i32,
+        }
+    }
+}
+
+impl std::str::FromStr for KvType {
+    type Err = String;
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        match s.to_ascii_lowercase().as_str() {
+            "f16" => Ok(KvType::F16),
+            "q8_0" => Ok(KvType::Q8_0),
+            "q4_0" => Ok(KvType::Q4_0),
+            "q4_1" => Ok(KvType::Q4_1),
+            _ => Err(format!("unknown kv cache type {s:?}")),
+        }
+    }
+}
+
+/// What context shifting drops from the kv cache
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum KvEvict {
+    /// The oldest tokens after the kept ones
+    Oldest,
+    /// Per layer, the positions that received the least attention so far,
+    /// sparing the most recent tokens (heavy-hitter eviction)
+    H2O,
+}
+
+impl KvEvict {
+    fn to_raw(self) -> i32 {
+        match self {
+            KvEvict::Oldest => binding::MINMPT_KV_EVICT_OLDEST as i32,
+            KvEvict::H2O => binding::MINMPT_KV_EVICT_H2O as i32,
+        }
+    }
+}
+
+impl std::str::FromStr for KvEvict {
+    type Err = String;
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        match s.to_ascii_lowercase().as_str() {
+            "oldest" => Ok(KvEvict::Oldest),
+            "h2o" => Ok(KvEvict::H2O),
+            _ => Err(format!("unknown kv eviction policy {s:?}")),
+        }
+    }
+}
+
 #[derive(Default, Debug)]
 pub struct MinMPTOptions {
     n_ctx_override: Option<usize>,
     n_threads: Option<u32>,
+    kv_layout: Option<KvLayout>,
+    kv_type_k: Option<KvType>,
+    kv_type_v: Option<KvType>,
+    kv_block_size: Option<usize>,
+    kv_max_blocks: Option<usize>,
+    prefix_cache_bytes: Option<usize>,
+    ctx_shift: Option<(usize, usize)>,
+    kv_evict: Option<(KvEvict, usize, usize)>,
+    attn_prune_tol: Option<f32>,
+    kv_disk: Option<(String, usize)>,
+    head_index: Option<(usize, usize)>,
 }
 
 impl MinMPTOptions {
@@ -49,6 +148,107 @@ impl MinMPTOptions {
             ..self
         }
     }
+    pub fn kv_layout(self, kv_layout: KvLayout) -> Self {
+        Self {
+            kv_layout: Some(kv_layout),
+            ..self
+        }
+    }
+    /// Quantized values need the flat layout
+    pub fn kv_types(self, type_k: KvType, type_v: KvType) -> Self {
+        Self {
+            kv_type_k: Some(type_k),
+            kv_type_v: Some(type_v),
+            ..self
+        }
+    }
+    /// Page the kv cache in blocks of this many positions, allocated as the
+    /// context grows and shared with forks
+    pub fn kv_block_size(self, block_size: usize) -> Self {
+        Self {
+            kv_block_size: Some(block_size),
+            ..self
+        }
+    }
+    /// Keep up to this many bytes of kv cache blocks keyed by the tokens they hold, so
+    /// sessions starting with the same tokens evaluate them once. Needs `kv_block_size`
+    pub fn prefix_cache_bytes(self, bytes: usize) -> Self {
+        Self {
+            prefix_cache_bytes: Some(bytes),
+            ..self
+        }
+    }
+    /// Instead of failing at n_ctx, keep the first `keep` tokens and drop the oldest of the rest,
+    /// `discard` at a time (0 for half of them), so generation can go on indefinitely
+    pub fn ctx_shift(self, keep: usize, discard: usize) -> Self {
+        Self {
+            ctx_shift: Some((keep, discard)),
+            ..self
+        }
+    }
+    /// With `ctx_shift`, choose what is dropped and shift once the cache
+    /// holds `budget` positions (0 for n_ctx). `H2O` never evicts the last
+    /// `recent` tokens
+    pub fn kv_evict(self, policy: KvEvict, budget: usize, recent: usize) -> Self {
+        Self {
+            kv_evict: Some((policy, budget, recent)),
+            ..self
+        }
+    }
+    /// Skip keys so far back that ALiBi scales their attention weight by less than `tol`, which
+    /// makes attention cost per head depend on its slope rather than the context length
+    pub fn attn_prune_tol(self, tol: f32) -> Self {
+        Self {
+            attn_prune_tol: Some(tol),
+            ..self
+        }
+    }
+    /// Keep the kv cache blocks in a scratch file created at `path`, with each session's most
+    /// recent `ram_bytes` of blocks resident and older ones read in layer by layer. Needs
+    /// `kv_block_size`
+    pub fn kv_disk(self, path: &str, ram_bytes: usize) -> Self {
+        Self {
+            kv_disk: Some((path.to_owned(), ram_bytes)),
+            ..self
+        }
+    }
+    /// Most kv cache blocks this model and its forks may hold at once
+    pub fn kv_max_blocks(self, max_blocks: usize) -> Self {
+        Self {
+            kv_max_blocks: Some(max_blocks),
+            ..self
+        }
+    }
+    /// Cluster the rows of the output projection into `clusters` groups at load, and compute
+    /// logits only for the `candidates` or so tokens of the clusters that best match each output,
+    /// leaving the rest at -inf. See [`MinMPT::set_head_candidates`]
+    pub fn head_index(self, clusters: usize, candidates: usize) -> Self {
+        Self {
+            head_index: Some((clusters, candidates)),
+            ..self
+        }
+    }
+}
+
+/// Disk traffic of a kv cache kept on disk, shared by a model and its forks
+#[derive(Debug, Clone, Copy, Default)]
+pub struct KvIoStats {
+    pub tokens: usize,
+    pub read_bytes: usize,
+    pub paged_out_bytes: usize,
+    /// time attention waited for blocks to be read in
+    pub stall_us: u64,
+}
+
+/// Counters of the prefix cache shared by a model and its forks
+#[derive(Debug, Clone, Copy, Default)]
+pub struct PrefixCacheStats {
+    /// evals of more than one token, which look for cached blocks
+    pub lookups: usize,
+    pub hits: usize,
+    pub tokens_reused: usize,
+    pub blocks: usize,
+    pub bytes: usize,
 }
 
 pub struct MinMPT {
@@ -68,12 +268,60 @@ impl MinMPT {
         };
         let load_options = load_options.unwrap_or_default();
         let href: *mut binding::minmpt_handle = &mut me.handle;
+        let mut params = unsafe { binding::minmpt_default_params() };
+        params.n_ctx_override = load_options.n_ctx_override.unwrap_or(0);
+        if let Some(layout) = load_options.kv_layout {
+            params.kv_layout = layout.to_raw();
+        }
+        if let Some(type_k) = load_options.kv_type_k {
+            params.kv_type_k = type_k.to_raw();
+        }
+        if let Some(type_v) = load_options.kv_type_v {
+            params.kv_type_v = type_v.to_raw();
+        }
+        if let Some(block_size) = load_options.kv_block_size {
+            params.kv_block_size = block_size as i32;
+        }
+        if let Some(max_blocks) = load_options.kv_max_blocks {
+            params.kv_max_blocks = max_blocks as i32;
+        }
+        if let Some(bytes) = load_options.prefix_cache_bytes {
+            params.prefix_cache_bytes = bytes;
+        }
+        if let Some((keep, discard)) = load_options.ctx_shift {
+            params.ctx_shift = 1;
+            params.ctx_keep = keep;
+            params.ctx_discard = discard;
+        }
+        if let Some((policy, budget, recent)) = load_options.kv_evict {
+            params.kv_evict = policy.to_raw();
+            params.kv_budget = budget;
+            params.kv_recent = recent;
+        }
+        if let Some(tol) = load_options.attn_prune_tol {
+            params.attn_prune_tol = tol;
+        }
+        if let Some((clusters, candidates)) = load_options.head_index {
+            params.head_clusters = clusters;
+            params.head_candidates = candidates;
+        }
+        // must outlive the load call
+        let disk_path = match &load_options.kv_disk {
+            Some((path, ram_bytes)) => {
+                params.kv_ram_bytes = *ram_bytes;
+                Some(CString::new(path.as_str()).map_err(|_| MinMPTError::InvalidInput)?)
+            }
+            None => None,
+        };
+        if let Some(path) = &disk_path {
+            params.kv_disk_path = path.as_ptr();
+        }
         let err = unsafe {
-            binding::minmpt_load(
+            binding::minmpt_load_with_params(
                 href,
                 path.as_bytes().as_ptr().cast(),
                 path.as_bytes().len(),
-                load_options.n_ctx_override.unwrap_or(0),
+                &params,
             )
         };
         if err == binding::MINMPT_OK as i32 {
@@ -86,7 +334,8 @@ impl MinMPT {
         }
     }
     /// Creates a second model instance with its own kvcache but sharing the original model's
-    /// weight data
+    /// weight data. The context so far is copied, or shared copy-on-write when the kv cache is
+    /// paged
     pub fn fork(&self) -> MinMPT {
         let mut child = MinMPT {
             handle: null_mut(),
@@ -102,29 +351,348 @@ impl MinMPT {
     pub fn set_n_threads(&self, n_threads: u32) {
         unsafe { binding::minmpt_set_n_threads(self.handle, n_threads) }
     }
+    /// With a model loaded with `head_index`, the number of tokens this session computes logits
+    /// for, 0 for all of them
+    pub fn set_head_candidates(&self, n_candidates: usize) {
+        unsafe { binding::minmpt_set_head_candidates(self.handle, n_candidates) }
+    }
     pub fn n_vocab(&self) -> usize {
         unsafe { binding::minmpt_n_vocab(self.handle) }
     }
     pub fn n_past(&self) -> usize {
         unsafe { binding::minmpt_n_past(self.handle) }
     }
+    /// Tokens dropped or evicted from the context by shifting. `n_past() + n_dropped()` is the
+    /// number of tokens evaluated since the last reset
+    pub fn n_dropped(&self) -> usize {
+        unsafe { binding::minmpt_n_dropped(self.handle) }
+    }
+    /// Goes back `n` tokens in the evaluated stream. When the context has shifted, going back
+    /// past the kept window leaves only the first tokens in the context
     pub fn rewind(&self, n: usize) {
         unsafe { binding::minmpt_rewind(self.handle, n) }
     }
     pub fn n_ctx(&self) -> usize {
         unsafe { binding::minmpt_n_ctx(self.handle) }
     }
+    /// Bytes of kv cache memory held, by the whole block pool when paged
+    pub fn kv_bytes(&self) -> usize {
+        unsafe { binding::minmpt_kv_bytes(self.handle) }
+    }
     pub fn reset_ctx(&mut self) {
         unsafe {
             binding::minmpt_reset_ctx(self.handle);
         }
     }
+    pub fn prefix_cache_stats(&self) -> PrefixCacheStats {
+        let mut stats = binding::minmpt_prefix_cache_stats {
+            n_lookups: 0,
+            n_hits: 0,
+            n_tokens_reused: 0,
+            n_blocks: 0,
+            n_bytes: 0,
+        };
+        unsafe { binding::minmpt_get_prefix_cache_stats(self.handle, &mut stats) }
+        PrefixCacheStats {
+            lookups: stats.n_lookups,
+            hits: stats.n_hits,
+            tokens_reused: stats.n_tokens_reused,
+            blocks: stats.n_blocks,
+            bytes: stats.n_bytes,
+        }
+    }
+    pub fn kv_io_stats(&self) -> KvIoStats {
+        let mut stats = binding::minmpt_kv_io_stats {
+            n_tokens: 0,
+            n_read_bytes: 0,
+            n_paged_out_bytes: 0,
+            stall_us: 0,
+        };
+        unsafe { binding::minmpt_get_kv_io_stats(self.handle, &mut stats) }
+        KvIoStats {
+            tokens: stats.n_tokens,
+            read_bytes: stats.n_read_bytes,
+            paged_out_bytes: stats.n_paged_out_bytes,
+            stall_us: stats.stall_us,
+        }
+    }
+    /// The n_past tokens currently in the context
+    pub fn tokens(&self) -> Vec<u32> {
+        let mut tokens = vec![0; self.n_past()];
+        unsafe { binding::minmpt_tokens(self.handle, tokens.as_mut_ptr()) }
+        tokens
+    }
+    /// Writes the context and the last logits to a file that `load_state` can
+    /// restore without evaluating the tokens again
+    pub fn save_state(&self, path: &str) -> Result<(), MinMPTError> {
+        let err = unsafe {
+            binding::minmpt_save_state(
+                self.handle,
+                path.as_bytes().as_ptr().cast(),
+                path.as_bytes().len(),
+            )
+        };
+        if err == binding::MINMPT_OK as i32 {
+            Ok(())
+        } else {
+            Err(MinMPTError::from_code(err))
+        }
+    }
+    /// Replaces the context with one saved by `save_state` from the same model
+    /// and kv cache settings, and puts the logits that followed it in
+    /// `logits_out`
+    pub fn load_state(&mut self, path: &str, logits_out: &mut Vec<f32>) -> Result<(), MinMPTError> {
+        logits_out.resize(self.n_vocab(), 0.0);
+        let err = unsafe {
+            binding::minmpt_load_state(
+                self.handle,
+                path.as_bytes().as_ptr().cast(),
+                path.as_bytes().len(),
+                logits_out.as_mut_ptr(),
+            )
+        };
+        if err == binding::MINMPT_OK as i32 {
+            Ok(())
+        } else {
+            Err(MinMPTError::from_code(err))
+        }
+    }
     pub fn eval(&mut self, ids: &[u32], logits_out: &mut Vec<f32>) -> Result<(), MinMPTError> {
         for chunk in ids.chunks(self.chunksize) {
             self.eval_inner(chunk, logits_out)?;
         }
         Ok(())
     }
+    /// Like `eval`, but leaves the logits in the session for a [`NativeSampler`] instead of
+    /// copying them out
+    pub fn feed(&mut self, ids: &[u32]) -> Result<(), MinMPTError> {
+        for chunk in ids.chunks(self.chunksize) {
+            let err = unsafe {
+                binding::minmpt_eval_logits(self.handle, chunk.as_ptr(), chunk.len(), null_mut())
+            };
+            if err != binding::MINMPT_OK as i32 {
+                return Err(MinMPTError::from_code(err));
+            }
+        }
+        Ok(())
+    }
+    /// Like `eval`, with the logits after each of `ids`, `ids.len() * n_vocab` floats, in
+    /// `logits_out`
+    pub fn eval_all(&mut self, ids: &[u32], logits_out: &mut Vec<f32>) -> Result<(), MinMPTError> {
+        if ids.is_empty() {
+            return Err(MinMPTError::InvalidInput);
+        }
+        let n_vocab = self.n_vocab();
+        logits_out.resize(ids.len() * n_vocab, 0.0);
+        for (chunk, out) in ids
+            .chunks(self.chunksize)
+            .zip(logits_out.chunks_mut(self.chunksize * n_vocab))
+        {
+            let err = unsafe {
+                binding::minmpt_eval_logits_n(
+                    self.handle,
+                    chunk.as_ptr(),
+                    chunk.len(),
+                    chunk.len(),
+                    out.as_mut_ptr(),
+                )
+            };
+            if err != binding::MINMPT_OK as i32 {
+                return Err(MinMPTError::from_code(err));
+            }
+        }
+        Ok(())
+    }
+    /// Like `eval`, with logits computed only for the tokens in `allowed`, such as the labels of
+    /// a classifier, and the rest set to -inf. A short list costs a fraction of the full head
+    pub fn eval_allowed(
+        &mut self,
+        ids: &[u32],
+        allowed: &[u32],
+        logits_out: &mut Vec<f32>,
+    ) -> Result<(), MinMPTError> {
+        // checked before any chunk is evaluated
+        let n_vocab = self.n_vocab();
+        if ids.is_empty() || allowed.is_empty() || allowed.iter().any(|t| *t as usize >= n_vocab) {
+            return Err(MinMPTError::InvalidInput);
+        }
+        let (rest, last) = ids.split_at((ids.len() - 1) / self.chunksize * self.chunksize);
+        self.feed(rest)?;
+        logits_out.resize(n_vocab, 0.0);
+        let err = unsafe {
+            binding::minmpt_eval_logits_allowed(
+                self.handle,
+                last.as_ptr(),
+                last.len(),
+                allowed.as_ptr(),
+                allowed.len(),
+                logits_out.as_mut_ptr(),
+            )
+        };
+        if err == binding::MINMPT_OK as i32 {
+            Ok(())
+        } else {
+            Err(MinMPTError::from_code(err))
+        }
+    }
+    /// Evaluates `ids` and returns the `k` most likely next tokens, most likely first, with
+    /// their log probabilities. The head keeps only these while computing the logits, so none
+    /// are left in the session afterwards
+    pub fn eval_top_k(&mut self, ids: &[u32], k: usize) -> Result<Vec<(u32, f32)>, MinMPTError> {
+        if ids.is_empty() {
+            return Err(MinMPTError::InvalidInput);
+        }
+        // chunked as `eval` would, with the head run on the last chunk only
+        let (rest, last) = ids.split_at((ids.len() - 1) / self.chunksize * self.chunksize);
+        self.feed(rest)?;
+        let mut tokens = vec![0u32; k];
+        let mut logprobs = vec![0f32; k];
+        let err = unsafe {
+            binding::minmpt_eval_top_k(
+                self.handle,
+                last.as_ptr(),
+                last.len(),
+                k,
+                tokens.as_mut_ptr(),
+                logprobs.as_mut_ptr(),
+            )
+        };
+        if err == binding::MINMPT_OK as i32 {
+            Ok(tokens.into_iter().zip(logprobs).collect())
+        } else {
+            Err(MinMPTError::from_code(err))
+        }
+    }
+    /// Evaluates `ids[i]` in `models[i]` for each i, sharing every pass over the weights
+    /// between them, and writes the logits after each to `logits_out[i]`. The models must be
+    /// distinct forks of one loaded model. If any fails, its error is returned after the
+    /// others are evaluated
+    pub fn eval_batch(
+        models: &mut [&mut MinMPT],
+        ids: &[&[u32]],
+        logits_out: &mut [Vec<f32>],
+    ) -> Result<(), MinMPTError> {
+        if models.is_empty() || ids.len() != models.len() || logits_out.len() != models.len() {
+            return Err(MinMPTError::InvalidInput);
+        }
+        let handles: Vec<binding::minmpt_handle> = models.iter().map(|m| m.handle).collect();
+        let tokens: Vec<*const u32> = ids.iter().map(|t| t.as_ptr()).collect();
+        let n_tokens: Vec<usize> = ids.iter().map(|t| t.len()).collect();
+        let n_vocab = models[0].n_vocab();
+        let logits: Vec<*mut f32> = logits_out
+            .iter_mut()
+            .map(|l| {
+                l.resize(n_vocab, 0.0);
+                l.as_mut_ptr()
+            })
+            .collect();
+        let err = unsafe {
+            binding::minmpt_eval_batch(
+                handles.as_ptr(),
+                tokens.as_ptr(),
+                n_tokens.as_ptr(),
+                handles.len(),
+                logits.as_ptr(),
+                null_mut(),
+            )
+        };
+        if err == binding::MINMPT_OK as i32 {
+            Ok(())
+        } else {
+            Err(MinMPTError::from_code(err))
+        }
+    }
+    /// Classifier-free guidance: evaluates `ids` in this model and `neg_ids` in `neg`, a fork of
+    /// it, in one batch per chunk, and writes `cfg_scale * (pos - neg) + neg` to `logits_out`.
+    /// The longer input's extra leading tokens are evaluated on their own first, so the two
+    /// end in the same batch
+    pub fn eval_cfg(
+        &mut self,
+        ids: &[u32],
+        neg: &mut MinMPT,
+        neg_ids: &[u32],
+        cfg_scale: f32,
+        logits_out: &mut Vec<f32>,
+    ) -> Result<(), MinMPTError> {
+        if ids.is_empty() || neg_ids.is_empty() {
+            return Err(MinMPTError::InvalidInput);
+        }
+        let n = ids.len().min(neg_ids.len());
+        let (ids_head, ids) = ids.split_at(ids.len() - n);
+        let (neg_head, neg_ids) = neg_ids.split_at(neg_ids.len() - n);
+        if !ids_head.is_empty() {
+            self.eval(ids_head, logits_out)?;
+        }
+        if !neg_head.is_empty() {
+            neg.eval(neg_head, logits_out)?;
+        }
+        logits_out.resize(self.n_vocab(), 0.0);
+        for (chunk, neg_chunk) in ids
+            .chunks(self.chunksize)
+            .zip(neg_ids.chunks(self.chunksize))
+        {
+            let err = unsafe {
+                binding::minmpt_eval_cfg(
+                    self.handle,
+                    chunk.as_ptr(),
+                    chunk.len(),
+                    neg.handle,
+                    neg_chunk.as_ptr(),
+                    neg_chunk.len(),
+                    cfg_scale,
+                    logits_out.as_mut_ptr(),
+                )
+            };
+            if err != binding::MINMPT_OK as i32 {
+                return Err(MinMPTError::from_code(err));
+            }
+        }
+        Ok(())
+    }
+    /// Samples `options.n` continuations of the context followed by `prompt`, returning each
+    /// with the sum of the log probabilities of its tokens. The prompt is evaluated once and the
+    /// continuations decode together in one batch per step. A continuation that runs out of
+    /// context ends early. The context is left unchanged
+    pub fn generate_n(
+        &self,
+        prompt: &[u32],
+        options: GenerateOptions,
+    ) -> Result<Vec<(Vec<u32>, f32)>, MinMPTError> {
+        let params = binding::minmpt_generate_params {
+            n: options.n,
+            max_tokens: options.max_tokens,
+            temperature: options.temperature,
+            seed: options.seed,
+            eos_token: options.eos_token,
+        };
+        let mut tokens = vec![vec![0u32; options.max_tokens]; options.n];
+        let ptrs: Vec<*mut u32> = tokens.iter_mut().map(|t| t.as_mut_ptr()).collect();
+        let mut n_tokens = vec![0usize; options.n];
+        let mut logprobs = vec![0f32; options.n];
+        let err = unsafe {
+            binding::minmpt_generate_n(
+                self.handle,
+                prompt.as_ptr(),
+                prompt.len(),
+                &params,
+                ptrs.as_ptr(),
+                n_tokens.as_mut_ptr(),
+                logprobs.as_mut_ptr(),
+            )
+        };
+        if err != binding::MINMPT_OK as i32 {
+            return Err(MinMPTError::from_code(err));
+        }
+        Ok(tokens
+            .into_iter()
+            .zip(n_tokens)
+            .zip(logprobs)
+            .map(|((mut t, n), lp)| {
+                t.truncate(n);
+                (t, lp)
+            })
+            .collect())
+    }
     fn eval_inner(&mut self, ids: &[u32], logits_out: &mut Vec<f32>) -> Result<(), MinMPTError> {
         if ids.is_empty() {
             return Err(MinMPTError::InvalidInput);
@@ -146,6 +714,590 @@ impl MinMPT {
     }
 }
 
+/// Sampling of [`MinMPT::generate_n`]
+#[derive(Debug, Clone, Copy)]
+pub struct GenerateOptions {
+    /// Continuations sampled
+    pub n: usize,
+    /// Most tokens per continuation
+    pub max_tokens: usize,
+    /// 0 for greedy
+    pub temperature: f32,
+    /// 0 for a random seed
+    pub seed: u64,
+    /// Ends a continuation, and is not part of it
+    pub eos_token: u32,
+}
+
+impl Default for GenerateOptions {
+    fn default() -> Self {
+        let params = unsafe { binding::minmpt_generate_default_params() };
+        GenerateOptions {
+            n: params.n,
+            max_tokens: params.max_tokens,
+            temperature: params.temperature,
+            seed: params.seed,
+            eos_token: params.eos_token,
+        }
+    }
+}
+
+/// Limits of a [`Scheduler`]
+#[derive(Debug, Clone, Copy)]
+pub struct SchedulerOptions {
+    /// Most sequences holding a kv cache at once
+    pub max_seqs: usize,
+    /// Tokens evaluated per step, at least `max_seqs`
+    pub max_batch_tokens: usize,
+    /// Most prompt tokens one sequence prefills per step
+    pub prefill_chunk: usize,
+    /// Split this many cores between a prefill pool, run by a thread of the scheduler, and a
+    /// decode pool, run by the thread calling `step`, at most the cores this thread may run on.
+    /// 0 evaluates prompts and decode tokens together
+    pub split_threads: usize,
+    /// Fewest threads either pool is left with when the split adapts to load
+    pub min_pool_threads: usize,
+    /// With a dense kv cache, most bytes of kv cache the running sequences may hold, 0 for no
+    /// limit. A paged cache is bounded by `kv_max_blocks` instead
+    pub max_kv_bytes: usize,
+}
+
+impl Default for SchedulerOptions {
+    fn default() -> Self {
+        let params = unsafe { binding::minmpt_sched_default_params() };
+        SchedulerOptions {
+            max_seqs: params.max_seqs,
+            max_batch_tokens: params.max_batch_tokens,
+            prefill_chunk: params.prefill_chunk,
+            split_threads: params.n_split_threads,
+            min_pool_threads: params.n_min_pool_threads,
+            max_kv_bytes: params.max_kv_bytes,
+        }
+    }
+}
+
+/// Queue depth, batch sizes and step latency of a [`Scheduler`]
+#[derive(Debug, Clone, Copy, Default)]
+pub struct SchedulerStats {
+    pub queued: usize,
+    pub running: usize,
+    pub steps: usize,
+    /// sequences sent back to the queue when the kv cache pool ran out
+    pub preempted: usize,
+    /// the last step
+    pub batch_seqs: usize,
+    pub batch_tokens: usize,
+    pub prefill_tokens: usize,
+    pub step_us: u64,
+    /// over all steps
+    pub tokens_total: usize,
+    pub step_us_total: u64,
+    pub step_us_max: u64,
+    /// the current split of `split_threads`
+    pub decode_threads: usize,
+    pub prefill_threads: usize,
+}
+
+/// Continuous batching over forks of a model. Each step evaluates one token for every decoding
+/// sequence plus chunks of the prompts being prefilled, and admits queued prompts as the kv cache
+/// pool has room for them
+pub struct Scheduler<'a> {
+    handle: binding::minmpt_sched_handle,
+    n_vocab: usize,
+    _base: std::marker::PhantomData<&'a MinMPT>,
+}
+
+impl<'a> Scheduler<'a> {
+    /// Sequences start as forks of `base`, continuing its context
+    pub fn new(base: &'a MinMPT, options: SchedulerOptions) -> Result<Self, MinMPTError> {
+        let params = binding::minmpt_sched_params {
+            max_seqs: options.max_seqs,
+            max_batch_tokens: options.max_batch_tokens,
+            prefill_chunk: options.prefill_chunk,
+            n_split_threads: options.split_threads,
+            n_min_pool_threads: options.min_pool_threads,
+            max_kv_bytes: options.max_kv_bytes,
+        };
+        let mut handle: binding::minmpt_sched_handle = null_mut();
+        let err = unsafe { binding::minmpt_sched_create(base.handle, &params, &mut handle) };
+        if err == binding::MINMPT_OK as i32 {
+            Ok(Scheduler {
+                handle,
+                n_vocab: base.n_vocab(),
+                _base: std::marker::PhantomData,
+            })
+        } else {
+            Err(MinMPTError::from_code(err))
+        }
+    }
+    /// Queues a sequence starting with `prompt` and returns its id
+    pub fn submit(&mut self, prompt: &[u32]) -> Result<u64, MinMPTError> {
+        let mut id = 0;
+        let err = unsafe {
+            binding::minmpt_sched_submit(self.handle, prompt.as_ptr(), prompt.len(), &mut id)
+        };
+        if err == binding::MINMPT_OK as i32 {
+            Ok(id)
+        } else {
+            Err(MinMPTError::from_code(err))
+        }
+    }
+    /// Evaluates one batch and returns the ids of the sequences waiting for a token, including
+    /// failed ones. With split pools the batch holds only decode tokens, and a step with none
+    /// waits for a prompt to be evaluated. A failed batch is an error, and its sequences are
+    /// left waiting with the error `logits` reports for each
+    pub fn step(&mut self) -> Result<Vec<u64>, MinMPTError> {
+        let err = unsafe { binding::minmpt_sched_step(self.handle, null_mut()) };
+        if err != binding::MINMPT_OK as i32 {
+            return Err(MinMPTError::from_code(err));
+        }
+        Ok(self.ready())
+    }
+    /// The ids of the sequences waiting for a token, including failed ones
+    pub fn ready(&self) -> Vec<u64> {
+        let n_ready = unsafe { binding::minmpt_sched_ready(self.handle, null_mut(), 0) };
+        let mut ids = vec![0; n_ready];
+        unsafe { binding::minmpt_sched_ready(self.handle, ids.as_mut_ptr(), ids.len()) };
+        ids
+    }
+    /// The logits after the last token of a waiting sequence, or the error it failed with
+    pub fn logits(&self, id: u64) -> Result<&[f32], MinMPTError> {
+        let mut logits: *const f32 = std::ptr::null();
+        let err = unsafe { binding::minmpt_sched_logits(self.handle, id, &mut logits) };
+        if err == binding::MINMPT_OK as i32 {
+            Ok(unsafe { std::slice::from_raw_parts(logits, self.n_vocab) })
+        } else {
+            Err(MinMPTError::from_code(err))
+        }
+    }
+    /// Gives a waiting sequence its next token, evaluated by a later step
+    pub fn push(&mut self, id: u64, token: u32) -> Result<(), MinMPTError> {
+        let err = unsafe { binding::minmpt_sched_push(self.handle, id, token) };
+        if err == binding::MINMPT_OK as i32 {
+            Ok(())
+        } else {
+            Err(MinMPTError::from_code(err))
+        }
+    }
+    /// Drops a sequence and its kv cache
+    pub fn finish(&mut self, id: u64) {
+        unsafe { binding::minmpt_sched_finish(self.handle, id) }
+    }
+    pub fn stats(&self) -> SchedulerStats {
+        let mut stats: binding::minmpt_sched_stats = unsafe { std::mem::zeroed() };
+        unsafe { binding::minmpt_sched_get_stats(self.handle, &mut stats) }
+        SchedulerStats {
+            queued: stats.n_queued,
+            running: stats.n_running,
+            steps: stats.n_steps,
+            preempted: stats.n_preempted,
+            batch_seqs: stats.n_batch_seqs,
+            batch_tokens: stats.n_batch_tokens,
+            prefill_tokens: stats.n_prefill_tokens,
+            step_us: stats.step_us,
+            tokens_total: stats.n_tokens_total,
+            step_us_total: stats.step_us_total,
+            step_us_max: stats.step_us_max,
+            decode_threads: stats.n_decode_threads,
+            prefill_threads: stats.n_prefill_threads,
+        }
+    }
+}
+
+impl Drop for Scheduler<'_> {
+    fn drop(&mut self) {
+        if !self.handle.is_null() {
+            unsafe { binding::minmpt_sched_free(self.handle) }
+        }
+    }
+}
+
+/// Draft length and sampling of a [`Speculative`] decoder
+#[derive(Debug, Clone, Copy)]
+pub struct SpeculativeOptions {
+    /// Tokens the draft model proposes per round
+    pub n_draft: usize,
+    /// 0 for greedy
+    pub temperature: f32,
+    /// 0 for a random seed
+    pub seed: u64,
+    /// Lengths of the n-grams prompt lookup matches when there is no draft model
+    pub ngram_min: usize,
+    pub ngram_max: usize,
+}
+
+impl Default for SpeculativeOptions {
+    fn default() -> Self {
+        let params = unsafe { binding::minmpt_spec_default_params() };
+        SpeculativeOptions {
+            n_draft: params.n_draft,
+            temperature: params.temperature,
+            seed: params.seed,
+            ngram_min: params.ngram_min,
+            ngram_max: params.ngram_max,
+        }
+    }
+}
+
+/// Counters of a [`Speculative`] decoder
+#[derive(Debug, Clone, Copy, Default)]
+pub struct SpeculativeStats {
+    pub rounds: usize,
+    pub drafted: usize,
+    pub accepted: usize,
+    /// accepted drafts plus one token from the target per round
+    pub tokens: usize,
+    /// time spent in `step`
+    pub us: u64,
+}
+
+impl SpeculativeStats {
+    /// Fraction of the drafted tokens the target kept
+    pub fn acceptance_rate(&self) -> f64 {
+        if self.drafted == 0 {
+            0.0
+        } else {
+            self.accepted as f64 / self.drafted as f64
+        }
+    }
+    /// Tokens produced per second of `step`
+    pub fn tokens_per_sec(&self) -> f64 {
+        if self.us == 0 {
+            0.0
+        } else {
+            self.tokens as f64 * 1e6 / self.us as f64
+        }
+    }
+}
+
+/// Speculative decoding: a small draft model proposes tokens which the target model checks in
+/// one pass. Rejection sampling keeps the output distributed as sampling the target alone.
+/// Without a draft model, the tokens that followed an earlier occurrence of the last few tokens
+/// of the context are proposed instead (prompt lookup)
+pub struct Speculative {
+    handle: binding::minmpt_spec_handle,
+    n_draft: usize,
+}
+
+impl Speculative {
+    pub fn new(options: SpeculativeOptions) -> Result<Self, MinMPTError> {
+        let params = binding::minmpt_spec_params {
+            n_draft: options.n_draft,
+            temperature: options.temperature,
+            seed: options.seed,
+            ngram_min: options.ngram_min,
+            ngram_max: options.ngram_max,
+        };
+        let mut handle: binding::minmpt_spec_handle = null_mut();
+        let err = unsafe { binding::minmpt_spec_create(&params, &mut handle) };
+        if err == binding::MINMPT_OK as i32 {
+            Ok(Speculative {
+                handle,
+                n_draft: options.n_draft,
+            })
+        } else {
+            Err(MinMPTError::from_code(err))
+        }
+    }
+    /// Evaluates `input` in `target` and returns the next 1 to `n_draft + 1` tokens. `target`
+    /// is left holding all but the last token returned, which is the input of the next step.
+    /// `draft` must share the target's vocabulary and is resynced to its tokens as needed;
+    /// without one, the tokens are proposed by prompt lookup
+    pub fn step(
+        &mut self,
+        target: &mut MinMPT,
+        draft: Option<&mut MinMPT>,
+        input: &[u32],
+    ) -> Result<Vec<u32>, MinMPTError> {
+        let mut out = vec![0; self.n_draft + 1];
+        let mut n_out = 0;
+        let err = unsafe {
+            binding::minmpt_spec_step(
+                self.handle,
+                target.handle,
+                draft.map_or(null_mut(), |d| d.handle),
+                input.as_ptr(),
+                input.len(),
+                out.as_mut_ptr(),
+                &mut n_out,
+            )
+        };
+        if err == binding::MINMPT_OK as i32 {
+            out.truncate(n_out);
+            Ok(out)
+        } else {
+            Err(MinMPTError::from_code(err))
+        }
+    }
+    pub fn stats(&self) -> SpeculativeStats {
+        let mut stats: binding::minmpt_spec_stats = unsafe { std::mem::zeroed() };
+        unsafe { binding::minmpt_spec_get_stats(self.handle, &mut stats) }
+        SpeculativeStats {
+            rounds: stats.n_rounds,
+            drafted: stats.n_drafted,
+            accepted: stats.n_accepted,
+            tokens: stats.n_tokens,
+            us: stats.t_us,
+        }
+    }
+}
+
+impl Drop for Speculative {
+    fn drop(&mut self) {
+        if !self.handle.is_null() {
+            unsafe { binding::minmpt_spec_free(self.handle) }
+        }
+    }
+}
+
+/// Width, length and scoring of a [`BeamSearch`]
+#[derive(Debug, Clone, Copy)]
+pub struct BeamOptions {
+    pub n_beams: usize,
+    /// Most tokens generated per beam
+    pub max_tokens: usize,
+    /// Ends a beam, which is set aside as finished
+    pub eos_token: u32,
+    /// Finished beams rank by log probability / n_tokens^length_penalty
+    pub length_penalty: f32,
+}
+
+impl Default for BeamOptions {
+    fn default() -> Self {
+        let params = unsafe { binding::minmpt_beam_default_params() };
+        BeamOptions {
+            n_beams: params.n_beams,
+            max_tokens: params.max_tokens,
+            eos_token: params.eos_token,
+            length_penalty: params.length_penalty,
+        }
+    }
+}
+
+/// Beam search over forks of a model. Every step evaluates all live beams in one batch, and
+/// beams left without an extension free their kv cache right away. With a paged kv cache the
+/// beams share the blocks of their common prefix
+pub struct BeamSearch<'a> {
+    handle: binding::minmpt_beam_handle,
+    _base: std::marker::PhantomData<&'a MinMPT>,
+}
+
+impl<'a> BeamSearch<'a> {
+    /// Beams continue the context of `base` with `prompt`
+    pub fn new(
+        base: &'a MinMPT,
+        prompt: &[u32],
+        options: BeamOptions,
+    ) -> Result<Self, MinMPTError> {
+        let params = binding::minmpt_beam_params {
+            n_beams: options.n_beams,
+            max_tokens: options.max_tokens,
+            eos_token: options.eos_token,
+            length_penalty: options.length_penalty,
+        };
+        let mut handle: binding::minmpt_beam_handle = null_mut();
+        let err = unsafe {
+            binding::minmpt_beam_create(
+                base.handle,
+                prompt.as_ptr(),
+                prompt.len(),
+                &params,
+                &mut handle,
+            )
+        };
+        if err == binding::MINMPT_OK as i32 {
+            Ok(BeamSearch {
+                handle,
+                _base: std::marker::PhantomData,
+            })
+        } else {
+            Err(MinMPTError::from_code(err))
+        }
+    }
+    /// Runs one step and returns the number of live beams, 0 once the search is done
+    pub fn step(&mut self) -> Result<usize, MinMPTError> {
+        let mut n_live = 0;
+        let err = unsafe { binding::minmpt_beam_step(self.handle, &mut n_live) };
+        if err == binding::MINMPT_OK as i32 {
+            Ok(n_live)
+        } else {
+            Err(MinMPTError::from_code(err))
+        }
+    }
+    /// Steps until the search is done and returns the finished beams with their scores, best
+    /// first
+    pub fn run(&mut self) -> Result<Vec<(Vec<u32>, f32)>, MinMPTError> {
+        while self.step()? > 0 {}
+        Ok(self.results())
+    }
+    /// The beams finished so far, best first, without eos
+    pub fn results(&self) -> Vec<(Vec<u32>, f32)> {
+        let n = unsafe { binding::minmpt_beam_n_results(self.handle) };
+        (0..n)
+            .map(|i| {
+                let mut tokens: *const u32 = std::ptr::null();
+                let mut n_tokens = 0;
+                let mut score = 0.0;
+                unsafe {
+                    binding::minmpt_beam_result(
+                        self.handle,
+                        i,
+                        &mut tokens,
+                        &mut n_tokens,
+                        &mut score,
+                    );
+                }
+                // a beam that ends at once has no tokens, and maybe a null pointer
+                if n_tokens == 0 {
+                    return (Vec::new(), score);
+                }
+                let tokens = unsafe { std::slice::from_raw_parts(tokens, n_tokens) };
+                (tokens.to_vec(), score)
+            })
+            .collect()
+    }
+}
+
+impl Drop for BeamSearch<'_> {
+    fn drop(&mut self) {
+        if !self.handle.is_null() {
+            unsafe { binding::minmpt_beam_free(self.handle) }
+        }
+    }
+}
+
+/// The chain of a [`NativeSampler`]: repetition penalty, temperature, then mirostat or top-k,
+/// min-p and top-p
+#[derive(Debug, Clone, Copy)]
+pub struct SamplerOptions {
+    /// 0 for greedy
+    pub temperature: f32,
+    /// 0 keeps every token
+    pub top_k: usize,
+    /// Smallest set of tokens whose probability reaches top_p, 1 keeps all
+    pub top_p: f32,
+    /// Drops tokens less likely than min_p times the top token, 0 keeps all
+    pub min_p: f32,
+    /// Divides positive logits and multiplies negative ones of the tokens among the last
+    /// `repeat_last_n` of the context, 1 is off
+    pub repeat_penalty: f32,
+    pub repeat_last_n: usize,
+    /// Mirostat (v1) in place of top-k, min-p and top-p, with its target surprise in bits and
+    /// learning rate
+    pub mirostat: bool,
+    pub mirostat_tau: f32,
+    pub mirostat_eta: f32,
+    /// 0 for a random seed
+    pub seed: u64,
+}
+
+impl Default for SamplerOptions {
+    fn default() -> Self {
+        let params = unsafe { binding::minmpt_sampler_default_params() };
+        SamplerOptions {
+            temperature: params.temperature,
+            top_k: params.top_k,
+            top_p: params.top_p,
+            min_p: params.min_p,
+            repeat_penalty: params.repeat_penalty,
+            repeat_last_n: params.repeat_last_n,
+            mirostat: params.mirostat != 0,
+            mirostat_tau: params.mirostat_tau,
+            mirostat_eta: params.mirostat_eta,
+            seed: params.seed,
+        }
+    }
+}
+
+/// Samples the next token from the logits a model keeps after its last eval, inside the
+/// library, so only the token crosses over. Pair it with `MinMPT::feed`. Mirostat's state lives
+/// in the sampler, so use one per stream
+pub struct NativeSampler {
+    handle: binding::minmpt_sampler_handle,
+}
+
+impl NativeSampler {
+    pub fn new(options: SamplerOptions) -> Result<Self, MinMPTError> {
+        let params = binding::minmpt_sampler_params {
+            temperature: options.temperature,
+            top_k: options.top_k,
+            top_p: options.top_p,
+            min_p: options.min_p,
+            repeat_penalty: options.repeat_penalty,
+            repeat_last_n: options.repeat_last_n,
+            mirostat: options.mirostat as i32,
+            mirostat_tau: options.mirostat_tau,
+            mirostat_eta: options.mirostat_eta,
+            seed: options.seed,
+        };
+        let mut handle: binding::minmpt_sampler_handle = null_mut();
+        let err = unsafe { binding::minmpt_sampler_create(&params, &mut handle) };
+        if err == binding::MINMPT_OK as i32 {
+            Ok(NativeSampler { handle })
+        } else {
+            Err(MinMPTError::from_code(err))
+        }
+    }
+    /// Samples the token following `model`'s context. The token is not evaluated
+    pub fn sample(&mut self, model: &MinMPT) -> Result<u32, MinMPTError> {
+        let mut token = 0;
+        let err = unsafe {
+            binding::minmpt_sample_next(
+                model.handle,
+                self.handle,
+                &mut token,
+                null_mut(),
+                0,
+                null_mut(),
+                null_mut(),
+            )
+        };
+        if err == binding::MINMPT_OK as i32 {
+            Ok(token)
+        } else {
+            Err(MinMPTError::from_code(err))
+        }
+    }
+    /// Like `sample`, also returning the token's log probability under the model and the
+    /// model's `n_top` most likely tokens with theirs, most likely first
+    pub fn sample_with_logprobs(
+        &mut self,
+        model: &MinMPT,
+        n_top: usize,
+    ) -> Result<(u32, f32, Vec<(u32, f32)>), MinMPTError> {
+        let mut token = 0;
+        let mut logprob = 0.0;
+        let n_top = n_top.min(model.n_vocab());
+        let mut top_tokens = vec![0; n_top];
+        let mut top_logprobs = vec![0.0; n_top];
+        let err = unsafe {
+            binding::minmpt_sample_next(
+                model.handle,
+                self.handle,
+                &mut token,
+                &mut logprob,
+                n_top,
+                top_tokens.as_mut_ptr(),
+                top_logprobs.as_mut_ptr(),
+            )
+        };
+        if err == binding::MINMPT_OK as i32 {
+            let top = top_tokens.into_iter().zip(top_logprobs).collect();
+            Ok((token, logprob, top))
+        } else {
+            Err(MinMPTError::from_code(err))
+        }
+    }
+}
+
+impl Drop for NativeSampler {
+    fn drop(&mut self) {
+        if !self.handle.is_null() {
+            unsafe { binding::minmpt_sampler_free(self.handle) }
+        }
+    }
+}
+
 impl Drop for MinMPT {
     fn drop(&mut self) {
         if !self.handle.is_null() {
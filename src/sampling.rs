@@ -1,4 +1,5 @@
-use rand::{prelude::Distribution, Rng};
+use rand::Rng;
+use std::cmp::Ordering;
 use std::f32::consts::TAU;
 
 pub fn apply_cfg(cfg_scale: f32, pos_logits: &[f32], neg_logits: &[f32]) -> Vec<f32> {
@@ -13,74 +14,175 @@ pub trait Sampler<R: Rng> {
     fn sample(&mut self, raw_logits: &[f32], rng: &mut R) -> usize;
 }
 
-struct Candidate {
-    logit: f32,
-    p: f32,
-    token: usize,
-}
+// the reductions keep 8 independent lanes so they vectorize
+const LANES: usize = 8;
 
-fn sorted_softmax(raw_logits: &[f32]) -> Vec<Candidate> {
-    let ps = softmax(raw_logits);
-    let mut samples: Vec<Candidate> = raw_logits
-        .iter()
-        .enumerate()
-        .map(|(i, l)| Candidate {
-            logit: *l,
-            p: ps[i],
-            token: i,
-        })
-        .collect();
-    samples.sort_by(|sa, sb| sa.logit.partial_cmp(&sb.logit).unwrap());
-    samples
-}
-
-fn softmax_inplace(logits: &mut [f32]) {
-    let lmax = *logits
+#[inline]
+fn max_logit(logits: &[f32]) -> f32 {
+    let mut lanes = [f32::NEG_INFINITY; LANES];
+    let chunks = logits.chunks_exact(LANES);
+    let rest = chunks.remainder();
+    for chunk in chunks {
+        for (m, l) in lanes.iter_mut().zip(chunk) {
+            *m = m.max(*l);
+        }
+    }
+    lanes
         .iter()
-        .max_by(|la, lb| la.partial_cmp(lb).unwrap())
-        .unwrap();
-    // shift max to 0 to avoid overflow
-    logits.iter_mut().for_each(|l| *l = (*l - lmax).exp());
-    let psum: f32 = logits.iter().sum();
-    logits.iter_mut().for_each(|p| *p /= psum);
+        .chain(rest)
+        .fold(f32::NEG_INFINITY, |m, l| m.max(*l))
+}
+
+#[inline]
+fn sum(xs: &[f32]) -> f32 {
+    let mut lanes = [0.0; LANES];
+    let chunks = xs.chunks_exact(LANES);
+    let rest = chunks.remainder();
+    for chunk in chunks {
+        for (s, x) in lanes.iter_mut().zip(chunk) {
+            *s += x;
+        }
+    }
+    lanes.iter().sum::<f32>() + rest.iter().sum::<f32>()
+}
+
+/// exp(x) for x <= 0, as plain arithmetic the compiler can vectorize, unlike calls to `exp`.
+/// 2^(x log2(e)) is split into a power of two, written into the exponent bits, and a
+/// polynomial for the fraction, good to about 4e-6 relative. Below about -87.7, where e^x is no
+/// longer a normal f32, the power of two is 0, so masked tokens at -inf get no weight
+#[inline]
+fn exp_neg(x: f32) -> f32 {
+    // adding and subtracting 1.5 * 2^23 rounds to the nearest integer
+    const ROUND: f32 = 12582912.0;
+    let t = x.max(-88.0) * std::f32::consts::LOG2_E;
+    let n = (t + ROUND) - ROUND;
+    let f = t - n;
+    // 2^f = e^(f ln 2), taylor series on [-0.5, 0.5]
+    let p = 1.0
+        + f * (0.693_147_2
+            + f * (0.240_226_5
+                + f * (0.055_504_11
+                    + f * (0.009_618_129
+                        + f * (0.001_333_355_8 + f * (0.000_154_035_3 + f * 0.000_015_252_73))))));
+    // an exponent of 0 or less is written as 0 bits, which is 0.0
+    p * f32::from_bits(((n as i32 + 127).max(0) << 23) as u32)
 }
 
-fn softmax(logits: &[f32]) -> Vec<f32> {
-    let mut out = Vec::from(logits);
-    softmax_inplace(&mut out);
-    out
+// orders token ids by descending logit
+fn by_logit(logits: &[f32]) -> impl Fn(&u32, &u32) -> Ordering + '_ {
+    move |a, b| {
+        logits[*b as usize]
+            .partial_cmp(&logits[*a as usize])
+            .unwrap_or(Ordering::Equal)
+    }
+}
+
+/// Samples an index of `weights`, which need not sum to 1. The running sum skips a block of
+/// weights at a time and only walks the block the sample falls in
+fn sample_weighted<R: Rng>(weights: &[f32], rng: &mut R) -> usize {
+    const BLOCK: usize = 256;
+    let mut u = rng.gen::<f32>() * sum(weights);
+    let mut base = 0;
+    for block in weights.chunks(BLOCK) {
+        let block_sum = sum(block);
+        if u < block_sum {
+            for (i, w) in block.iter().enumerate() {
+                if u < *w {
+                    return base + i;
+                }
+                u -= w;
+            }
+            break;
+        }
+        u -= block_sum;
+        base += block.len();
+    }
+    // rounding can leave u past the last weight
+    weights.iter().rposition(|w| *w > 0.0).unwrap_or(0)
+}
+
+/// Puts the `k` tokens with the largest logits in `tokens`, in no order. One pass collects the
+/// tokens above the k-th largest logit seen so far, and `select_nth_unstable` cuts the buffer
+/// back to k whenever it fills
+fn top_k(logits: &[f32], k: usize, tokens: &mut Vec<u32>) {
+    let cap = (2 * k).max(256);
+    let mut threshold = f32::NEG_INFINITY;
+    tokens.clear();
+    for (i, l) in logits.iter().enumerate() {
+        if *l > threshold {
+            tokens.push(i as u32);
+            if tokens.len() == cap {
+                tokens.select_nth_unstable_by(k - 1, by_logit(logits));
+                tokens.truncate(k);
+                threshold = logits[tokens[k - 1] as usize];
+            }
+        }
+    }
+    if tokens.len() > k {
+        tokens.select_nth_unstable_by(k - 1, by_logit(logits));
+        tokens.truncate(k);
+    }
 }
 
+/// Samples softmax(logits / temperature), from only the `top_k` most likely tokens if set. The
+/// buffers are kept from token to token, so sampling does not allocate once they have grown
 #[derive(Debug, Default)]
 pub struct BasicSampler {
-    pub temperature: Option<f32>,
+    temperature: Option<f32>,
+    top_k: Option<usize>,
+    weights: Vec<f32>,
+    tokens: Vec<u32>,
+}
+
+impl BasicSampler {
+    pub fn new() -> Self {
+        Self::default()
+    }
+    /// 0 for greedy
+    pub fn temperature(self, temperature: Option<f32>) -> Self {
+        Self {
+            temperature,
+            ..self
+        }
+    }
+    pub fn top_k(self, top_k: Option<usize>) -> Self {
+        Self { top_k, ..self }
+    }
 }
+
 impl<R: Rng> Sampler<R> for BasicSampler {
     fn sample(&mut self, raw_logits: &[f32], rng: &mut R) -> usize {
         if self.temperature == Some(0.) {
             return greedy(raw_logits);
         }
-        let probs = if let Some(temp) = self.temperature {
-            let mut templogits: Vec<f32> = raw_logits.iter().map(|l| *l / temp).collect();
-            softmax_inplace(&mut templogits);
-            templogits
-        } else {
-            softmax(raw_logits)
-        };
-        let dist = rand::distributions::WeightedIndex::new(probs)
-            .expect("create probability distribution");
-        dist.sample(rng)
+        let inv_temp = 1.0 / self.temperature.unwrap_or(1.0);
+        let lmax = max_logit(raw_logits);
+        let weight = |l: f32| exp_neg((l - lmax) * inv_temp);
+        self.weights.clear();
+        match self.top_k {
+            Some(k) if k > 0 && k < raw_logits.len() => {
+                top_k(raw_logits, k, &mut self.tokens);
+                self.weights
+                    .extend(self.tokens.iter().map(|t| weight(raw_logits[*t as usize])));
+                self.tokens[sample_weighted(&self.weights, rng)] as usize
+            }
+            _ => {
+                self.weights.extend(raw_logits.iter().map(|l| weight(*l)));
+                sample_weighted(&self.weights, rng)
+            }
+        }
     }
 }
 
-fn estimate_surprise(orig: &[Candidate], m: usize) -> f32 {
-    let end = (m - 1).min(orig.len() - 1);
+/// Fits the exponent of a Zipf distribution to the probabilities of the tokens in `top`, most
+/// likely first
+fn estimate_surprise(probs: &[f32], top: &[u32]) -> f32 {
     let mut num = 0.;
     let mut den = 0.;
-    for i in 0..end {
+    for (i, pair) in top.windows(2).enumerate() {
         let fi = i as f32;
         let ti = ((fi + 2.) / (fi + 1.)).log10();
-        let bi = (orig[i].p / orig[i + 1].p).log10();
+        let bi = (probs[pair[0] as usize] / probs[pair[1] as usize]).log10();
         num += ti * bi;
         den += ti * ti;
     }
@@ -93,6 +195,9 @@ pub struct Mirostat {
     max_surprise: f32,
     target_surprise: f32,
     m: usize, // # of tokens for surprise estimate
+    probs: Vec<f32>,
+    weights: Vec<f32>,
+    tokens: Vec<u32>,
 }
 
 impl Mirostat {
@@ -102,6 +207,9 @@ impl Mirostat {
             target_surprise: TAU,
             max_surprise: 2.0 * TAU,
             m: 100,
+            probs: Vec::new(),
+            weights: Vec::new(),
+            tokens: Vec::new(),
         }
     }
     pub fn lr(self, lr: f32) -> Self {
@@ -124,35 +232,45 @@ impl Default for Mirostat {
 
 impl<R: Rng> Sampler<R> for Mirostat {
     fn sample(&mut self, raw_logits: &[f32], rng: &mut R) -> usize {
-        let mut cands = sorted_softmax(raw_logits);
-        let n_cand = cands.len() as f32;
-        let surp = estimate_surprise(&cands, self.m);
+        let n = raw_logits.len();
+        let lmax = max_logit(raw_logits);
+        self.probs.clear();
+        self.probs
+            .extend(raw_logits.iter().map(|l| exp_neg(l - lmax)));
+        let inv_sum = 1.0 / sum(&self.probs);
+        self.probs.iter_mut().for_each(|p| *p *= inv_sum);
+
+        // only the top m tokens are sorted, for the estimate
+        let m = self.m.min(n);
+        top_k(raw_logits, m, &mut self.tokens);
+        self.tokens.sort_unstable_by(by_logit(raw_logits));
+        let surp = estimate_surprise(&self.probs, &self.tokens);
         let eps = surp - 1.;
-        let k =
-            ((eps * (2.0_f32.powf(self.max_surprise))) / (1. - n_cand.powf(-eps))).powf(1.0 / surp);
-        let k = (k.round() + 1.) as usize;
-        cands.shrink_to(k);
-        let mut p_logits: Vec<f32> = cands.iter().map(|c| c.logit).collect();
-        let probs = {
-            softmax_inplace(&mut p_logits);
-            p_logits
+        let k = ((eps * (2.0_f32.powf(self.max_surprise))) / (1. - (n as f32).powf(-eps)))
+            .powf(1.0 / surp);
+        // a failed estimate keeps every token
+        let k = match (k.round() + 1.) as usize {
+            0 => n,
+            k => k.min(n),
         };
-        let dist = rand::distributions::WeightedIndex::new(probs)
-            .expect("create probability distribution");
-        let pidx = dist.sample(rng);
-        let isurp = cands[pidx].p.recip().log2();
+        if k > m {
+            top_k(raw_logits, k, &mut self.tokens);
+        }
+        self.tokens.truncate(k);
+
+        self.weights.clear();
+        self.weights
+            .extend(self.tokens.iter().map(|t| self.probs[*t as usize]));
+        let token = self.tokens[sample_weighted(&self.weights, rng)] as usize;
+        let isurp = self.probs[token].recip().log2();
         let error_surprise = isurp - self.target_surprise;
         self.max_surprise -= self.lr * error_surprise;
-        cands[pidx].token
+        token
     }
 }
 
 pub fn greedy(logits: &[f32]) -> usize {
     assert!(!logits.is_empty());
-    let (i, _v) = logits
-        .iter()
-        .enumerate()
-        .max_by(|(_, va), (_, vb)| va.partial_cmp(vb).unwrap())
-        .unwrap();
-    i
+    let lmax = max_logit(logits);
+    logits.iter().position(|l| *l == lmax).unwrap_or(0)
 }